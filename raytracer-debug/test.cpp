@@ -99,3 +99,73 @@ TEST_CASE("Deer", "[raytracer]") {
     render_opts.mode = RenderMode::kNormal;
     CheckImage("deer/CERF_Free.obj", "deer/normal.png", camera_opts, render_opts);
 }
+
+TEST_CASE("Crop window", "[raytracer]") {
+    CameraOptions camera_opts(640, 480, M_PI / 3);
+    camera_opts.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    camera_opts.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    RenderOptions render_opts{4, RenderMode::kNormal};
+    const auto filename = kBasePath + "tests/box/cube.obj";
+
+    camera_opts.crop = CropWindow{250, 100, 120, 90};
+    auto crop = Render(filename, camera_opts, render_opts);
+    REQUIRE(crop.Width() == 120);
+    REQUIRE(crop.Height() == 90);
+
+    Image composite(kBasePath + "tests/box/normal.png");
+    Image blank(120, 90);
+    composite.Paste(blank, 250, 100);
+    RenderInto(composite, filename, camera_opts, render_opts);
+    Compare(composite, Image(kBasePath + "tests/box/normal.png"));
+
+    // Depth crops are shaded against the farthest hit of the frame they are pasted into.
+    render_opts.mode = RenderMode::kDepth;
+    REQUIRE_THROWS_AS(RenderInto(composite, filename, camera_opts, render_opts),
+                      std::invalid_argument);
+    auto frame_opts = camera_opts;
+    frame_opts.crop.reset();
+    Image depth(kBasePath + "tests/box/depth.png");
+    depth.Paste(blank, 250, 100);
+    RenderInto(depth, filename, camera_opts, render_opts,
+               GetFrameScale(RenderAovs(filename, frame_opts, render_opts, {Aov::kDepth})));
+    Compare(depth, Image(kBasePath + "tests/box/depth.png"));
+
+    Image expected(kBasePath + "tests/box/normal.png");
+    int matches = 0;
+    for (int y = 0; y != crop.Height(); ++y) {
+        for (int x = 0; x != crop.Width(); ++x) {
+            matches += PixelDistance(crop.GetPixel(y, x), expected.GetPixel(100 + y, 250 + x)) < 2;
+        }
+    }
+    REQUIRE(matches >= 0.99 * crop.Width() * crop.Height());
+}
+
+TEST_CASE("Single pass AOVs", "[raytracer]") {
+    CameraOptions camera_opts(500, 500);
+    camera_opts.look_from = std::array<double, 3>{-0.5, 1.5, 0.98};
+    camera_opts.look_to = std::array<double, 3>{0.0, 1.0, 0.0};
+    RenderOptions render_opts{4};
+    const auto filename = kBasePath + "tests/classic_box/CornellBox-Original.obj";
+    const auto scene = ReadScene(filename);
+    auto aovs = RenderAovs(scene, camera_opts, render_opts,
+                           {Aov::kBeauty, Aov::kDepth, Aov::kNormal, Aov::kMaterialIndex,
+                            Aov::kObjectIndex});
+
+    Compare(*aovs.beauty, Render(filename, camera_opts, render_opts));
+    Compare(*aovs.depth, Image(kBasePath + "tests/classic_box/depth1.png"));
+    Compare(*aovs.normal, Image(kBasePath + "tests/classic_box/normal1.png"));
+
+    const size_t pixels = 500 * 500;
+    REQUIRE(aovs.distance.size() == pixels);
+    REQUIRE(aovs.material_index.size() == pixels);
+    REQUIRE(aovs.object_index.size() == pixels);
+    const int objects = scene.GetObjects().size() + scene.GetSphereObjects().size();
+    size_t inconsistent = 0;
+    for (size_t i = 0; i != pixels; ++i) {
+        bool hit = aovs.object_index[i] >= 0;
+        inconsistent += (aovs.distance[i] >= 0) != hit || (aovs.material_index[i] >= 0) != hit ||
+                        aovs.material_index[i] >= static_cast<int>(scene.GetMaterials().Size()) ||
+                        aovs.object_index[i] >= objects;
+    }
+    REQUIRE(inconsistent == 0);
+}
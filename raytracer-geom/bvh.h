@@ -0,0 +1,324 @@
+#pragma once
+
+#include <vector.h>
+#include <memory_accounting.h>
+#include <triangle.h>
+#include <sphere.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+struct Aabb {
+    Vector min{std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+               std::numeric_limits<double>::infinity()};
+    Vector max{-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+               -std::numeric_limits<double>::infinity()};
+
+    void Extend(const Vector& point) {
+        for (size_t k = 0; k != 3; ++k) {
+            min[k] = std::min(min[k], point[k]);
+            max[k] = std::max(max[k], point[k]);
+        }
+    }
+
+    void Extend(const Aabb& box) {
+        for (size_t k = 0; k != 3; ++k) {
+            min[k] = std::min(min[k], box.min[k]);
+            max[k] = std::max(max[k], box.max[k]);
+        }
+    }
+
+    // Grows the box by a margin proportional to its coordinates, so that rounding in the
+    // slab test never rejects a ray that the exact primitive test accepts.
+    void Pad() {
+        for (size_t k = 0; k != 3; ++k) {
+            double margin = 1e-9 * (1 + std::max(std::fabs(min[k]), std::fabs(max[k])));
+            min[k] -= margin;
+            max[k] += margin;
+        }
+    }
+
+    Vector Center() const {
+        return 0.5 * (min + max);
+    }
+
+    double SurfaceArea() const {
+        if (min[0] > max[0]) {
+            return 0;
+        }
+        Vector size = max - min;
+        return 2 * (size[0] * size[1] + size[1] * size[2] + size[2] * size[0]);
+    }
+
+    // Slab test of the ray segment [0, max_t]; inv_direction holds 1 / direction per axis.
+    bool Hit(const Vector& origin, const Vector& inv_direction, double max_t) const {
+        return Entry(origin, inv_direction, max_t) != std::numeric_limits<double>::infinity();
+    }
+
+    // Ray parameter where the segment [0, max_t] enters the box, infinity if it misses it.
+    double Entry(const Vector& origin, const Vector& inv_direction, double max_t) const {
+        double t_near = 0;
+        double t_far = max_t;
+        for (size_t k = 0; k != 3; ++k) {
+            double t0 = (min[k] - origin[k]) * inv_direction[k];
+            double t1 = (max[k] - origin[k]) * inv_direction[k];
+            if (t0 > t1) {
+                std::swap(t0, t1);
+            }
+            t_near = std::max(t_near, t0);
+            t_far = std::min(t_far, t1);
+        }
+        return t_near <= t_far ? t_near : std::numeric_limits<double>::infinity();
+    }
+};
+
+inline Aabb GetBounds(const Triangle& triangle) {
+    Aabb box;
+    for (size_t i = 0; i != 3; ++i) {
+        box.Extend(triangle[i]);
+    }
+    box.Pad();
+    return box;
+}
+
+inline Aabb GetBounds(const Sphere& sphere) {
+    Vector radius{sphere.GetRadius(), sphere.GetRadius(), sphere.GetRadius()};
+    Aabb box{sphere.GetCenter() - radius, sphere.GetCenter() + radius};
+    box.Pad();
+    return box;
+}
+
+// 63-bit key of a point along a Morton curve through bounds, 21 bits per axis; sorting by it
+// keeps points that are close in space mostly close in order.
+inline uint64_t MortonCode(const Vector& point, const Aabb& bounds) {
+    uint64_t code = 0;
+    uint64_t cell[3];
+    for (size_t k = 0; k != 3; ++k) {
+        double extent = bounds.max[k] - bounds.min[k];
+        double unit = extent > 0 ? (point[k] - bounds.min[k]) / extent : 0;
+        cell[k] = std::min<uint64_t>(unit * (1 << 21), (1 << 21) - 1);
+    }
+    for (int bit = 20; bit >= 0; --bit) {
+        for (size_t k = 0; k != 3; ++k) {
+            code = code << 1 | ((cell[k] >> bit) & 1);
+        }
+    }
+    return code;
+}
+
+// Bounding volume hierarchy over a set of primitive boxes, built by median splits. Nodes are
+// stored in depth-first order: the left child of node i is i + 1 and the right child is
+// nodes[i].first. A leaf covers Order()[first, first + count), so the caller can keep
+// per-primitive data in the same order and scan each leaf as a contiguous range.
+class Bvh {
+public:
+    struct Node {
+        Aabb bounds;
+        uint32_t first = 0;
+        uint32_t count = 0;
+        uint32_t axis = 0;
+    };
+
+    static constexpr double kTraversalCost = 1;
+    static constexpr double kIntersectionCost = 1;
+
+    void Build(const std::vector<Aabb>& boxes, size_t max_leaf_size = 4) {
+        nodes_.clear();
+        order_.resize(boxes.size());
+        std::iota(order_.begin(), order_.end(), 0);
+        if (!boxes.empty()) {
+            nodes_.reserve(2 * boxes.size() / std::max<size_t>(max_leaf_size, 1) + 1);
+            BuildNode(boxes, 0, boxes.size(), std::max<size_t>(max_leaf_size, 1));
+        }
+        memory_.Set(nodes_.capacity() * sizeof(Node) + order_.capacity() * sizeof(uint32_t));
+    }
+
+    // Recomputes every node box for moved primitives in O(N), keeping the topology. Children
+    // follow their parent in depth-first order, so one backward pass suffices.
+    void Refit(const std::vector<Aabb>& boxes) {
+        for (size_t i = nodes_.size(); i-- != 0;) {
+            auto& node = nodes_[i];
+            node.bounds = Aabb();
+            if (node.count) {
+                for (uint32_t k = node.first; k != node.first + node.count; ++k) {
+                    node.bounds.Extend(boxes[order_[k]]);
+                }
+            } else {
+                node.bounds.Extend(nodes_[i + 1].bounds);
+                node.bounds.Extend(nodes_[node.first].bounds);
+            }
+        }
+    }
+
+    // Surface area heuristic estimate of the cost of tracing a random ray, relative to the
+    // root box. It only grows as refits make boxes overlap, so it tells when to rebuild.
+    double Cost() const {
+        if (nodes_.empty() || nodes_[0].bounds.SurfaceArea() == 0) {
+            return 0;
+        }
+        double cost = 0;
+        for (const auto& node : nodes_) {
+            cost += node.bounds.SurfaceArea() *
+                    (node.count ? node.count * kIntersectionCost : kTraversalCost);
+        }
+        return cost / nodes_[0].bounds.SurfaceArea();
+    }
+
+    const std::vector<Node>& Nodes() const {
+        return nodes_;
+    }
+
+    const std::vector<uint32_t>& Order() const {
+        return order_;
+    }
+
+    // Calls visit(first, count) for every leaf whose box the ray hits within [0, max_t],
+    // nearer children first. visit may lower max_t (it is re-read after every leaf) and
+    // returns true to stop the traversal. If steps is given, it is increased by the number of
+    // nodes whose boxes were tested.
+    template <class F>
+    void Traverse(const Vector& origin, const Vector& direction, const double& max_t,
+                  F&& visit, size_t* steps = nullptr) const {
+        if (nodes_.empty()) {
+            return;
+        }
+        Vector inv_direction{1 / direction[0], 1 / direction[1], 1 / direction[2]};
+        uint32_t stack[64];
+        size_t size = 0;
+        stack[size++] = 0;
+        while (size) {
+            uint32_t index = stack[--size];
+            const auto& node = nodes_[index];
+            if (steps) {
+                ++*steps;
+            }
+            if (!node.bounds.Hit(origin, inv_direction, max_t)) {
+                continue;
+            }
+            if (node.count) {
+                if (visit(node.first, node.count)) {
+                    return;
+                }
+                continue;
+            }
+            if (direction[node.axis] < 0) {
+                stack[size++] = index + 1;
+                stack[size++] = node.first;
+            } else {
+                stack[size++] = node.first;
+                stack[size++] = index + 1;
+            }
+        }
+    }
+
+    // Traverse for a packet of coherent rays, e.g. shadow rays of neighbouring points towards
+    // one light. An inner node is opened for all the rays after the first one that hits its
+    // box, so a coherent packet usually pays a single box test per node; the rays are filtered
+    // exactly at the leaves only. visit(first, count, rays, size) gets the indices of the rays
+    // that hit a leaf; it may lower their max_t, and a negative max_t drops a ray from the rest
+    // of the traversal. Children are ordered by the direction of the first ray that hits them.
+    // If steps is given, it is increased by the number of ray-box tests.
+    template <class F>
+    void TraversePacket(const std::vector<Vector>& origins, const std::vector<Vector>& directions,
+                        const std::vector<double>& max_t, F&& visit,
+                        size_t* steps = nullptr) const {
+        if (nodes_.empty() || origins.empty()) {
+            return;
+        }
+        std::vector<Vector> inv_directions;
+        inv_directions.reserve(directions.size());
+        for (const auto& direction : directions) {
+            inv_directions.push_back({1 / direction[0], 1 / direction[1], 1 / direction[2]});
+        }
+        // Inner nodes only drop rays from the front of the packet, so a stack entry holds a node
+        // and the first ray of order that may hit it. The rays of a leaf are gathered after the
+        // end of the packet.
+        std::vector<uint32_t> order(origins.size());
+        std::iota(order.begin(), order.end(), 0);
+        const uint32_t end = order.size();
+        std::pair<uint32_t, uint32_t> stack[64];
+        size_t size = 0;
+        stack[size++] = {0, 0};
+        while (size) {
+            auto [index, begin] = stack[--size];
+            const auto& node = nodes_[index];
+            auto hits = [&](uint32_t r) {
+                if (steps) {
+                    ++*steps;
+                }
+                return node.bounds.Hit(origins[r], inv_directions[r], max_t[r]);
+            };
+            if (node.count) {
+                order.resize(end);
+                for (uint32_t i = begin; i != end; ++i) {
+                    if (hits(order[i])) {
+                        order.push_back(order[i]);
+                    }
+                }
+                if (order.size() != end) {
+                    visit(node.first, node.count, order.data() + end, order.size() - end);
+                }
+                continue;
+            }
+            while (begin != end && !hits(order[begin])) {
+                ++begin;
+            }
+            if (begin == end) {
+                continue;
+            }
+            if (directions[order[begin]][node.axis] < 0) {
+                stack[size++] = {index + 1, begin};
+                stack[size++] = {node.first, begin};
+            } else {
+                stack[size++] = {node.first, begin};
+                stack[size++] = {index + 1, begin};
+            }
+        }
+    }
+
+private:
+    uint32_t BuildNode(const std::vector<Aabb>& boxes, size_t begin, size_t end,
+                       size_t max_leaf_size) {
+        uint32_t index = nodes_.size();
+        nodes_.emplace_back();
+        Aabb bounds;
+        Aabb centers;
+        for (size_t i = begin; i != end; ++i) {
+            bounds.Extend(boxes[order_[i]]);
+            centers.Extend(boxes[order_[i]].Center());
+        }
+        nodes_[index].bounds = bounds;
+        if (end - begin <= max_leaf_size) {
+            nodes_[index].first = begin;
+            nodes_[index].count = end - begin;
+            return index;
+        }
+
+        Vector extent = centers.max - centers.min;
+        uint32_t axis = 0;
+        if (extent[1] > extent[axis]) {
+            axis = 1;
+        }
+        if (extent[2] > extent[axis]) {
+            axis = 2;
+        }
+        size_t middle = begin + (end - begin) / 2;
+        std::nth_element(order_.begin() + begin, order_.begin() + middle, order_.begin() + end,
+                         [&boxes, axis](uint32_t lhs, uint32_t rhs) {
+                             return boxes[lhs].Center()[axis] < boxes[rhs].Center()[axis];
+                         });
+        BuildNode(boxes, begin, middle, max_leaf_size);
+        uint32_t right = BuildNode(boxes, middle, end, max_leaf_size);
+        nodes_[index].first = right;
+        nodes_[index].axis = axis;
+        return index;
+    }
+
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> order_;
+    TrackedBytes memory_{MemoryCategory::kAcceleration};
+};
@@ -3,52 +3,30 @@
 #include <intersection.h>
 #include <triangle.h>
 #include <ray.h>
+#include <sphere_batch.h>
 #include <math.h>
 
 #include <optional>
 
 constexpr double kEps = 1e-9;
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
-    Vector l = sphere.GetCenter() - ray.GetOrigin();
-    double tc = DotProduct(l, ray.GetDirection());
-
-    if (tc < 0.0) {
-        return std::nullopt;
-    }
-
-    double d2 = Length(l) * Length(l) - tc * tc;
-
-    double radius2 = sphere.GetRadius() * sphere.GetRadius();
+// Builds the hit record for a ray parameter returned by IntersectSphere. The normal faces the
+// ray origin, and |p - c| == r on the surface, so dividing by the radius normalizes it.
+Intersection MakeSphereIntersection(const Ray& ray, const Sphere& sphere, double t) {
+    auto position = ray.GetOrigin() + t * ray.GetDirection();
+    Vector to_origin(sphere.GetCenter(), ray.GetOrigin());
+    bool inside = DotProduct(to_origin, to_origin) < sphere.GetRadius() * sphere.GetRadius();
+    auto normal = (inside ? -1. : 1.) / sphere.GetRadius() * Vector(sphere.GetCenter(), position);
+    return Intersection(position, normal, Length(ray.GetOrigin(), position));
+}
 
-    if (d2 > radius2) {
+std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
+    double t = IntersectSphere(ray.GetOrigin(), ray.GetDirection(), sphere.GetCenter(),
+                               sphere.GetRadius() * sphere.GetRadius());
+    if (t == kNoHit) {
         return std::nullopt;
     }
-
-    // solve for t1c
-    double t1c = sqrt(radius2 - d2);
-
-    // solve for intersection points
-    double t1 = tc - t1c;
-    double t2 = tc + t1c;
-
-    auto position1 = ray.GetOrigin() + t1 * ray.GetDirection();
-    auto position2 = ray.GetOrigin() + t2 * ray.GetDirection();
-    Vector position;
-    if (Length(ray.GetOrigin(), sphere.GetCenter()) < sphere.GetRadius()) {
-        position = DotProduct(ray.GetDirection(), Vector(ray.GetOrigin(), position1)) > 0
-                       ? position1
-                       : position2;
-    } else {
-        position = Length(ray.GetOrigin(), position1) < Length(ray.GetOrigin(), position2)
-                        ? position1
-                        : position2;
-    }
-    auto normal = Length(ray.GetOrigin(), sphere.GetCenter()) < sphere.GetRadius()
-                      ? Vector(position, sphere.GetCenter())
-                      : Vector(sphere.GetCenter(), position);
-    normal.Normalize();
-    return Intersection(position, normal, Length(Vector(ray.GetOrigin(), position)));
+    return MakeSphereIntersection(ray, sphere, t);
 }
 
 std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <iomanip>
+#include <ostream>
+
+enum class MemoryCategory {
+    // Triangles, plain or compressed, with their handles.
+    kObjects,
+    kSpheres,
+    kMaterials,
+    // Hierarchies and the sphere batch.
+    kAcceleration,
+    // Ray and hit arrays: G-buffers and the waves of the out-of-core renderer.
+    kRays,
+    // Radiance buffers and per-pixel AOV arrays.
+    kFramebuffers,
+    // Pixels of Image.
+    kImages,
+};
+
+constexpr size_t kMemoryCategoryCount = 7;
+
+inline const char* GetMemoryCategoryName(MemoryCategory category) {
+    static const char* const kNames[kMemoryCategoryCount] = {
+        "objects", "spheres", "materials", "acceleration", "rays", "framebuffers", "images"};
+    return kNames[static_cast<size_t>(category)];
+}
+
+struct MemoryUsage {
+    size_t current = 0;
+    size_t peak = 0;
+};
+
+// Bytes held by the renderer's big arrays, per category and in total, with the high-water
+// marks since the last ResetPeaks. Containers report their capacity through TrackedBytes, so
+// the figures are what the arrays hold, not what the allocator adds on top.
+class MemoryAccounting {
+public:
+    void Add(MemoryCategory category, size_t bytes) {
+        auto& slot = slots_[static_cast<size_t>(category)];
+        RaisePeak(slot.peak, slot.current.fetch_add(bytes) + bytes);
+        RaisePeak(total_.peak, total_.current.fetch_add(bytes) + bytes);
+    }
+
+    void Release(MemoryCategory category, size_t bytes) {
+        slots_[static_cast<size_t>(category)].current.fetch_sub(bytes);
+        total_.current.fetch_sub(bytes);
+    }
+
+    MemoryUsage Get(MemoryCategory category) const {
+        const auto& slot = slots_[static_cast<size_t>(category)];
+        return {slot.current.load(), slot.peak.load()};
+    }
+
+    // The peak of the total, which is at most the sum of the category peaks.
+    MemoryUsage Total() const {
+        return {total_.current.load(), total_.peak.load()};
+    }
+
+    // Starts a new measurement: peaks drop to the current values.
+    void ResetPeaks() {
+        for (auto& slot : slots_) {
+            slot.peak = slot.current.load();
+        }
+        total_.peak = total_.current.load();
+    }
+
+    void Print(std::ostream& out) const {
+        out << std::left << std::setw(14) << "memory" << std::right << std::setw(14) << "current"
+            << std::setw(14) << "peak" << "\n";
+        auto line = [&out](const char* name, MemoryUsage usage) {
+            out << std::left << std::setw(14) << name << std::right << std::setw(14)
+                << usage.current << std::setw(14) << usage.peak << "\n";
+        };
+        for (size_t i = 0; i != kMemoryCategoryCount; ++i) {
+            const auto category = static_cast<MemoryCategory>(i);
+            line(GetMemoryCategoryName(category), Get(category));
+        }
+        line("total", Total());
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> current{0};
+        std::atomic<size_t> peak{0};
+    };
+
+    static void RaisePeak(std::atomic<size_t>& peak, size_t value) {
+        size_t seen = peak.load();
+        while (seen < value && !peak.compare_exchange_weak(seen, value)) {
+        }
+    }
+
+    std::array<Slot, kMemoryCategoryCount> slots_;
+    Slot total_;
+};
+
+// Accounting shared by the whole process.
+inline MemoryAccounting& GetMemoryAccounting() {
+    static MemoryAccounting accounting;
+    return accounting;
+}
+
+// Member that charges the bytes of its owner's arrays to a category for as long as the owner
+// lives. Copies charge again, moves hand the bytes over.
+class TrackedBytes {
+public:
+    explicit TrackedBytes(MemoryCategory category) : category_(category) {
+    }
+
+    TrackedBytes(const TrackedBytes& other) : category_(other.category_) {
+        Set(other.bytes_);
+    }
+
+    TrackedBytes(TrackedBytes&& other) noexcept
+        : category_(other.category_), bytes_(other.bytes_) {
+        other.bytes_ = 0;
+    }
+
+    TrackedBytes& operator=(const TrackedBytes& other) {
+        Set(other.bytes_);
+        return *this;
+    }
+
+    TrackedBytes& operator=(TrackedBytes&& other) noexcept {
+        if (this != &other) {
+            Set(0);
+            bytes_ = other.bytes_;
+            other.bytes_ = 0;
+        }
+        return *this;
+    }
+
+    ~TrackedBytes() {
+        Set(0);
+    }
+
+    void Set(size_t bytes) {
+        if (bytes > bytes_) {
+            GetMemoryAccounting().Add(category_, bytes - bytes_);
+        } else if (bytes < bytes_) {
+            GetMemoryAccounting().Release(category_, bytes_ - bytes);
+        }
+        bytes_ = bytes;
+    }
+
+    size_t Get() const {
+        return bytes_;
+    }
+
+private:
+    MemoryCategory category_;
+    size_t bytes_ = 0;
+};
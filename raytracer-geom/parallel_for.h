@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+// Threads kept for the whole process, which ParallelFor borrows instead of starting its own,
+// so loops that run many times per frame cost a queue push rather than thread creation.
+class WorkerThreads {
+public:
+    explicit WorkerThreads(size_t count) {
+        for (size_t i = 0; i != count; ++i) {
+            threads_.emplace_back([this] { Run(); });
+        }
+    }
+
+    WorkerThreads(const WorkerThreads&) = delete;
+    WorkerThreads& operator=(const WorkerThreads&) = delete;
+
+    ~WorkerThreads() {
+        {
+            std::lock_guard lock(mutex_);
+            closing_ = true;
+        }
+        has_task_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    size_t Size() const {
+        return threads_.size();
+    }
+
+    // Runs task on a free thread; tasks wait in order while all of them are busy.
+    void Post(std::function<void()> task) {
+        {
+            std::lock_guard lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        has_task_.notify_one();
+    }
+
+private:
+    void Run() {
+        std::unique_lock lock(mutex_);
+        while (true) {
+            has_task_.wait(lock, [this] { return closing_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                return;
+            }
+            auto task = std::move(tasks_.front());
+            tasks_.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable has_task_;
+    std::deque<std::function<void()>> tasks_;
+    bool closing_ = false;
+    std::vector<std::thread> threads_;
+};
+
+// One thread per hardware thread besides the caller of ParallelFor. A forked child has none
+// of its parent's threads and may have inherited their lock held, so it gets threads of its
+// own; the parent's are left alone and, like the process-wide ones, never torn down.
+inline WorkerThreads& GetWorkerThreads() {
+    struct Instance {
+        pid_t pid;
+        WorkerThreads threads;
+    };
+    static std::atomic<Instance*> current{nullptr};
+    const pid_t pid = getpid();
+    const size_t count = std::max(1u, std::thread::hardware_concurrency()) - 1;
+    auto* instance = current.load();
+    while (!instance || instance->pid != pid) {
+        auto* created = new Instance{pid, WorkerThreads(count)};
+        if (current.compare_exchange_strong(instance, created)) {
+            instance = created;
+        } else {
+            delete created;
+        }
+    }
+    return instance->threads;
+}
+
+// Runs f(i) for i in [0, count) on up to `threads` threads, the calling one included, and
+// rethrows the first exception raised; indices not started by then are skipped. The calling
+// thread claims indices like the borrowed ones do, so a call made while every worker is busy,
+// nested calls included, still completes on its own.
+template <class F>
+void ParallelFor(size_t count, size_t threads, F&& f) {
+    auto& workers = GetWorkerThreads();
+    threads = std::clamp<size_t>(threads, 1, std::min(count, workers.Size() + 1));
+    if (threads <= 1) {
+        for (size_t i = 0; i != count; ++i) {
+            f(i);
+        }
+        return;
+    }
+
+    // Helpers may start after the loop is over, so what they touch is shared; they never
+    // call f then, as every index is claimed.
+    struct State {
+        std::atomic<size_t> next{0};
+        size_t count;
+        std::mutex mutex;
+        std::condition_variable idle;
+        size_t active = 0;
+        std::exception_ptr error;
+    };
+    auto state = std::make_shared<State>();
+    state->count = count;
+    auto run = [&f](State& state) {
+        for (size_t i = state.next++; i < state.count; i = state.next++) {
+            try {
+                f(i);
+            } catch (...) {
+                std::lock_guard lock(state.mutex);
+                if (!state.error) {
+                    state.error = std::current_exception();
+                }
+                state.next = state.count;
+            }
+        }
+    };
+    for (size_t t = 1; t != threads; ++t) {
+        workers.Post([state, &run] {
+            {
+                std::lock_guard lock(state->mutex);
+                if (state->next >= state->count) {
+                    return;
+                }
+                ++state->active;
+            }
+            run(*state);
+            std::lock_guard lock(state->mutex);
+            if (--state->active == 0) {
+                state->idle.notify_all();
+            }
+        });
+    }
+    run(*state);
+    std::unique_lock lock(state->mutex);
+    state->idle.wait(lock, [&state] { return state->active == 0; });
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <vector.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+// Maps points of a box to integer grids of up to 21 bits per axis, packed into one 64-bit
+// word (x in the low bits). A decoded point is at most MaxError() away from the original one.
+class PositionQuantizer {
+public:
+    static constexpr int kMaxBits = 21;
+
+    PositionQuantizer() = default;
+
+    PositionQuantizer(const Vector& min, const Vector& max, int bits = kMaxBits)
+        : min_(min), bits_(bits) {
+        if (bits < 1 || bits > kMaxBits) {
+            throw std::invalid_argument("Position quantization needs 1 to 21 bits per axis");
+        }
+        double levels = (uint64_t{1} << bits) - 1;
+        for (size_t k = 0; k != 3; ++k) {
+            step_[k] = std::max(0.0, max[k] - min[k]) / levels;
+        }
+    }
+
+    uint64_t Encode(const Vector& point) const {
+        const uint64_t max_level = (uint64_t{1} << bits_) - 1;
+        uint64_t code = 0;
+        for (size_t k = 0; k != 3; ++k) {
+            double level = step_[k] > 0 ? std::round((point[k] - min_[k]) / step_[k]) : 0;
+            code |= static_cast<uint64_t>(std::clamp<double>(level, 0, max_level)) << (k * kMaxBits);
+        }
+        return code;
+    }
+
+    Vector Decode(uint64_t code) const {
+        constexpr uint64_t kMask = (uint64_t{1} << kMaxBits) - 1;
+        return {min_[0] + step_[0] * static_cast<double>(code & kMask),
+                min_[1] + step_[1] * static_cast<double>((code >> kMaxBits) & kMask),
+                min_[2] + step_[2] * static_cast<double>((code >> (2 * kMaxBits)) & kMask)};
+    }
+
+    // Half a grid step along every axis, for points inside the box.
+    double MaxError() const {
+        return 0.5 * Length(step_);
+    }
+
+    int Bits() const {
+        return bits_;
+    }
+
+private:
+    Vector min_{0, 0, 0};
+    Vector step_{0, 0, 0};
+    int bits_ = kMaxBits;
+};
+
+// Octahedral encoding of a direction as two 16-bit signed normalized values: the unit sphere
+// is projected onto the octahedron |x| + |y| + |z| = 1 and its lower half folded over the
+// upper one. The decoded unit vector deviates from the original direction by less than
+// kOctahedralMaxError radians.
+constexpr double kOctahedralMaxError = 1e-4;
+
+inline uint32_t EncodeOctahedral(const Vector& direction) {
+    double l1 = std::fabs(direction[0]) + std::fabs(direction[1]) + std::fabs(direction[2]);
+    double u = direction[0] / l1;
+    double v = direction[1] / l1;
+    if (direction[2] < 0) {
+        double folded_u = (1 - std::fabs(v)) * (u < 0 ? -1 : 1);
+        v = (1 - std::fabs(u)) * (v < 0 ? -1 : 1);
+        u = folded_u;
+    }
+    auto snorm = [](double value) {
+        return static_cast<uint16_t>(
+            static_cast<int16_t>(std::round(std::clamp(value, -1.0, 1.0) * 32767)));
+    };
+    return snorm(u) | static_cast<uint32_t>(snorm(v)) << 16;
+}
+
+inline Vector DecodeOctahedral(uint32_t code) {
+    double u = static_cast<int16_t>(code & 0xffff) / 32767.0;
+    double v = static_cast<int16_t>(code >> 16) / 32767.0;
+    double z = 1 - std::fabs(u) - std::fabs(v);
+    if (z < 0) {
+        double folded_u = (1 - std::fabs(v)) * (u < 0 ? -1 : 1);
+        v = (1 - std::fabs(u)) * (v < 0 ? -1 : 1);
+        u = folded_u;
+    }
+    Vector direction{u, v, z};
+    direction.Normalize();
+    return direction;
+}
+
+// IEEE 754 binary16 with round-to-nearest-even: 11 significant bits, so values in
+// [6.1e-5, 65504] keep a relative error below 2^-11.
+inline uint16_t FloatToHalf(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t exponent = (bits >> 23) & 0xff;
+    uint32_t mantissa = bits & 0x7fffff;
+    if (exponent == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    int32_t half_exponent = static_cast<int32_t>(exponent) - 127 + 15;
+    if (half_exponent >= 0x1f) {
+        return sign | 0x7c00;
+    }
+    uint32_t shift = 13;
+    if (half_exponent <= 0) {
+        if (half_exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        shift = 14 - half_exponent;
+        half_exponent = 0;
+    }
+    uint32_t half = (static_cast<uint32_t>(half_exponent) << 10) | (mantissa >> shift);
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    // A carry out of the mantissa correctly bumps the exponent.
+    if (rest > halfway || (rest == halfway && (half & 1))) {
+        ++half;
+    }
+    return sign | half;
+}
+
+inline float HalfToFloat(uint16_t half) {
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    if (exponent == 0) {
+        float value = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -value : value;
+    }
+    uint32_t bits = sign | (mantissa << 13);
+    bits |= exponent == 0x1f ? 0x7f800000 : (exponent - 15 + 127) << 23;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <vector.h>
+#include <sphere.h>
+#include <memory_accounting.h>
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+constexpr double kNoHit = std::numeric_limits<double>::infinity();
+
+// Ray parameter of the visible sphere surface for a unit-length direction, kNoHit on a miss.
+// A ray starting inside the sphere sees the far root and a ray starting outside the near one,
+// so the root is picked by the sign of (r^2 - |l|^2) instead of comparing both hit points.
+inline double IntersectSphere(const Vector& origin, const Vector& direction, const Vector& center,
+                              double radius2) {
+    double lx = center[0] - origin[0];
+    double ly = center[1] - origin[1];
+    double lz = center[2] - origin[2];
+    double tc = lx * direction[0] + ly * direction[1] + lz * direction[2];
+    double l2 = lx * lx + ly * ly + lz * lz;
+    double disc = radius2 - (l2 - tc * tc);
+    if (tc < 0.0 || disc < 0.0) {
+        return kNoHit;
+    }
+    double t1c = std::sqrt(disc);
+    return l2 < radius2 ? tc + t1c : tc - t1c;
+}
+
+// Structure-of-arrays copy of sphere centers and squared radii, laid out so that
+// ClosestSphere/AnySphereBefore can test kSphereLanes spheres per iteration.
+class SphereBatch {
+public:
+    void Add(const Sphere& sphere) {
+        x_.push_back(sphere.GetCenter()[0]);
+        y_.push_back(sphere.GetCenter()[1]);
+        z_.push_back(sphere.GetCenter()[2]);
+        radius2_.push_back(sphere.GetRadius() * sphere.GetRadius());
+        memory_.Set(4 * radius2_.capacity() * sizeof(double));
+    }
+
+    void Set(size_t index, const Sphere& sphere) {
+        x_[index] = sphere.GetCenter()[0];
+        y_[index] = sphere.GetCenter()[1];
+        z_[index] = sphere.GetCenter()[2];
+        radius2_[index] = sphere.GetRadius() * sphere.GetRadius();
+    }
+
+    void Clear() {
+        x_.clear();
+        y_.clear();
+        z_.clear();
+        radius2_.clear();
+    }
+
+    size_t Size() const {
+        return radius2_.size();
+    }
+
+    const double* X() const {
+        return x_.data();
+    }
+
+    const double* Y() const {
+        return y_.data();
+    }
+
+    const double* Z() const {
+        return z_.data();
+    }
+
+    const double* Radius2() const {
+        return radius2_.data();
+    }
+
+private:
+    std::vector<double> x_;
+    std::vector<double> y_;
+    std::vector<double> z_;
+    std::vector<double> radius2_;
+    TrackedBytes memory_{MemoryCategory::kAcceleration};
+};
+
+struct SphereHit {
+    size_t index = 0;
+    double t = kNoHit;
+};
+
+constexpr size_t kSphereLanes = 4;
+
+// Branch-free body of IntersectSphere over kSphereLanes consecutive spheres. The fixed trip
+// count and the absence of early exits let the compiler keep every lane in vector registers.
+inline void IntersectSphereLanes(const Vector& origin, const Vector& direction,
+                                 const SphereBatch& batch, size_t first, double* t) {
+    const double* __restrict x = batch.X() + first;
+    const double* __restrict y = batch.Y() + first;
+    const double* __restrict z = batch.Z() + first;
+    const double* __restrict radius2 = batch.Radius2() + first;
+    for (size_t k = 0; k != kSphereLanes; ++k) {
+        double lx = x[k] - origin[0];
+        double ly = y[k] - origin[1];
+        double lz = z[k] - origin[2];
+        double tc = lx * direction[0] + ly * direction[1] + lz * direction[2];
+        double l2 = lx * lx + ly * ly + lz * lz;
+        double disc = radius2[k] - (l2 - tc * tc);
+        double t1c = std::sqrt(std::max(disc, 0.0));
+        double root = l2 < radius2[k] ? tc + t1c : tc - t1c;
+        t[k] = (tc < 0.0 || disc < 0.0) ? kNoHit : root;
+    }
+}
+
+inline SphereHit ClosestSphere(const Vector& origin, const Vector& direction,
+                               const SphereBatch& batch, size_t begin, size_t end) {
+    SphereHit best;
+    size_t i = begin;
+    for (; i + kSphereLanes <= end; i += kSphereLanes) {
+        double t[kSphereLanes];
+        IntersectSphereLanes(origin, direction, batch, i, t);
+        for (size_t k = 0; k != kSphereLanes; ++k) {
+            if (t[k] < best.t) {
+                best = {i + k, t[k]};
+            }
+        }
+    }
+    for (; i != end; ++i) {
+        double t = IntersectSphere(origin, direction, {batch.X()[i], batch.Y()[i], batch.Z()[i]},
+                                   batch.Radius2()[i]);
+        if (t < best.t) {
+            best = {i, t};
+        }
+    }
+    return best;
+}
+
+inline SphereHit ClosestSphere(const Vector& origin, const Vector& direction,
+                               const SphereBatch& batch) {
+    return ClosestSphere(origin, direction, batch, 0, batch.Size());
+}
+
+// Shadow-ray variant: true as soon as some sphere is hit with t < max_t.
+inline bool AnySphereBefore(const Vector& origin, const Vector& direction,
+                            const SphereBatch& batch, size_t begin, size_t end, double max_t) {
+    size_t i = begin;
+    for (; i + kSphereLanes <= end; i += kSphereLanes) {
+        double t[kSphereLanes];
+        IntersectSphereLanes(origin, direction, batch, i, t);
+        bool any = false;
+        for (size_t k = 0; k != kSphereLanes; ++k) {
+            any |= t[k] < max_t;
+        }
+        if (any) {
+            return true;
+        }
+    }
+    for (; i != end; ++i) {
+        if (IntersectSphere(origin, direction, {batch.X()[i], batch.Y()[i], batch.Z()[i]},
+                            batch.Radius2()[i]) < max_t) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool AnySphereBefore(const Vector& origin, const Vector& direction,
+                            const SphereBatch& batch, double max_t) {
+    return AnySphereBefore(origin, direction, batch, 0, batch.Size(), max_t);
+}
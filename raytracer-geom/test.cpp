@@ -5,6 +5,9 @@
 #include <optional>
 
 #include <geometry.h>
+#include <bvh.h>
+#include <quantized.h>
+#include <parallel_for.h>
 
 const double kX = 123.;
 const double kY = 456.;
@@ -174,3 +177,216 @@ TEST_CASE("Barycentric coords", "[raytracer]") {
     REQUIRE(std::fabs(inside[1] - 0.1) < kErr);
     REQUIRE(std::fabs(inside[2] - 0.1) < kErr);
 }
+
+TEST_CASE("Sphere batch", "[raytracer]") {
+    std::vector<Sphere> spheres;
+    SphereBatch batch;
+    for (int i = 0; i != 11; ++i) {
+        spheres.emplace_back(Vector{1.5 * i - 7, 0.3 * (i % 3), -4. - i}, 0.5 + 0.1 * i);
+        batch.Add(spheres.back());
+    }
+    spheres.emplace_back(Vector{0, 0, 0}, 2.);
+    batch.Add(spheres.back());
+
+    for (int dir = 0; dir != 16; ++dir) {
+        Vector direction{std::cos(dir * 0.4) * 0.5, 0.05 * dir - 0.2, -std::fabs(std::sin(dir))};
+        direction.Normalize();
+        Ray ray{{0.1, 0.2, 0.3}, direction};
+
+        double expected = kNoHit;
+        size_t expected_index = 0;
+        for (size_t i = 0; i != spheres.size(); ++i) {
+            auto intersection = GetIntersection(ray, spheres[i]);
+            double t = IntersectSphere(ray.GetOrigin(), ray.GetDirection(), spheres[i].GetCenter(),
+                                       spheres[i].GetRadius() * spheres[i].GetRadius());
+            REQUIRE(intersection.has_value() == (t != kNoHit));
+            if (intersection) {
+                REQUIRE(std::fabs(intersection->GetDistance() - t) < kErr);
+                REQUIRE(std::fabs(Length(intersection->GetNormal()) - 1) < kErr);
+            }
+            if (t < expected) {
+                expected = t;
+                expected_index = i;
+            }
+        }
+
+        auto hit = ClosestSphere(ray.GetOrigin(), ray.GetDirection(), batch);
+        REQUIRE(hit.t == expected);
+        REQUIRE(hit.index == expected_index);
+        if (expected != kNoHit) {
+            REQUIRE(AnySphereBefore(ray.GetOrigin(), ray.GetDirection(), batch, expected + kErr));
+        }
+        REQUIRE(!AnySphereBefore(ray.GetOrigin(), ray.GetDirection(), batch, expected - kErr));
+    }
+}
+
+TEST_CASE("Bvh", "[raytracer]") {
+    std::vector<Sphere> spheres;
+    for (int i = 0; i != 40; ++i) {
+        spheres.emplace_back(Vector{std::sin(i * 1.3) * 6, std::cos(i * 0.7) * 4, -3. - i % 9},
+                             0.2 + 0.05 * (i % 5));
+    }
+    auto closest = [](const Bvh& bvh, const std::vector<Sphere>& spheres, const Ray& ray) {
+        double max_t = kNoHit;
+        size_t index = 0;
+        bvh.Traverse(ray.GetOrigin(), ray.GetDirection(), max_t,
+                     [&](uint32_t first, uint32_t count) {
+                         for (uint32_t k = first; k != first + count; ++k) {
+                             const auto& sphere = spheres[bvh.Order()[k]];
+                             double t = IntersectSphere(ray.GetOrigin(), ray.GetDirection(),
+                                                        sphere.GetCenter(),
+                                                        sphere.GetRadius() * sphere.GetRadius());
+                             if (t < max_t) {
+                                 max_t = t;
+                                 index = bvh.Order()[k];
+                             }
+                         }
+                         return false;
+                     });
+        return std::make_pair(max_t, index);
+    };
+    auto check = [&closest](const Bvh& bvh, const std::vector<Sphere>& spheres) {
+        std::vector<Vector> origins;
+        std::vector<Vector> directions;
+        std::vector<double> expected_t;
+        for (int dir = 0; dir != 64; ++dir) {
+            Vector direction{std::cos(dir * 0.1) * 0.7, 0.02 * dir - 0.6, -1};
+            direction.Normalize();
+            Ray ray{{0.1, 0.2, 0.3}, direction};
+            double expected = kNoHit;
+            size_t expected_index = 0;
+            for (size_t i = 0; i != spheres.size(); ++i) {
+                double t = IntersectSphere(ray.GetOrigin(), ray.GetDirection(),
+                                           spheres[i].GetCenter(),
+                                           spheres[i].GetRadius() * spheres[i].GetRadius());
+                if (t < expected) {
+                    expected = t;
+                    expected_index = i;
+                }
+            }
+            auto [t, index] = closest(bvh, spheres, ray);
+            REQUIRE(t == expected);
+            if (expected != kNoHit) {
+                REQUIRE(index == expected_index);
+            }
+            origins.push_back(ray.GetOrigin());
+            directions.push_back(direction);
+            expected_t.push_back(expected);
+        }
+
+        // The same rays as one packet; every third one is dropped at its first leaf.
+        std::vector<double> max_t(origins.size(), kNoHit);
+        std::vector<char> visited(origins.size());
+        bvh.TraversePacket(origins, directions, max_t,
+                           [&](uint32_t first, uint32_t count, const uint32_t* rays, size_t size) {
+                               for (size_t i = 0; i != size; ++i) {
+                                   const uint32_t r = rays[i];
+                                   REQUIRE(max_t[r] >= 0);
+                                   visited[r] = true;
+                                   for (uint32_t k = first; k != first + count; ++k) {
+                                       const auto& sphere = spheres[bvh.Order()[k]];
+                                       max_t[r] = std::min(
+                                           max_t[r],
+                                           IntersectSphere(origins[r], directions[r],
+                                                           sphere.GetCenter(),
+                                                           sphere.GetRadius() *
+                                                               sphere.GetRadius()));
+                                   }
+                                   if (r % 3 == 0) {
+                                       max_t[r] = -1;
+                                   }
+                               }
+                           });
+        for (size_t r = 0; r != origins.size(); ++r) {
+            if (r % 3) {
+                REQUIRE(max_t[r] == expected_t[r]);
+            } else if (expected_t[r] != kNoHit) {
+                REQUIRE(visited[r]);
+            }
+        }
+    };
+
+    std::vector<Aabb> boxes;
+    for (const auto& sphere : spheres) {
+        boxes.push_back(GetBounds(sphere));
+    }
+    Bvh bvh;
+    bvh.Build(boxes);
+    check(bvh, spheres);
+    double cost = bvh.Cost();
+
+    // Shuffle the spheres around: a refit keeps the hierarchy correct but makes it worse.
+    for (size_t i = 0; i != spheres.size(); ++i) {
+        const auto& other = spheres[(i * 17 + 5) % spheres.size()];
+        spheres[i] = Sphere(other.GetCenter() + Vector{0.1, 0, 0}, spheres[i].GetRadius());
+        boxes[i] = GetBounds(spheres[i]);
+    }
+    bvh.Refit(boxes);
+    check(bvh, spheres);
+    REQUIRE(bvh.Cost() > cost);
+    bvh.Build(boxes);
+    check(bvh, spheres);
+}
+
+TEST_CASE("Quantization", "[raytracer]") {
+    Vector min{-3, 0.5, 10};
+    Vector max{250, 0.75, 10};
+    for (int bits : {16, 21}) {
+        PositionQuantizer quantizer(min, max, bits);
+        REQUIRE(Length(min, quantizer.Decode(quantizer.Encode(min))) == 0);
+        double worst = 0;
+        for (int i = 0; i != 1000; ++i) {
+            Vector point{-3 + 253 * std::fabs(std::sin(i * 0.37)), 0.5 + 0.25 * (i % 97) / 96.,
+                         10};
+            worst = std::max(worst, Length(point, quantizer.Decode(quantizer.Encode(point))));
+        }
+        REQUIRE(worst <= quantizer.MaxError());
+        REQUIRE(quantizer.MaxError() < 253. / (1 << bits));
+    }
+    REQUIRE_THROWS(PositionQuantizer(min, max, 22));
+
+    double worst_angle = 0;
+    for (int i = 0; i != 2000; ++i) {
+        Vector direction{std::sin(i * 0.71), std::cos(i * 1.13), std::sin(i * 0.29) - 0.3};
+        direction.Normalize();
+        auto decoded = DecodeOctahedral(EncodeOctahedral(direction));
+        double cos = std::clamp(DotProduct(direction, decoded), -1.0, 1.0);
+        worst_angle = std::max(worst_angle, std::acos(cos));
+    }
+    REQUIRE(worst_angle < kOctahedralMaxError);
+    REQUIRE(DecodeOctahedral(EncodeOctahedral({0, 0, -1}))[2] == -1);
+
+    for (float value : {0.f, 1.f, -2.5f, 0.1f, 65504.f, 3e-6f, 1234.567f}) {
+        float decoded = HalfToFloat(FloatToHalf(value));
+        REQUIRE(std::fabs(decoded - value) <= std::fabs(value) / 2048 + 3e-8);
+    }
+    REQUIRE(std::isinf(HalfToFloat(FloatToHalf(1e6f))));
+    REQUIRE(FloatToHalf(1.f) == 0x3c00);
+}
+
+TEST_CASE("Parallel for", "[raytracer]") {
+    for (size_t count : {0, 1, 7, 1000}) {
+        std::vector<int> visits(count);
+        ParallelFor(count, 8, [&visits](size_t i) { ++visits[i]; });
+        REQUIRE(visits == std::vector<int>(count, 1));
+    }
+
+    // Calls from inside the loop body complete even when every worker is taken.
+    std::vector<std::vector<int>> nested(20, std::vector<int>(50));
+    ParallelFor(nested.size(), 4, [&nested](size_t i) {
+        ParallelFor(nested[i].size(), 4, [&nested, i](size_t j) { nested[i][j] = i + j; });
+    });
+    for (size_t i = 0; i != nested.size(); ++i) {
+        for (size_t j = 0; j != nested[i].size(); ++j) {
+            REQUIRE(nested[i][j] == static_cast<int>(i + j));
+        }
+    }
+
+    REQUIRE_THROWS_AS(ParallelFor(100, 4,
+                                  [](size_t i) {
+                                      if (i == 37) {
+                                          throw std::runtime_error("failed");
+                                      }
+                                  }),
+                      std::runtime_error);
+}
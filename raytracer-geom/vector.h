@@ -5,6 +5,7 @@
 #include <iostream>
 #include <initializer_list>
 #include <algorithm>
+#include <vector>
 
 class Vector;
 
@@ -0,0 +1,518 @@
+#pragma once
+
+#include <scene.h>
+#include <bvh.h>
+#include <parallel_reader.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Cluster file: triangles grouped into spatially compact clusters that are read back one at a
+// time. Layout: magic, cluster count, then one ClusterInfo per cluster, then the Object
+// arrays of all clusters. Material ids refer to the material table of the scene the file
+// was written from.
+static_assert(std::is_trivially_copyable_v<Object>, "clusters store raw Object arrays");
+
+struct ClusterInfo {
+    Aabb bounds;
+    uint64_t offset;
+    uint64_t count;
+    // Triangles are numbered in file order, so every cluster is one contiguous index range.
+    uint64_t first;
+};
+
+constexpr char kClusterMagic[8] = {'R', 'T', 'C', 'L', 'U', 'S', 'T', '1'};
+
+// Point of a triangle the clusters are ordered by.
+inline Vector TriangleCenter(const Triangle& polygon) {
+    return (1. / 3) * (polygon[0] + polygon[1] + polygon[2]);
+}
+
+// pread and pwrite of exactly size bytes.
+inline bool ReadFileAt(int fd, void* data, size_t size, uint64_t offset) {
+    auto* cur = static_cast<char*>(data);
+    while (size) {
+        ssize_t got = pread(fd, cur, size, offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        cur += got;
+        size -= got;
+        offset += got;
+    }
+    return true;
+}
+
+inline bool WriteFileAt(int fd, const void* data, size_t size, uint64_t offset) {
+    const auto* cur = static_cast<const char*>(data);
+    while (size) {
+        ssize_t put = pwrite(fd, cur, size, offset);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put <= 0) {
+            return false;
+        }
+        cur += put;
+        size -= put;
+        offset += put;
+    }
+    return true;
+}
+
+// Sorts the triangles of a scene along a Morton curve of their centroids and cuts the curve
+// into clusters of cluster_size triangles.
+inline void WriteClusterFile(const Scene& scene, const std::string& path,
+                             size_t cluster_size = 4096) {
+    const size_t count = scene.GetTriangleCount();
+    std::vector<Vector> centers(count);
+    Aabb bounds;
+    for (size_t i = 0; i != count; ++i) {
+        centers[i] = TriangleCenter(scene.GetTriangle(i).polygon);
+        bounds.Extend(centers[i]);
+    }
+    std::vector<std::pair<uint64_t, uint32_t>> order(count);
+    for (size_t i = 0; i != count; ++i) {
+        order[i] = {MortonCode(centers[i], bounds), i};
+    }
+    std::sort(order.begin(), order.end());
+
+    cluster_size = std::max<size_t>(cluster_size, 1);
+    uint64_t cluster_count = (count + cluster_size - 1) / cluster_size;
+    std::vector<ClusterInfo> clusters(cluster_count);
+    uint64_t offset = sizeof(kClusterMagic) + sizeof(cluster_count) +
+                      cluster_count * sizeof(ClusterInfo);
+
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        throw std::runtime_error("Can't open file " + path);
+    }
+    bool ok = fwrite(kClusterMagic, 1, sizeof(kClusterMagic), fp) == sizeof(kClusterMagic) &&
+              fwrite(&cluster_count, sizeof(cluster_count), 1, fp) == 1 &&
+              fseek(fp, offset, SEEK_SET) == 0;
+    std::vector<Object> objects;
+    for (uint64_t c = 0; ok && c != cluster_count; ++c) {
+        auto& cluster = clusters[c];
+        cluster.first = c * cluster_size;
+        cluster.count = std::min<uint64_t>(cluster_size, count - cluster.first);
+        cluster.offset = offset;
+        objects.clear();
+        for (uint64_t i = cluster.first; i != cluster.first + cluster.count; ++i) {
+            objects.push_back(scene.GetTriangle(order[i].second));
+            for (size_t v = 0; v != 3; ++v) {
+                cluster.bounds.Extend(objects.back().polygon[v]);
+            }
+        }
+        cluster.bounds.Pad();
+        ok = fwrite(objects.data(), sizeof(Object), objects.size(), fp) == objects.size();
+        offset += objects.size() * sizeof(Object);
+    }
+    ok = ok && fseek(fp, sizeof(kClusterMagic) + sizeof(cluster_count), SEEK_SET) == 0 &&
+         fwrite(clusters.data(), sizeof(ClusterInfo), clusters.size(), fp) == clusters.size();
+    if (fclose(fp) != 0 || !ok) {
+        throw std::runtime_error("Can't write cluster file " + path);
+    }
+}
+
+// Everything of a scene but its triangles: what stays in memory next to its cluster file.
+inline Scene WithoutTriangles(const Scene& scene) {
+    Scene result;
+    result.SetMaterials(scene.GetMaterials());
+    result.Reserve(0, scene.GetSphereObjects().size());
+    for (const auto& sphere_object : scene.GetSphereObjects()) {
+        result.AddSphereObject(sphere_object);
+    }
+    for (const auto& light : scene.GetLights()) {
+        result.AddLight(light);
+    }
+    result.Commit();
+    return result;
+}
+
+struct ClusterConversionOptions {
+    size_t cluster_size = 4096;
+    // Bytes of OBJ text parsed at a time, and about the most triangle bytes sorted at once.
+    size_t block_size = size_t{64} << 20;
+    // 0 means one per hardware thread.
+    size_t threads = 0;
+};
+
+// Same cluster file as WriteClusterFile(ReadScene(obj_path), path), written without ever
+// holding all triangles in memory; returns the rest of the scene (see WithoutTriangles). The
+// OBJ is parsed a block at a time and its triangles are spilled to path + ".triangles". A
+// histogram of their Morton codes then cuts the curve into buckets of about block_size
+// bytes, each bucket is scattered to the range of the output it ends up in and sorted there.
+// Memory holds the vertex, texture and normal arrays of the file, which faces refer to, and
+// a block or a bucket of triangles at a time.
+inline Scene ConvertObjToClusterFile(std::string_view obj_path, const std::string& path,
+                                     const ClusterConversionOptions& options = {}) {
+    const size_t threads =
+        options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    const size_t cluster_size = std::max<size_t>(options.cluster_size, 1);
+    const size_t block_size = std::max<size_t>(options.block_size, 1);
+    std::ifstream file(std::string(obj_path), std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Can't open file " + std::string(obj_path));
+    }
+
+    struct Files {
+        std::string spill_path;
+        int spill = -1;
+        int out = -1;
+
+        ~Files() {
+            for (int fd : {spill, out}) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            unlink(spill_path.c_str());
+        }
+    } files{path + ".triangles"};
+    files.spill = open(files.spill_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (files.spill < 0) {
+        throw std::runtime_error("Can't open file " + files.spill_path);
+    }
+
+    // Parse, resolving faces against the elements defined so far like ReadScene does.
+    Scene scene;
+    ObjChunkSequence sequence(obj_path, scene);
+    std::vector<Vector> vertices;
+    std::vector<Vector> textures;
+    std::vector<Vector> normals;
+    Aabb bounds;
+    uint64_t count = 0;
+    std::string rest;
+    for (bool more = true; more;) {
+        std::string text = std::move(rest);
+        const size_t size = text.size();
+        text.resize(size + block_size);
+        file.read(text.data() + size, block_size);
+        text.resize(size + file.gcount());
+        more = static_cast<bool>(file);
+        if (more) {
+            // The last line goes with the next block.
+            const size_t end = text.rfind('\n') + 1;
+            rest.assign(text, end);
+            text.resize(end);
+        }
+        auto pieces = SplitObjText(text, std::min(threads * 4, text.size() / 4096 + 1));
+        std::vector<ObjChunk> chunks(pieces.size());
+        ParallelFor(chunks.size(), threads,
+                    [&](size_t c) { chunks[c] = ParseObjChunk(pieces[c]); });
+        std::vector<ObjChunkPrefix> prefixes;
+        for (const auto& chunk : chunks) {
+            prefixes.push_back(sequence.Add(chunk));
+            vertices.insert(vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+            textures.insert(textures.end(), chunk.textures.begin(), chunk.textures.end());
+            normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+        }
+        std::vector<std::vector<Object>> objects(chunks.size());
+        ParallelFor(chunks.size(), threads, [&](size_t c) {
+            ForEachChunkTriangle(chunks[c], prefixes[c], vertices, textures, normals,
+                                 [&](const Object& object) { objects[c].push_back(object); });
+        });
+        for (size_t c = 0; c != chunks.size(); ++c) {
+            for (const auto& object : objects[c]) {
+                bounds.Extend(TriangleCenter(object.polygon));
+            }
+            if (!WriteFileAt(files.spill, objects[c].data(), objects[c].size() * sizeof(Object),
+                             count * sizeof(Object))) {
+                throw std::runtime_error("Can't write file " + files.spill_path);
+            }
+            count += objects[c].size();
+            for (const auto& record : chunks[c].spheres) {
+                scene.AddSphereObject({prefixes[c].GetMaterial(record.material), record.sphere});
+            }
+            for (const auto& light : chunks[c].lights) {
+                scene.AddLight(light);
+            }
+        }
+    }
+    vertices = {};
+    textures = {};
+    normals = {};
+
+    const size_t batch = std::max<size_t>(block_size / sizeof(Object), 1);
+    std::vector<Object> objects;
+    std::vector<uint64_t> codes;
+    // Calls f(first) with triangles [first, first + objects.size()) of the spill file in
+    // objects and their Morton codes in codes.
+    auto for_each_spilled = [&](auto&& f) {
+        for (uint64_t first = 0; first < count; first += batch) {
+            objects.resize(std::min<uint64_t>(batch, count - first));
+            if (!ReadFileAt(files.spill, objects.data(), objects.size() * sizeof(Object),
+                            first * sizeof(Object))) {
+                throw std::runtime_error("Can't read file " + files.spill_path);
+            }
+            codes.resize(objects.size());
+            ParallelFor(objects.size(), threads, [&](size_t i) {
+                codes[i] = MortonCode(TriangleCenter(objects[i].polygon), bounds);
+            });
+            f(first);
+        }
+    };
+
+    // Buckets are runs of Morton code prefixes, cut before they outgrow a batch unless a
+    // single prefix does.
+    constexpr int kPrefixBits = 18;
+    auto prefix_of = [](uint64_t code) { return code >> (63 - kPrefixBits); };
+    std::vector<uint64_t> histogram(size_t{1} << kPrefixBits);
+    for_each_spilled([&](uint64_t) {
+        for (uint64_t code : codes) {
+            ++histogram[prefix_of(code)];
+        }
+    });
+    std::vector<uint32_t> bucket_of(histogram.size());
+    std::vector<uint64_t> bucket_begin = {0};
+    uint64_t end = 0;
+    for (size_t p = 0; p != histogram.size(); ++p) {
+        if (end != bucket_begin.back() && end + histogram[p] - bucket_begin.back() > batch) {
+            bucket_begin.push_back(end);
+        }
+        bucket_of[p] = bucket_begin.size() - 1;
+        end += histogram[p];
+    }
+    bucket_begin.push_back(end);
+    histogram = {};
+
+    const uint64_t cluster_count = (count + cluster_size - 1) / cluster_size;
+    const uint64_t data_offset = sizeof(kClusterMagic) + sizeof(cluster_count) +
+                                 cluster_count * sizeof(ClusterInfo);
+    files.out = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (files.out < 0) {
+        throw std::runtime_error("Can't open file " + path);
+    }
+    auto write_out = [&](const void* data, size_t size, uint64_t offset) {
+        if (!WriteFileAt(files.out, data, size, offset)) {
+            throw std::runtime_error("Can't write cluster file " + path);
+        }
+    };
+
+    // Scatter in spill order, so that equal codes stay in file order as in WriteClusterFile.
+    constexpr size_t kScatterBuffer = 64;
+    std::vector<uint64_t> filled(bucket_begin.begin(), bucket_begin.end() - 1);
+    std::vector<std::vector<Object>> scattered(filled.size());
+    auto flush = [&](size_t b) {
+        write_out(scattered[b].data(), scattered[b].size() * sizeof(Object),
+                  data_offset + filled[b] * sizeof(Object));
+        filled[b] += scattered[b].size();
+        scattered[b].clear();
+    };
+    for_each_spilled([&](uint64_t) {
+        for (size_t i = 0; i != objects.size(); ++i) {
+            const size_t b = bucket_of[prefix_of(codes[i])];
+            scattered[b].push_back(objects[i]);
+            if (scattered[b].size() == kScatterBuffer) {
+                flush(b);
+            }
+        }
+    });
+    for (size_t b = 0; b != scattered.size(); ++b) {
+        flush(b);
+    }
+    scattered = {};
+
+    std::vector<ClusterInfo> clusters(cluster_count);
+    for (uint64_t c = 0; c != cluster_count; ++c) {
+        auto& cluster = clusters[c];
+        cluster.first = c * cluster_size;
+        cluster.count = std::min<uint64_t>(cluster_size, count - cluster.first);
+        cluster.offset = data_offset + cluster.first * sizeof(Object);
+    }
+    std::vector<std::pair<uint64_t, size_t>> order;
+    std::vector<Object> sorted;
+    for (size_t b = 0; b + 1 != bucket_begin.size(); ++b) {
+        const uint64_t first = bucket_begin[b];
+        objects.resize(bucket_begin[b + 1] - first);
+        if (objects.empty()) {
+            continue;
+        }
+        const uint64_t offset = data_offset + first * sizeof(Object);
+        if (!ReadFileAt(files.out, objects.data(), objects.size() * sizeof(Object), offset)) {
+            throw std::runtime_error("Can't read cluster file " + path);
+        }
+        order.resize(objects.size());
+        ParallelFor(objects.size(), threads, [&](size_t i) {
+            order[i] = {MortonCode(TriangleCenter(objects[i].polygon), bounds), i};
+        });
+        std::sort(order.begin(), order.end());
+        sorted.resize(objects.size());
+        for (size_t i = 0; i != objects.size(); ++i) {
+            sorted[i] = objects[order[i].second];
+            for (size_t v = 0; v != 3; ++v) {
+                clusters[(first + i) / cluster_size].bounds.Extend(sorted[i].polygon[v]);
+            }
+        }
+        write_out(sorted.data(), sorted.size() * sizeof(Object), offset);
+    }
+    for (auto& cluster : clusters) {
+        cluster.bounds.Pad();
+    }
+    write_out(kClusterMagic, sizeof(kClusterMagic), 0);
+    write_out(&cluster_count, sizeof(cluster_count), sizeof(kClusterMagic));
+    write_out(clusters.data(), clusters.size() * sizeof(ClusterInfo),
+              sizeof(kClusterMagic) + sizeof(cluster_count));
+    const int out = files.out;
+    files.out = -1;
+    if (close(out) != 0) {
+        throw std::runtime_error("Can't write cluster file " + path);
+    }
+    scene.Commit();
+    return scene;
+}
+
+// A resident cluster: its triangles and a hierarchy over them.
+struct Cluster {
+    std::vector<Object> objects;
+    Bvh bvh;
+
+    size_t ByteSize() const {
+        return objects.capacity() * sizeof(Object) + bvh.Nodes().capacity() * sizeof(Bvh::Node) +
+               bvh.Order().capacity() * sizeof(uint32_t);
+    }
+};
+
+// Keeps the cluster table and a hierarchy over the cluster bounds in memory and pages whole
+// clusters in on demand. Resident clusters are evicted least recently used first once they
+// take more than memory_budget bytes; a cluster still held by a caller stays valid. Load may
+// be called from several threads at once.
+class ClusterStore {
+public:
+    ClusterStore(const std::string& path, size_t memory_budget)
+        : memory_budget_(memory_budget) {
+        fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0) {
+            throw std::runtime_error("Can't open file " + path);
+        }
+        char magic[sizeof(kClusterMagic)];
+        uint64_t count = 0;
+        bool ok = ReadAt(magic, sizeof(magic), 0) &&
+                  std::memcmp(magic, kClusterMagic, sizeof(magic)) == 0 &&
+                  ReadAt(&count, sizeof(count), sizeof(magic));
+        if (ok) {
+            clusters_.resize(count);
+            ok = ReadAt(clusters_.data(), count * sizeof(ClusterInfo),
+                        sizeof(magic) + sizeof(count));
+        }
+        if (!ok) {
+            close(fd_);
+            throw std::runtime_error("Not a cluster file " + path);
+        }
+        std::vector<Aabb> boxes;
+        for (const auto& cluster : clusters_) {
+            boxes.push_back(cluster.bounds);
+            triangle_count_ += cluster.count;
+        }
+        bvh_.Build(boxes, 1);
+    }
+
+    ClusterStore(const ClusterStore&) = delete;
+    ClusterStore& operator=(const ClusterStore&) = delete;
+
+    ~ClusterStore() {
+        close(fd_);
+    }
+
+    const std::vector<ClusterInfo>& GetClusters() const {
+        return clusters_;
+    }
+
+    // Hierarchy over the cluster bounds, with one cluster per leaf.
+    const Bvh& GetBvh() const {
+        return bvh_;
+    }
+
+    size_t GetTriangleCount() const {
+        return triangle_count_;
+    }
+
+    std::shared_ptr<const Cluster> Load(size_t index) {
+        {
+            std::lock_guard lock(mutex_);
+            auto it = resident_.find(index);
+            if (it != resident_.end()) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                return it->second->second;
+            }
+        }
+
+        const auto& info = clusters_[index];
+        auto cluster = std::make_shared<Cluster>();
+        cluster->objects.resize(info.count);
+        if (!ReadAt(cluster->objects.data(), info.count * sizeof(Object), info.offset)) {
+            throw std::runtime_error("Truncated cluster file");
+        }
+        std::vector<Aabb> boxes;
+        boxes.reserve(info.count);
+        for (const auto& object : cluster->objects) {
+            boxes.push_back(GetBounds(object.polygon));
+        }
+        cluster->bvh.Build(boxes);
+
+        std::lock_guard lock(mutex_);
+        ++page_ins_;
+        auto [it, inserted] = resident_.emplace(index, lru_.end());
+        if (!inserted) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return it->second->second;
+        }
+        lru_.emplace_front(index, cluster);
+        it->second = lru_.begin();
+        memory_ += cluster->ByteSize();
+        while (memory_ > memory_budget_ && lru_.size() > 1) {
+            memory_ -= lru_.back().second->ByteSize();
+            resident_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+        return cluster;
+    }
+
+    size_t MemoryUsage() const {
+        std::lock_guard lock(mutex_);
+        return memory_;
+    }
+
+    size_t PageIns() const {
+        std::lock_guard lock(mutex_);
+        return page_ins_;
+    }
+
+private:
+    using LruList = std::list<std::pair<size_t, std::shared_ptr<const Cluster>>>;
+
+    bool ReadAt(void* data, size_t size, uint64_t offset) const {
+        return ReadFileAt(fd_, data, size, offset);
+    }
+
+    int fd_ = -1;
+    size_t memory_budget_;
+    std::vector<ClusterInfo> clusters_;
+    size_t triangle_count_ = 0;
+    Bvh bvh_;
+    mutable std::mutex mutex_;
+    LruList lru_;
+    std::unordered_map<size_t, LruList::iterator> resident_;
+    size_t memory_ = 0;
+    size_t page_ins_ = 0;
+};
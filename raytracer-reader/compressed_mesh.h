@@ -0,0 +1,99 @@
+#pragma once
+
+#include <object.h>
+#include <quantized.h>
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Triangles of a scene in about a quarter of the memory of std::vector<Object>: 52 bytes per
+// triangle instead of 220. Positions are quantized within the bounds of the whole mesh (see
+// GetQuantizer().MaxError()), vertex normals are octahedral-encoded and stored normalized
+// (within kOctahedralMaxError radians), and texture coordinates keep u and v as half floats
+// while w is dropped. Objects without vertex normals decode with all-zero normals again.
+class CompressedMesh {
+public:
+    CompressedMesh() = default;
+
+    explicit CompressedMesh(const std::vector<Object>& objects,
+                            int position_bits = PositionQuantizer::kMaxBits) {
+        Vector min{std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+                   std::numeric_limits<double>::infinity()};
+        Vector max = -1 * min;
+        for (const auto& object : objects) {
+            for (size_t i = 0; i != 3; ++i) {
+                for (size_t k = 0; k != 3; ++k) {
+                    min[k] = std::min(min[k], object.polygon[i][k]);
+                    max[k] = std::max(max[k], object.polygon[i][k]);
+                }
+            }
+        }
+        quantizer_ = objects.empty() ? PositionQuantizer({0, 0, 0}, {0, 0, 0}, position_bits)
+                                     : PositionQuantizer(min, max, position_bits);
+
+        positions_.reserve(3 * objects.size());
+        attributes_.reserve(objects.size());
+        for (const auto& object : objects) {
+            Attributes attributes;
+            bool has_normals = object.NormalExists();
+            for (size_t i = 0; i != 3; ++i) {
+                positions_.push_back(quantizer_.Encode(object.polygon[i]));
+                attributes.normal[i] = has_normals ? EncodeOctahedral(object.normal[i]) : 0;
+                attributes.texture[i][0] = FloatToHalf(object.texture[i][0]);
+                attributes.texture[i][1] = FloatToHalf(object.texture[i][1]);
+            }
+            attributes.material = object.material_id | (has_normals ? 0 : kNoNormals);
+            attributes_.push_back(attributes);
+        }
+    }
+
+    size_t Size() const {
+        return attributes_.size();
+    }
+
+    Triangle GetPolygon(size_t index) const {
+        const uint64_t* position = &positions_[3 * index];
+        return {quantizer_.Decode(position[0]), quantizer_.Decode(position[1]),
+                quantizer_.Decode(position[2])};
+    }
+
+    MaterialId GetMaterialId(size_t index) const {
+        return attributes_[index].material & ~kNoNormals;
+    }
+
+    Object GetObject(size_t index) const {
+        const auto& attributes = attributes_[index];
+        Object object{GetMaterialId(index), GetPolygon(index), {}, {}};
+        for (size_t i = 0; i != 3; ++i) {
+            object.texture[i] = {HalfToFloat(attributes.texture[i][0]),
+                                 HalfToFloat(attributes.texture[i][1]), 0};
+            object.normal[i] = attributes.material & kNoNormals
+                                   ? Vector{0, 0, 0}
+                                   : DecodeOctahedral(attributes.normal[i]);
+        }
+        return object;
+    }
+
+    const PositionQuantizer& GetQuantizer() const {
+        return quantizer_;
+    }
+
+    size_t ByteSize() const {
+        return positions_.capacity() * sizeof(uint64_t) + attributes_.capacity() * sizeof(Attributes);
+    }
+
+private:
+    // The top bit of the material id marks triangles without vertex normals.
+    static constexpr MaterialId kNoNormals = MaterialId{1} << 31;
+
+    struct Attributes {
+        uint32_t normal[3];
+        uint16_t texture[3][2];
+        MaterialId material;
+    };
+
+    PositionQuantizer quantizer_;
+    std::vector<uint64_t> positions_;
+    std::vector<Attributes> attributes_;
+};
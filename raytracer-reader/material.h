@@ -1,10 +1,14 @@
 #pragma once
 
 #include <vector.h>
+
+#include <cstdint>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 struct Material {
-    std::string name;
     Vector ambient_color = {0, 0, 0};
     Vector diffuse_color = {0, 0, 0};
     Vector specular_color = {0, 0, 0};
@@ -12,4 +16,85 @@ struct Material {
     double specular_exponent;
     double refraction_index;
     std::array<double, 3> albedo = {1, 0, 0};
+    // Image multiplied into diffuse_color (map_Kd), empty for none.
+    std::string diffuse_map;
+};
+
+using MaterialId = uint32_t;
+
+// Materials stored densely in definition order and addressed by id; names only matter while
+// loading, so they live in a side table.
+class MaterialTable {
+public:
+    // Id of the named material, defining a default one first if the name is new.
+    MaterialId Add(const std::string& name) {
+        auto [it, inserted] = ids_.emplace(name, materials_.size());
+        if (inserted) {
+            materials_.emplace_back();
+            names_.push_back(name);
+        }
+        return it->second;
+    }
+
+    MaterialId GetId(const std::string& name) const {
+        auto it = ids_.find(name);
+        if (it == ids_.end()) {
+            throw std::out_of_range("Unknown material " + name);
+        }
+        return it->second;
+    }
+
+    bool Contains(const std::string& name) const {
+        return ids_.count(name);
+    }
+
+    const std::string& GetName(MaterialId id) const {
+        return names_[id];
+    }
+
+    const Material& Get(const std::string& name) const {
+        return materials_[GetId(name)];
+    }
+
+    const Material& operator[](MaterialId id) const {
+        return materials_[id];
+    }
+
+    Material& operator[](MaterialId id) {
+        return materials_[id];
+    }
+
+    size_t Size() const {
+        return materials_.size();
+    }
+
+    // Adds the materials of another table as new entries, even under names that are taken:
+    // the names then refer to the new definitions, while existing ids keep the old ones.
+    // Returns the new ids in the order of other.
+    std::vector<MaterialId> Append(const MaterialTable& other) {
+        std::vector<MaterialId> ids;
+        for (MaterialId id = 0; id != other.Size(); ++id) {
+            ids.push_back(materials_.size());
+            ids_[other.names_[id]] = materials_.size();
+            materials_.push_back(other.materials_[id]);
+            names_.push_back(other.names_[id]);
+        }
+        return ids;
+    }
+
+    // Approximate: hash table nodes are counted as a name and an id each.
+    size_t ByteSize() const {
+        size_t bytes = materials_.capacity() * sizeof(Material) +
+                       names_.capacity() * sizeof(std::string) +
+                       ids_.size() * (sizeof(std::string) + sizeof(MaterialId));
+        for (size_t i = 0; i != materials_.size(); ++i) {
+            bytes += materials_[i].diffuse_map.capacity() + 2 * names_[i].capacity();
+        }
+        return bytes;
+    }
+
+private:
+    std::vector<Material> materials_;
+    std::vector<std::string> names_;
+    std::unordered_map<std::string, MaterialId> ids_;
 };
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <scene.h>
+#include <bvh.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <ostream>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+struct MeshOptimizationOptions {
+    // Vertices closer than this are moved onto one another; 0 merges exact duplicates only.
+    double weld_distance = 0;
+    bool remove_degenerate = true;
+    // Faces with the same material and corners (position, texture and normal) in the same
+    // winding as an earlier face.
+    bool remove_duplicates = true;
+    // Sorts the triangles along a Morton curve of their centroids, so that neighbours in space
+    // are neighbours in memory.
+    bool reorder = true;
+};
+
+struct MeshOptimizationReport {
+    size_t triangles_before = 0;
+    size_t triangles_after = 0;
+    size_t degenerate_triangles = 0;
+    size_t duplicate_triangles = 0;
+    // Distinct vertex positions before and after welding, and the corners that welding moved.
+    size_t vertices_before = 0;
+    size_t vertices_after = 0;
+    size_t welded_corners = 0;
+    size_t bytes_before = 0;
+    size_t bytes_after = 0;
+
+    void Print(std::ostream& out) const {
+        out << "triangles: " << triangles_before << " -> " << triangles_after << " ("
+            << degenerate_triangles << " degenerate, " << duplicate_triangles
+            << " duplicate removed)\n"
+            << "vertices: " << vertices_before << " -> " << vertices_after << " distinct ("
+            << welded_corners << " corners welded)\n"
+            << "triangle memory: " << bytes_before << " -> " << bytes_after << " bytes ("
+            << bytes_before - bytes_after << " saved)\n";
+    }
+};
+
+// Merges vertex positions within a distance into the first of them seen, on a hash grid of
+// that cell size so that only neighbouring cells are searched.
+class VertexWelder {
+public:
+    explicit VertexWelder(double distance) : distance_(distance) {
+    }
+
+    // The representative of position; new positions become representatives themselves.
+    const Vector& Weld(const Vector& position) {
+        const auto cell = GetCell(position);
+        const int reach = distance_ > 0 ? 1 : 0;
+        for (int dx = -reach; dx <= reach; ++dx) {
+            for (int dy = -reach; dy <= reach; ++dy) {
+                for (int dz = -reach; dz <= reach; ++dz) {
+                    auto it = cells_.find({cell[0] + dx, cell[1] + dy, cell[2] + dz});
+                    if (it == cells_.end()) {
+                        continue;
+                    }
+                    for (uint32_t index : it->second) {
+                        if (Length(vertices_[index], position) <= distance_) {
+                            return vertices_[index];
+                        }
+                    }
+                }
+            }
+        }
+        cells_[cell].push_back(vertices_.size());
+        vertices_.push_back(position);
+        return vertices_.back();
+    }
+
+    size_t Size() const {
+        return vertices_.size();
+    }
+
+private:
+    struct CellHash {
+        size_t operator()(const std::array<int64_t, 3>& cell) const {
+            uint64_t hash = 0;
+            for (int64_t c : cell) {
+                hash = (hash ^ static_cast<uint64_t>(c)) * 0x9e3779b97f4a7c15;
+            }
+            return hash ^ (hash >> 29);
+        }
+    };
+
+    std::array<int64_t, 3> GetCell(const Vector& position) const {
+        std::array<int64_t, 3> cell;
+        for (size_t k = 0; k != 3; ++k) {
+            // Exact welding keys by value; +0.0 turns -0.0 into the +0.0 it equals.
+            double c = distance_ > 0 ? std::floor(position[k] / distance_) : position[k] + 0.0;
+            if (distance_ > 0) {
+                cell[k] = static_cast<int64_t>(std::clamp(c, -4e18, 4e18));
+            } else {
+                std::memcpy(&cell[k], &c, sizeof(c));
+            }
+        }
+        return cell;
+    }
+
+    double distance_;
+    std::vector<Vector> vertices_;
+    std::unordered_map<std::array<int64_t, 3>, std::vector<uint32_t>, CellHash> cells_;
+};
+
+// Object with its corners rotated so that the lexicographically smallest position comes
+// first, which keeps the winding; equal faces are equal as arrays of these values.
+inline std::array<double, 28> GetFaceKey(const Object& object) {
+    size_t first = 0;
+    for (size_t i = 1; i != 3; ++i) {
+        const auto& a = object.polygon[i];
+        const auto& b = object.polygon[first];
+        if (std::make_tuple(a[0], a[1], a[2]) < std::make_tuple(b[0], b[1], b[2])) {
+            first = i;
+        }
+    }
+    std::array<double, 28> key;
+    key[0] = object.material_id;
+    size_t next = 1;
+    for (size_t r = 0; r != 3; ++r) {
+        const size_t i = (first + r) % 3;
+        for (const Triangle* corners : {&object.polygon, &object.texture, &object.normal}) {
+            for (size_t k = 0; k != 3; ++k) {
+                key[next++] = (*corners)[i][k] + 0.0;
+            }
+        }
+    }
+    return key;
+}
+
+// Post-load cleanup of the triangles of a scene: welds vertices, drops triangles no ray can
+// hit and repeated faces, and reorders the rest for locality. Triangles store their corners
+// inline, so welding saves no memory by itself, but it closes cracks and exposes faces that
+// collapse or coincide. Object handles are reissued as by SetObjects; the scene is committed.
+inline MeshOptimizationReport OptimizeMesh(Scene& scene,
+                                           const MeshOptimizationOptions& options = {}) {
+    // Triangles with a smaller |e1 x e2| are never hit: the determinant GetIntersection
+    // computes for a unit direction is bounded by it and rejected below this value.
+    constexpr double kNeverHitArea = 1e-9;
+    if (!(options.weld_distance >= 0)) {
+        throw std::invalid_argument("Weld distance must be non-negative");
+    }
+    if (scene.IsCompressed()) {
+        throw std::logic_error("Compressed triangles can't be optimized");
+    }
+    std::vector<Object> objects = scene.GetObjects();
+    MeshOptimizationReport report;
+    report.triangles_before = objects.size();
+    report.bytes_before = scene.GetObjects().capacity() * sizeof(Object);
+
+    VertexWelder exact(0);
+    VertexWelder welder(options.weld_distance);
+    for (auto& object : objects) {
+        for (size_t i = 0; i != 3; ++i) {
+            exact.Weld(object.polygon[i]);
+            const Vector welded = welder.Weld(object.polygon[i]);
+            if (Length(welded, object.polygon[i]) != 0) {
+                object.polygon[i] = welded;
+                ++report.welded_corners;
+            }
+        }
+    }
+    report.vertices_before = exact.Size();
+    report.vertices_after = welder.Size();
+
+    if (options.remove_degenerate) {
+        auto degenerate = [](const Object& object) {
+            const auto& p = object.polygon;
+            return Length(CrossProduct(p[1] - p[0], p[2] - p[0])) < kNeverHitArea;
+        };
+        const size_t size = objects.size();
+        objects.erase(std::remove_if(objects.begin(), objects.end(), degenerate), objects.end());
+        report.degenerate_triangles = size - objects.size();
+    }
+
+    if (options.remove_duplicates) {
+        std::vector<std::array<double, 28>> keys(objects.size());
+        std::vector<uint32_t> order(objects.size());
+        for (size_t i = 0; i != objects.size(); ++i) {
+            keys[i] = GetFaceKey(objects[i]);
+        }
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+                         [&keys](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+        std::vector<char> duplicate(objects.size());
+        for (size_t i = 1; i < order.size(); ++i) {
+            if (keys[order[i]] == keys[order[i - 1]]) {
+                duplicate[order[i]] = 1;
+                ++report.duplicate_triangles;
+            }
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i != objects.size(); ++i) {
+            if (!duplicate[i]) {
+                objects[kept++] = objects[i];
+            }
+        }
+        objects.resize(kept);
+    }
+
+    if (options.reorder) {
+        Aabb bounds;
+        std::vector<Vector> centers(objects.size());
+        for (size_t i = 0; i != objects.size(); ++i) {
+            const auto& p = objects[i].polygon;
+            centers[i] = (1. / 3) * (p[0] + p[1] + p[2]);
+            bounds.Extend(centers[i]);
+        }
+        std::vector<std::pair<uint64_t, uint32_t>> order(objects.size());
+        for (size_t i = 0; i != objects.size(); ++i) {
+            order[i] = {MortonCode(centers[i], bounds), i};
+        }
+        std::sort(order.begin(), order.end());
+        std::vector<Object> sorted;
+        sorted.reserve(objects.size());
+        for (const auto& [code, index] : order) {
+            sorted.push_back(objects[index]);
+        }
+        objects = std::move(sorted);
+    }
+
+    objects.shrink_to_fit();
+    report.triangles_after = objects.size();
+    report.bytes_after = objects.capacity() * sizeof(Object);
+    scene.SetObjects(std::move(objects));
+    scene.Commit();
+    return report;
+}
@@ -6,7 +6,7 @@
 
 struct Object {
     static constexpr double kEps = 1e-9;
-    const Material *material = nullptr;
+    MaterialId material_id = 0;
     Triangle polygon;
     Triangle texture;
     Triangle normal;
@@ -23,6 +23,6 @@ struct Object {
 };
 
 struct SphereObject {
-    const Material *material = nullptr;
+    MaterialId material_id = 0;
     Sphere sphere;
 };
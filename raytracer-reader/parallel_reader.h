@@ -0,0 +1,351 @@
+#pragma once
+
+#include <scene.h>
+#include <parallel_for.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// What one newline-aligned chunk of an OBJ file contributes to the scene. Face corners keep
+// the indices exactly as written: positive ones are global, while negative ones count back
+// from the number of elements defined so far, which depends on the chunks before. Material
+// names are resolved only after all mtllib statements are known, each in the library that
+// was current where it appears.
+struct ObjChunk {
+    // Face or sphere material: index into material_names, or kInherited for the material
+    // that was current when the chunk started.
+    static constexpr int32_t kInherited = -1;
+
+    struct Corner {
+        int32_t vertex = 0;
+        int32_t texture = 0;
+        int32_t normal = 0;
+    };
+
+    struct Face {
+        uint32_t first_corner;
+        uint32_t corner_count;
+        int32_t material;
+        // Vertices, texture coordinates and normals of this chunk defined before the face.
+        uint32_t vertices;
+        uint32_t textures;
+        uint32_t normals;
+    };
+
+    struct SphereRecord {
+        Sphere sphere;
+        int32_t material;
+    };
+
+    std::vector<Vector> vertices;
+    std::vector<Vector> textures;
+    std::vector<Vector> normals;
+    std::vector<Corner> corners;
+    std::vector<Face> faces;
+    std::vector<SphereRecord> spheres;
+    std::vector<Light> lights;
+    std::vector<std::string> material_names;
+    // Number of material_libraries that precede each of material_names.
+    std::vector<uint32_t> material_scopes;
+    std::vector<std::string> material_libraries;
+    // Material current at the end of the chunk, kInherited if it has no usemtl.
+    int32_t last_material = kInherited;
+};
+
+// Splits a line into whitespace-separated tokens without copying it.
+class ObjTokenizer {
+public:
+    explicit ObjTokenizer(std::string_view line) : line_(line) {
+    }
+
+    std::string_view Next() {
+        while (pos_ != line_.size() && IsSpace(line_[pos_])) {
+            ++pos_;
+        }
+        size_t begin = pos_;
+        while (pos_ != line_.size() && !IsSpace(line_[pos_])) {
+            ++pos_;
+        }
+        return line_.substr(begin, pos_ - begin);
+    }
+
+    // Tokens sit in a null-terminated buffer and end at whitespace, so strtod stops exactly
+    // at the end of the token.
+    double NextDouble() {
+        auto token = Next();
+        return token.empty() ? 0 : std::strtod(token.data(), nullptr);
+    }
+
+    Vector NextVector() {
+        double x = NextDouble();
+        double y = NextDouble();
+        double z = NextDouble();
+        return {x, y, z};
+    }
+
+private:
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    std::string_view line_;
+    size_t pos_ = 0;
+};
+
+// "v", "v/vt", "v//vn" or "v/vt/vn"; missing parts are 0, as in ReadScene.
+inline ObjChunk::Corner ParseCorner(std::string_view token) {
+    int32_t values[3] = {0, 0, 0};
+    for (size_t k = 0; k != 3 && !token.empty(); ++k) {
+        size_t slash = token.find('/');
+        auto part = token.substr(0, slash);
+        std::from_chars(part.data(), part.data() + part.size(), values[k]);
+        if (slash == std::string_view::npos) {
+            break;
+        }
+        token.remove_prefix(slash + 1);
+    }
+    return {values[0], values[1], values[2]};
+}
+
+inline ObjChunk ParseObjChunk(std::string_view text) {
+    ObjChunk chunk;
+    int32_t material = ObjChunk::kInherited;
+    while (!text.empty()) {
+        size_t end = text.find('\n');
+        ObjTokenizer tokens(text.substr(0, end));
+        text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+
+        auto keyword = tokens.Next();
+        if (keyword == "v") {
+            chunk.vertices.push_back(tokens.NextVector());
+        } else if (keyword == "vt") {
+            chunk.textures.push_back(tokens.NextVector());
+        } else if (keyword == "vn") {
+            chunk.normals.push_back(tokens.NextVector());
+        } else if (keyword == "f") {
+            ObjChunk::Face face{static_cast<uint32_t>(chunk.corners.size()), 0, material,
+                                static_cast<uint32_t>(chunk.vertices.size()),
+                                static_cast<uint32_t>(chunk.textures.size()),
+                                static_cast<uint32_t>(chunk.normals.size())};
+            for (auto token = tokens.Next(); !token.empty(); token = tokens.Next()) {
+                chunk.corners.push_back(ParseCorner(token));
+            }
+            face.corner_count = chunk.corners.size() - face.first_corner;
+            chunk.faces.push_back(face);
+        } else if (keyword == "usemtl") {
+            material = chunk.material_names.size();
+            chunk.material_names.emplace_back(tokens.Next());
+            chunk.material_scopes.push_back(chunk.material_libraries.size());
+        } else if (keyword == "mtllib") {
+            chunk.material_libraries.emplace_back(tokens.Next());
+        } else if (keyword == "S") {
+            Vector center = tokens.NextVector();
+            double radius = tokens.NextDouble();
+            chunk.spheres.push_back({Sphere(center, radius), material});
+        } else if (keyword == "P") {
+            Vector position = tokens.NextVector();
+            Vector intensity = tokens.NextVector();
+            chunk.lights.push_back({position, intensity});
+        }
+    }
+    chunk.last_material = material;
+    return chunk;
+}
+
+// Where a chunk's elements go in the global arrays of the file and the material it starts
+// with.
+struct ObjChunkPrefix {
+    size_t vertices = 0;
+    size_t textures = 0;
+    size_t normals = 0;
+    size_t objects = 0;
+    std::optional<MaterialId> material;
+    // Scene ids of the chunk's material_names.
+    std::vector<MaterialId> material_ids;
+
+    MaterialId GetMaterial(int32_t material) const {
+        if (material != ObjChunk::kInherited) {
+            return material_ids[material];
+        }
+        if (!this->material) {
+            throw std::runtime_error("Geometry without usemtl");
+        }
+        return *this->material;
+    }
+};
+
+// Running totals over the chunks of an OBJ file taken in file order. The material libraries
+// of a chunk are read into the scene when the chunk is added, so every usemtl resolves in the
+// last library before it.
+class ObjChunkSequence {
+public:
+    ObjChunkSequence(std::string_view filename, Scene& scene)
+        : directory_(filename.substr(0, filename.find_last_of('/') + 1)), scene_(scene) {
+    }
+
+    ObjChunkPrefix Add(const ObjChunk& chunk) {
+        for (const auto& library : chunk.material_libraries) {
+            libraries_.push_back(ReadMaterials(directory_ + library));
+            library_ids_.push_back(scene_.AddMaterials(libraries_.back()));
+        }
+        ObjChunkPrefix prefix = total_;
+        for (size_t i = 0; i != chunk.material_names.size(); ++i) {
+            const auto& name = chunk.material_names[i];
+            const size_t scope = library_count_ + chunk.material_scopes[i];
+            if (scope == 0) {
+                throw std::out_of_range("Unknown material " + name);
+            }
+            prefix.material_ids.push_back(
+                library_ids_[scope - 1][libraries_[scope - 1].GetId(name)]);
+        }
+        library_count_ += chunk.material_libraries.size();
+        if (chunk.last_material != ObjChunk::kInherited) {
+            total_.material = prefix.material_ids[chunk.last_material];
+        }
+        total_.vertices += chunk.vertices.size();
+        total_.textures += chunk.textures.size();
+        total_.normals += chunk.normals.size();
+        for (const auto& face : chunk.faces) {
+            total_.objects += std::max<size_t>(face.corner_count, 2) - 2;
+        }
+        return prefix;
+    }
+
+    // Elements of all the chunks added so far; material_ids is empty.
+    const ObjChunkPrefix& Total() const {
+        return total_;
+    }
+
+private:
+    std::string directory_;
+    Scene& scene_;
+    std::vector<MaterialTable> libraries_;
+    std::vector<std::vector<MaterialId>> library_ids_;
+    size_t library_count_ = 0;
+    ObjChunkPrefix total_;
+};
+
+// Calls emit(object) for the triangles of the faces of a chunk in order, with corners resolved
+// against the global element arrays of the file. Positive indices are global and 1-based,
+// negative ones count back from the elements defined before the face; 0 means the element is
+// absent.
+template <class F>
+void ForEachChunkTriangle(const ObjChunk& chunk, const ObjChunkPrefix& prefix,
+                          const std::vector<Vector>& vertices,
+                          const std::vector<Vector>& textures,
+                          const std::vector<Vector>& normals, F&& emit) {
+    auto resolve = [](int32_t index, size_t defined, const std::vector<Vector>& vectors) {
+        if (index == 0) {
+            return Vector{0, 0, 0};
+        }
+        return vectors.at(index > 0 ? index - 1 : defined + index);
+    };
+    for (const auto& face : chunk.faces) {
+        if (face.corner_count < 3) {
+            continue;
+        }
+        MaterialId material = prefix.GetMaterial(face.material);
+        const auto* corners = &chunk.corners[face.first_corner];
+        size_t defined[3] = {prefix.vertices + face.vertices, prefix.textures + face.textures,
+                             prefix.normals + face.normals};
+        auto triangle = [&](int32_t ObjChunk::Corner::*field, size_t j, size_t kind,
+                            const std::vector<Vector>& vectors) {
+            return Triangle{resolve(corners[0].*field, defined[kind], vectors),
+                            resolve(corners[j - 1].*field, defined[kind], vectors),
+                            resolve(corners[j].*field, defined[kind], vectors)};
+        };
+        for (size_t j = 2; j != face.corner_count; ++j) {
+            emit(Object{material, triangle(&ObjChunk::Corner::vertex, j, 0, vertices),
+                        triangle(&ObjChunk::Corner::texture, j, 1, textures),
+                        triangle(&ObjChunk::Corner::normal, j, 2, normals)});
+        }
+    }
+}
+
+// Newline-aligned pieces of text, about count of them.
+inline std::vector<std::string_view> SplitObjText(std::string_view text, size_t count) {
+    std::vector<std::string_view> pieces;
+    size_t begin = 0;
+    for (size_t c = 1; c <= count; ++c) {
+        size_t end = c == count ? text.size() : text.size() / count * c;
+        end = std::max(end, begin);
+        end = end == text.size() ? end : std::min(text.find('\n', end), text.size() - 1) + 1;
+        pieces.push_back(text.substr(begin, end - begin));
+        begin = end;
+    }
+    return pieces;
+}
+
+// Same scene as ReadScene. The file is read with a single call, cut into newline-aligned
+// chunks that are parsed concurrently, and face indices are resolved in a second parallel
+// pass once the number of elements before every chunk is known. threads == 0 means one per
+// hardware thread.
+inline Scene ReadSceneParallel(std::string_view filename, size_t threads = 0) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::ifstream file(std::string(filename), std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Can't open file " + std::string(filename));
+    }
+    file.seekg(0, std::ios::end);
+    std::string text(static_cast<size_t>(file.tellg()), '\0');
+    file.seekg(0);
+    file.read(text.data(), text.size());
+
+    // A few chunks per thread even out the load when some of them hold only vertices.
+    auto pieces = SplitObjText(text, std::min(threads * 4, text.size() / 4096 + 1));
+    std::vector<ObjChunk> chunks(pieces.size());
+    ParallelFor(chunks.size(), threads, [&](size_t c) { chunks[c] = ParseObjChunk(pieces[c]); });
+
+    Scene scene;
+    ObjChunkSequence sequence(filename, scene);
+    std::vector<ObjChunkPrefix> prefixes;
+    size_t sphere_count = 0;
+    for (const auto& chunk : chunks) {
+        prefixes.push_back(sequence.Add(chunk));
+        sphere_count += chunk.spheres.size();
+    }
+    const auto& total = sequence.Total();
+
+    std::vector<Vector> vertices(total.vertices);
+    std::vector<Vector> textures(total.textures);
+    std::vector<Vector> normals(total.normals);
+    ParallelFor(chunks.size(), threads, [&](size_t c) {
+        std::copy(chunks[c].vertices.begin(), chunks[c].vertices.end(),
+                  vertices.begin() + prefixes[c].vertices);
+        std::copy(chunks[c].textures.begin(), chunks[c].textures.end(),
+                  textures.begin() + prefixes[c].textures);
+        std::copy(chunks[c].normals.begin(), chunks[c].normals.end(),
+                  normals.begin() + prefixes[c].normals);
+    });
+
+    std::vector<Object> objects(total.objects);
+    ParallelFor(chunks.size(), threads, [&](size_t c) {
+        size_t out = prefixes[c].objects;
+        ForEachChunkTriangle(chunks[c], prefixes[c], vertices, textures, normals,
+                             [&](const Object& object) { objects[out++] = object; });
+    });
+
+    scene.SetObjects(std::move(objects));
+    scene.Reserve(0, sphere_count);
+    for (size_t c = 0; c != chunks.size(); ++c) {
+        for (const auto& record : chunks[c].spheres) {
+            scene.AddSphereObject({prefixes[c].GetMaterial(record.material), record.sphere});
+        }
+        for (const auto& light : chunks[c].lights) {
+            scene.AddLight(light);
+        }
+    }
+    scene.Commit();
+    return scene;
+}
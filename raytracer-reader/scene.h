@@ -4,28 +4,220 @@
 #include <vector.h>
 #include <object.h>
 #include <light.h>
+#include <sphere_batch.h>
+#include <bvh.h>
+#include <compressed_mesh.h>
 
+#include <cstdint>
 #include <vector>
-#include <map>
+#include <optional>
+#include <stdexcept>
 #include <string>
 #include <fstream>
 
+// Stable ids for elements of a vector that is compacted by moving its last element into the
+// hole left by a removal.
+class HandleTable {
+public:
+    uint32_t Add(size_t index) {
+        index_of_.push_back(index);
+        id_of_.push_back(index_of_.size() - 1);
+        return index_of_.size() - 1;
+    }
+
+    size_t Index(uint32_t id) const {
+        if (id >= index_of_.size() || index_of_[id] == kRemoved) {
+            throw std::out_of_range("Stale scene handle");
+        }
+        return index_of_[id];
+    }
+
+    // Returns the index the element occupied; the last element now lives there.
+    size_t Remove(uint32_t id) {
+        size_t index = Index(id);
+        id_of_[index] = id_of_.back();
+        index_of_[id_of_[index]] = index;
+        id_of_.pop_back();
+        index_of_[id] = kRemoved;
+        return index;
+    }
+
+    size_t ByteSize() const {
+        return index_of_.capacity() * sizeof(size_t) + id_of_.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    static constexpr size_t kRemoved = -1;
+
+    std::vector<size_t> index_of_;
+    std::vector<uint32_t> id_of_;
+};
+
+struct ObjectHandle {
+    uint32_t id;
+};
+
+struct SphereHandle {
+    uint32_t id;
+};
+
+// Geometry can be edited through handles that stay valid until the element they refer to is
+// removed. Edits only mark the acceleration structures dirty; Commit() brings them up to date
+// before the next render, refitting the bounds in O(N) when only positions changed.
 class Scene {
 public:
+    // A refit never changes the topology, so boxes of moving objects drift apart and overlap.
+    // Past this growth of the traversal cost estimate the hierarchy is rebuilt from scratch.
+    static constexpr double kRebuildCostRatio = 1.5;
+
     const std::vector<Object>& GetObjects() const {
         return objects_;
     }
 
-    void AddObject(const Object& object) {
+    ObjectHandle AddObject(const Object& object) {
+        CheckEditable();
         objects_.push_back(object);
+        triangles_.rebuild = true;
+        ObjectHandle handle{object_handles_.Add(objects_.size() - 1)};
+        UpdateObjectsMemory();
+        return handle;
+    }
+
+    Object GetObject(ObjectHandle handle) const {
+        return GetTriangle(object_handles_.Index(handle.id));
+    }
+
+    // Triangle count and triangles by index, whether or not the geometry is compressed.
+    size_t GetTriangleCount() const {
+        return compressed_ ? compressed_mesh_.Size() : objects_.size();
+    }
+
+    Object GetTriangle(size_t index) const {
+        return compressed_ ? compressed_mesh_.GetObject(index) : objects_[index];
+    }
+
+    // Moves the triangles into a CompressedMesh (see there for the precision) and frees
+    // GetObjects(). Triangles can't be added, updated or removed afterwards; spheres, lights
+    // and materials stay editable. Needs a Commit() like any other geometry change.
+    void CompressGeometry(int position_bits = PositionQuantizer::kMaxBits) {
+        CheckEditable();
+        compressed_mesh_ = CompressedMesh(objects_, position_bits);
+        objects_ = {};
+        compressed_ = true;
+        triangles_.rebuild = true;
+        UpdateObjectsMemory();
+    }
+
+    bool IsCompressed() const {
+        return compressed_;
+    }
+
+    const CompressedMesh& GetCompressedMesh() const {
+        return compressed_mesh_;
+    }
+
+    void UpdateObject(ObjectHandle handle, const Object& object) {
+        CheckEditable();
+        objects_[object_handles_.Index(handle.id)] = object;
+        triangles_.refit = true;
+    }
+
+    // Moves the last object into the freed slot, so object indices are not stable across
+    // removals; handles are.
+    void RemoveObject(ObjectHandle handle) {
+        CheckEditable();
+        size_t index = object_handles_.Remove(handle.id);
+        objects_[index] = objects_.back();
+        objects_.pop_back();
+        triangles_.rebuild = true;
+    }
+
+    // Replaces all triangles at once, e.g. with a cleaned up or reordered copy. Object handles
+    // are reissued: handle i now refers to objects[i].
+    void SetObjects(std::vector<Object> objects) {
+        CheckEditable();
+        objects_ = std::move(objects);
+        object_handles_ = HandleTable();
+        for (size_t i = 0; i != objects_.size(); ++i) {
+            object_handles_.Add(i);
+        }
+        triangles_.rebuild = true;
+        UpdateObjectsMemory();
     }
 
     const std::vector<SphereObject>& GetSphereObjects() const {
         return sphere_objects_;
     }
 
-    void AddSphereObject(const SphereObject& sphere_object) {
+    SphereHandle AddSphereObject(const SphereObject& sphere_object) {
         sphere_objects_.push_back(sphere_object);
+        spheres_.rebuild = true;
+        SphereHandle handle{sphere_handles_.Add(sphere_objects_.size() - 1)};
+        UpdateSpheresMemory();
+        return handle;
+    }
+
+    const SphereObject& GetSphereObject(SphereHandle handle) const {
+        return sphere_objects_[sphere_handles_.Index(handle.id)];
+    }
+
+    void UpdateSphereObject(SphereHandle handle, const SphereObject& sphere_object) {
+        sphere_objects_[sphere_handles_.Index(handle.id)] = sphere_object;
+        spheres_.refit = true;
+    }
+
+    void RemoveSphereObject(SphereHandle handle) {
+        size_t index = sphere_handles_.Remove(handle.id);
+        sphere_objects_[index] = sphere_objects_.back();
+        sphere_objects_.pop_back();
+        spheres_.rebuild = true;
+    }
+
+    // Brings the acceleration structures in line with the geometry edits made since the last
+    // call. ReadScene commits, so only scenes edited afterwards need it.
+    void Commit() {
+        std::vector<Aabb> boxes;
+        if (triangles_.rebuild || triangles_.refit) {
+            for (size_t i = 0; i != GetTriangleCount(); ++i) {
+                boxes.push_back(GetBounds(compressed_ ? compressed_mesh_.GetPolygon(i)
+                                                      : objects_[i].polygon));
+            }
+            triangles_.Update(boxes);
+        }
+        if (spheres_.rebuild || spheres_.refit) {
+            boxes.clear();
+            for (const auto& object : sphere_objects_) {
+                boxes.push_back(GetBounds(object.sphere));
+            }
+            spheres_.Update(boxes);
+            sphere_batch_.Clear();
+            for (uint32_t index : spheres_.bvh.Order()) {
+                sphere_batch_.Add(sphere_objects_[index].sphere);
+            }
+        }
+    }
+
+    bool IsCommitted() const {
+        return !triangles_.rebuild && !triangles_.refit && !spheres_.rebuild && !spheres_.refit;
+    }
+
+    // Hierarchy over GetObjects(); leaves refer to objects through Order().
+    const Bvh& GetTriangleBvh() const {
+        CheckCommitted();
+        return triangles_.bvh;
+    }
+
+    // Hierarchy over GetSphereObjects(). The sphere batch is stored in its leaf order, so a
+    // leaf is the batch range [first, first + count) and batch index k is sphere
+    // GetSphereBvh().Order()[k].
+    const Bvh& GetSphereBvh() const {
+        CheckCommitted();
+        return spheres_.bvh;
+    }
+
+    const SphereBatch& GetSphereBatch() const {
+        CheckCommitted();
+        return sphere_batch_;
     }
 
     const std::vector<Light>& GetLights() const {
@@ -36,19 +228,105 @@ public:
         lights_.push_back(light);
     }
 
-    const std::map<std::string, Material>& GetMaterials() const {
+    void SetLights(const std::vector<Light>& lights) {
+        lights_ = lights;
+    }
+
+    const MaterialTable& GetMaterials() const {
         return materials_;
     }
 
-    void SetMaterials(const std::map<std::string, Material>& materials) {
+    void SetMaterials(const MaterialTable& materials) {
         materials_ = materials;
+        UpdateMaterialsMemory();
+    }
+
+    // See MaterialTable::Append.
+    std::vector<MaterialId> AddMaterials(const MaterialTable& materials) {
+        auto ids = materials_.Append(materials);
+        UpdateMaterialsMemory();
+        return ids;
+    }
+
+    // Replaces the shading parameters of an existing material, so objects that use it pick
+    // up the change.
+    void UpdateMaterial(const std::string& name, const Material& material) {
+        materials_[materials_.GetId(name)] = material;
+        UpdateMaterialsMemory();
+    }
+
+    // Preallocates primitive storage, so a loader that knows its counts builds the scene
+    // without growing the vectors.
+    void Reserve(size_t objects, size_t sphere_objects) {
+        objects_.reserve(objects);
+        sphere_objects_.reserve(sphere_objects);
+        UpdateObjectsMemory();
+        UpdateSpheresMemory();
     }
 
 private:
+    struct Accel {
+        Bvh bvh;
+        double built_cost = 0;
+        bool rebuild = false;
+        bool refit = false;
+
+        void Update(const std::vector<Aabb>& boxes) {
+            if (!rebuild) {
+                bvh.Refit(boxes);
+                rebuild = bvh.Cost() > kRebuildCostRatio * built_cost;
+            }
+            if (rebuild) {
+                bvh.Build(boxes);
+                built_cost = bvh.Cost();
+            }
+            rebuild = refit = false;
+        }
+    };
+
+    void CheckEditable() const {
+        if (compressed_) {
+            throw std::logic_error("Compressed triangles can't be edited");
+        }
+    }
+
+    // Handle tables grow with their arrays, so they are charged along with them. Only the
+    // category an edit touches is recounted: loaders add primitives one at a time, and the
+    // accounting changes only when a vector reallocates.
+    void UpdateObjectsMemory() {
+        objects_memory_.Set(objects_.capacity() * sizeof(Object) + compressed_mesh_.ByteSize() +
+                            object_handles_.ByteSize());
+    }
+
+    void UpdateSpheresMemory() {
+        spheres_memory_.Set(sphere_objects_.capacity() * sizeof(SphereObject) +
+                            sphere_handles_.ByteSize());
+    }
+
+    void UpdateMaterialsMemory() {
+        materials_memory_.Set(materials_.ByteSize());
+    }
+
+    void CheckCommitted() const {
+        if (!IsCommitted()) {
+            throw std::logic_error("Scene geometry was edited without Commit()");
+        }
+    }
+
     std::vector<Object> objects_;
+    CompressedMesh compressed_mesh_;
+    bool compressed_ = false;
+    HandleTable object_handles_;
+    Accel triangles_;
     std::vector<SphereObject> sphere_objects_;
+    HandleTable sphere_handles_;
+    Accel spheres_;
+    SphereBatch sphere_batch_;
     std::vector<Light> lights_;
-    std::map<std::string, Material> materials_;
+    MaterialTable materials_;
+    TrackedBytes objects_memory_{MemoryCategory::kObjects};
+    TrackedBytes spheres_memory_{MemoryCategory::kSpheres};
+    TrackedBytes materials_memory_{MemoryCategory::kMaterials};
 };
 
 std::vector<std::string> Split(const std::string& string, const std::string& delimiter = " ") {
@@ -104,6 +382,11 @@ int ToInt(const std::string& string) {
 Vector ParseVectorPos(const std::vector<std::string>& splitted, size_t& i) {
     std::vector<double> ans;
     for (size_t j = 0; j != 3; ++j) {
+        // Missing trailing components, as in two-component vt lines, are 0.
+        if (i == splitted.size()) {
+            ans.push_back(0);
+            continue;
+        }
         if (splitted[i++].empty()) {
             --j;
             continue;
@@ -140,12 +423,18 @@ Triangle GetTriangleByIndex(int i, int j, int k, const std::vector<Vector>& vect
     };
 }
 
-inline std::map<std::string, Material> ReadMaterials(std::string_view filename) {
-    std::map<std::string, Material> materials;
+inline MaterialTable ReadMaterials(std::string_view filename) {
+    MaterialTable materials;
     std::fstream file(filename.data(), std::fstream::in);
     std::string line;
-    Scene scene;
-    std::string current_material;
+    // Fields that precede any newmtl go to a material with an empty name.
+    std::optional<MaterialId> current_material;
+    auto current = [&]() -> Material& {
+        if (!current_material) {
+            current_material = materials.Add("");
+        }
+        return materials[*current_material];
+    };
 
     while (std::getline(file, line)) {
         auto splitted = Split(line, " \t");
@@ -157,34 +446,44 @@ inline std::map<std::string, Material> ReadMaterials(std::string_view filename)
         for (size_t i = 0; i != splitted.size();) {
             const auto& string = splitted[i++];
             if (string == "newmtl") {
-                current_material = splitted[i++];
-                materials[current_material].name = current_material;
+                current_material = materials.Add(splitted[i++]);
             } else if (string == "Ka") {
-                materials[current_material].ambient_color = ParseVectorPos(splitted, i);
+                current().ambient_color = ParseVectorPos(splitted, i);
             } else if (string == "Kd") {
-                materials[current_material].diffuse_color = ParseVectorPos(splitted, i);
+                current().diffuse_color = ParseVectorPos(splitted, i);
             } else if (string == "Ks") {
-                materials[current_material].specular_color = ParseVectorPos(splitted, i);
+                current().specular_color = ParseVectorPos(splitted, i);
             } else if (string == "Ke") {
-                materials[current_material].intensity = ParseVectorPos(splitted, i);
+                current().intensity = ParseVectorPos(splitted, i);
             } else if (string == "Ns") {
-                materials[current_material].specular_exponent = ToDouble(splitted[i++]);
+                current().specular_exponent = ToDouble(splitted[i++]);
             } else if (string == "Ni") {
-                materials[current_material].refraction_index = ToDouble(splitted[i++]);
+                current().refraction_index = ToDouble(splitted[i++]);
             } else if (string == "al") {
-                materials[current_material].albedo = ParseArrayPos(splitted, i);
+                current().albedo = ParseArrayPos(splitted, i);
+            } else if (string == "map_Kd" && i != splitted.size()) {
+                // Options such as -s may precede the file name, which comes last.
+                const std::string path(filename);
+                current().diffuse_map =
+                    path.substr(0, path.find_last_of('/') + 1) + splitted.back();
+                i = splitted.size();
             }
         }
     }
     return materials;
 }
 
+// usemtl looks names up in the library of the last mtllib before it. Every library adds its
+// own materials, so faces bound before a later library keep their definitions even when it
+// redefines the same names.
 inline Scene ReadScene(std::string_view filename) {
     std::fstream file(filename.data(), std::fstream::in);
     std::string line;
     Scene scene;
 
-    std::string current_material;
+    MaterialTable library;
+    std::vector<MaterialId> library_ids;
+    std::optional<MaterialId> current_material;
 
     std::vector<Vector> vertices;
     std::vector<Vector> textures;
@@ -200,10 +499,11 @@ inline Scene ReadScene(std::string_view filename) {
             const auto& string = splitted[i++];
             if (string == "mtllib") {
                 const std::string& path = filename.data();
-                scene.SetMaterials(
-                    ReadMaterials(path.substr(0, path.find_last_of('/') + 1) + splitted[i++]));
+                library =
+                    ReadMaterials(path.substr(0, path.find_last_of('/') + 1) + splitted[i++]);
+                library_ids = scene.AddMaterials(library);
             } else if (string == "usemtl") {
-                current_material = splitted[i++];
+                current_material = library_ids[library.GetId(splitted[i++])];
             } else if (string == "v") {
                 vertices.push_back(ParseVectorPos(splitted, i));
             } else if (string == "vt") {
@@ -214,7 +514,7 @@ inline Scene ReadScene(std::string_view filename) {
                 const auto& center = ParseVectorPos(splitted, i);
                 double radius = ToDouble(splitted[i++]);
                 scene.AddSphereObject(
-                    {&scene.GetMaterials().at(current_material), Sphere(center, radius)});
+                    {current_material.value(), Sphere(center, radius)});
             } else if (string == "P") {
                 const auto& position = ParseVectorPos(splitted, i);
                 const auto& intensity = ParseVectorPos(splitted, i);
@@ -247,7 +547,7 @@ inline Scene ReadScene(std::string_view filename) {
                 }
                 for (size_t j = 2; j != vertex_indexes.size(); ++j) {
                     scene.AddObject({
-                        &scene.GetMaterials().at(current_material),
+                        current_material.value(),
                         GetTriangleByIndex(0, j - 1, j, vertices, vertex_indexes),
                         GetTriangleByIndex(0, j - 1, j, textures, texture_indexes),
                         GetTriangleByIndex(0, j - 1, j, normals, normal_indexes),
@@ -256,5 +556,6 @@ inline Scene ReadScene(std::string_view filename) {
             }
         }
     }
+    scene.Commit();
     return scene;
 }
@@ -1,6 +1,13 @@
 #include <catch.hpp>
 
 #include <scene.h>
+#include <parallel_reader.h>
+#include <cluster_file.h>
+#include <mesh_optimizer.h>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
 
 #ifndef SHAD_TASK_DIR
 #define SHAD_TASK_DIR "./"
@@ -11,8 +18,8 @@ TEST_CASE("Scene", "[raytracer]") {
     const auto scene = ReadScene(dir_path + "tests/box/cube.obj");
     const double eps = 1e-6;
 
-    const auto& materials_map = scene.GetMaterials();
-    REQUIRE(materials_map.size() == 9);
+    const auto& materials = scene.GetMaterials();
+    REQUIRE(materials.Size() == 9);
 
     // objects
     const auto& objects = scene.GetObjects();
@@ -29,7 +36,7 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(std::fabs(normal_check[2] - 0.) < eps);
 
     for (const auto& object : objects) {
-        REQUIRE(materials_map.find(object.material->name) != materials_map.end());
+        REQUIRE(materials.GetId(materials.GetName(object.material_id)) == object.material_id);
     }
 
     // spheres
@@ -42,7 +49,7 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(std::fabs(center[2] - (-0.4)) < eps);
     REQUIRE(std::fabs(spheres[0].sphere.GetRadius() - 0.3) < eps);
     for (const auto& sphere : spheres) {
-        REQUIRE(materials_map.find(sphere.material->name) != materials_map.end());
+        REQUIRE(materials.GetId(materials.GetName(sphere.material_id)) == sphere.material_id);
     }
 
     // lights
@@ -55,21 +62,374 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(std::fabs(lights[1].intensity[2] - 0.5) < eps);
 
     // materials
-    const Material& right_sphere = materials_map.at("rightSphere");
+    const Material& right_sphere = materials.Get("rightSphere");
     REQUIRE(std::fabs(right_sphere.albedo[0] - 0.) < eps);
     REQUIRE(std::fabs(right_sphere.albedo[1] - 0.3) < eps);
     REQUIRE(std::fabs(right_sphere.albedo[2] - 0.7) < eps);
     REQUIRE(std::fabs(right_sphere.specular_exponent - 1024) < eps);
     REQUIRE(std::fabs(right_sphere.refraction_index - 1.8) < eps);
 
-    const Material& light = materials_map.at("light");
+    const Material& light = materials.Get("light");
     REQUIRE(std::fabs(light.ambient_color[1] - 0.78) < eps);
     REQUIRE(std::fabs(light.diffuse_color[2] - 0.78) < eps);
     REQUIRE(std::fabs(light.specular_color[1] - 0.) < eps);
     REQUIRE(std::fabs(light.intensity[2] - 1.) < eps);
 
-    const Vector& wall_behind_diffuse = materials_map.at("wallBehind").diffuse_color;
+    const Vector& wall_behind_diffuse = materials.Get("wallBehind").diffuse_color;
     REQUIRE(std::fabs(wall_behind_diffuse[0] - 0.2) < eps);
     REQUIRE(std::fabs(wall_behind_diffuse[1] - 0.7) < eps);
     REQUIRE(std::fabs(wall_behind_diffuse[2] - 0.8) < eps);
-}
\ No newline at end of file
+
+    // Objects refer to materials by id, so a copy is independent of the original.
+    auto copy = scene;
+    copy.UpdateMaterial("rightSphere", Material{});
+    REQUIRE(std::fabs(copy.GetMaterials().Get("rightSphere").albedo[1]) < eps);
+    REQUIRE(std::fabs(materials.Get("rightSphere").albedo[1] - 0.3) < eps);
+    REQUIRE(copy.GetSphereObjects()[1].material_id == spheres[1].material_id);
+}
+
+TEST_CASE("Scene handles", "[raytracer]") {
+    Scene scene;
+    std::vector<SphereHandle> handles;
+    for (int i = 0; i != 20; ++i) {
+        handles.push_back(scene.AddSphereObject({0, Sphere(Vector{1. * i, 0, 0}, 0.4)}));
+    }
+    auto triangle = scene.AddObject({0, Triangle{{0, 0, 0}, {1, 0, 0}, {0, 1, 0}}, {}, {}});
+    REQUIRE_THROWS(scene.GetSphereBvh());
+    scene.Commit();
+    REQUIRE(scene.GetSphereBatch().Size() == 20);
+    REQUIRE(scene.GetTriangleBvh().Order().size() == 1);
+
+    // Small moves only refit; the batch follows the new positions.
+    for (int i = 0; i != 20; ++i) {
+        scene.UpdateSphereObject(handles[i],
+                                 {0, Sphere(Vector{1. * i, 0.1, 0}, 0.4)});
+    }
+    REQUIRE(!scene.IsCommitted());
+    scene.Commit();
+    const auto& batch = scene.GetSphereBatch();
+    const auto& order = scene.GetSphereBvh().Order();
+    for (size_t k = 0; k != batch.Size(); ++k) {
+        REQUIRE(batch.X()[k] == scene.GetSphereObjects()[order[k]].sphere.GetCenter()[0]);
+        REQUIRE(batch.Y()[k] == 0.1);
+    }
+
+    scene.RemoveSphereObject(handles[3]);
+    scene.RemoveObject(triangle);
+    scene.Commit();
+    REQUIRE(scene.GetSphereObjects().size() == 19);
+    REQUIRE(scene.GetObjects().empty());
+    REQUIRE_THROWS(scene.GetSphereObject(handles[3]));
+    for (int i = 0; i != 20; ++i) {
+        if (i != 3) {
+            REQUIRE(scene.GetSphereObject(handles[i]).sphere.GetCenter()[0] == i);
+        }
+    }
+}
+
+void RequireSameScene(const Scene& expected, const Scene& actual) {
+    const auto& materials = expected.GetMaterials();
+    REQUIRE(actual.GetMaterials().Size() == materials.Size());
+    auto same_material = [&](MaterialId lhs, MaterialId rhs) {
+        const auto& a = materials[lhs];
+        const auto& b = actual.GetMaterials()[rhs];
+        return materials.GetName(lhs) == actual.GetMaterials().GetName(rhs) &&
+               Length(a.diffuse_color, b.diffuse_color) == 0 &&
+               Length(a.specular_color, b.specular_color) == 0 &&
+               Length(a.intensity, b.intensity) == 0 && a.albedo == b.albedo &&
+               a.diffuse_map == b.diffuse_map;
+    };
+    auto same_triangle = [](const Triangle& lhs, const Triangle& rhs) {
+        for (size_t i = 0; i != 3; ++i) {
+            for (size_t k = 0; k != 3; ++k) {
+                if (lhs[i][k] != rhs[i][k]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+    REQUIRE(actual.GetObjects().size() == expected.GetObjects().size());
+    size_t mismatches = 0;
+    for (size_t i = 0; i != expected.GetObjects().size(); ++i) {
+        const auto& lhs = expected.GetObjects()[i];
+        const auto& rhs = actual.GetObjects()[i];
+        mismatches += !same_material(lhs.material_id, rhs.material_id) ||
+                      !same_triangle(lhs.polygon, rhs.polygon) ||
+                      !same_triangle(lhs.texture, rhs.texture) ||
+                      !same_triangle(lhs.normal, rhs.normal);
+    }
+    REQUIRE(mismatches == 0);
+    REQUIRE(actual.GetSphereObjects().size() == expected.GetSphereObjects().size());
+    for (size_t i = 0; i != expected.GetSphereObjects().size(); ++i) {
+        const auto& lhs = expected.GetSphereObjects()[i];
+        const auto& rhs = actual.GetSphereObjects()[i];
+        REQUIRE(same_material(lhs.material_id, rhs.material_id));
+        REQUIRE(Length(lhs.sphere.GetCenter(), rhs.sphere.GetCenter()) == 0);
+        REQUIRE(lhs.sphere.GetRadius() == rhs.sphere.GetRadius());
+    }
+    REQUIRE(actual.GetLights().size() == expected.GetLights().size());
+    for (size_t i = 0; i != expected.GetLights().size(); ++i) {
+        const auto& lhs = expected.GetLights()[i];
+        const auto& rhs = actual.GetLights()[i];
+        REQUIRE(Length(lhs.position, rhs.position) == 0);
+        REQUIRE(Length(lhs.intensity, rhs.intensity) == 0);
+    }
+}
+
+TEST_CASE("Parallel scene loading", "[raytracer]") {
+    const std::string dir_path(SHAD_TASK_DIR);
+    const auto box = dir_path + "tests/box/cube.obj";
+    for (size_t threads : {1, 3, 8}) {
+        RequireSameScene(ReadScene(box), ReadSceneParallel(box, threads));
+    }
+
+    // Big enough to be cut into many chunks, with relative indices and materials that span
+    // chunk boundaries. The second library redefines both materials, which only usemtl
+    // statements after it pick up.
+    const auto dir = std::filesystem::temp_directory_path();
+    const auto obj = (dir / "raytracer_parallel_reader.obj").string();
+    {
+        std::ofstream mtl(dir / "raytracer_parallel_reader.mtl");
+        mtl << "newmtl red\nKd 1 0 0\nnewmtl blue\nKd 0 0 1\n";
+        std::ofstream later(dir / "raytracer_parallel_reader2.mtl");
+        later << "newmtl blue\nKd 0 0 0.5\nnewmtl red\nKd 0.5 0 0\n";
+        std::ofstream out(obj);
+        out << "mtllib raytracer_parallel_reader.mtl\n";
+        for (int i = 0; i != 3000; ++i) {
+            if (i == 1500) {
+                out << "mtllib raytracer_parallel_reader2.mtl\n";
+            }
+            if (i % 700 == 0) {
+                out << "usemtl " << (i % 1400 ? "blue" : "red") << "\n";
+            }
+            out << "v " << i << " " << i % 7 << " 0.5\nv " << i << " 1 " << i % 3 << "\n";
+            out << "vn 0 0 1\nv -1 " << i << " 2.25\n";
+            if (i % 2) {
+                out << "f -1//-1 -2//-1 -3//-1\n";
+            } else {
+                out << "f " << 3 * i + 1 << " -2 -1 " << (i ? 3 * i - 1 : 2) << "\n";
+            }
+            if (i % 1000 == 999) {
+                out << "S 0 " << i << " 0 0.5\nP 1 2 3 0.5 0.5 0.5\n";
+            }
+        }
+    }
+    const auto expected = ReadScene(obj);
+    REQUIRE(expected.GetObjects().size() == 4500);
+    REQUIRE(expected.GetMaterials().Size() == 4);
+    const auto& materials = expected.GetMaterials();
+    auto diffuse = [&](size_t object) {
+        return materials[expected.GetObjects()[object].material_id].diffuse_color;
+    };
+    // Faces 1400 and 1600 start at triangles 2100 and 2400 and are both bound to the first red.
+    REQUIRE(Length(diffuse(2100), Vector{1, 0, 0}) == 0);
+    REQUIRE(Length(diffuse(2400), Vector{1, 0, 0}) == 0);
+    REQUIRE(Length(diffuse(4499), Vector{0.5, 0, 0}) == 0);
+    for (size_t threads : {1, 2, 8}) {
+        RequireSameScene(expected, ReadSceneParallel(obj, threads));
+    }
+    std::filesystem::remove(obj);
+    std::filesystem::remove(dir / "raytracer_parallel_reader.mtl");
+    std::filesystem::remove(dir / "raytracer_parallel_reader2.mtl");
+}
+
+TEST_CASE("Cluster file", "[raytracer]") {
+    const std::string dir_path(SHAD_TASK_DIR);
+    const auto scene = ReadScene(dir_path + "tests/box/cube.obj");
+    const auto path = (std::filesystem::temp_directory_path() / "raytracer_reader.clusters").string();
+    WriteClusterFile(scene, path, 3);
+
+    ClusterStore store(path, 0);
+    const auto& clusters = store.GetClusters();
+    REQUIRE(store.GetTriangleCount() == scene.GetTriangleCount());
+    REQUIRE(clusters.size() == 4);
+    std::vector<int> seen(scene.GetTriangleCount());
+    for (size_t c = 0; c != clusters.size(); ++c) {
+        auto cluster = store.Load(c);
+        REQUIRE(cluster->objects.size() == clusters[c].count);
+        REQUIRE(clusters[c].first == 3 * c);
+        for (const auto& object : cluster->objects) {
+            for (size_t v = 0; v != 3; ++v) {
+                for (size_t k = 0; k != 3; ++k) {
+                    REQUIRE(clusters[c].bounds.min[k] <= object.polygon[v][k]);
+                    REQUIRE(object.polygon[v][k] <= clusters[c].bounds.max[k]);
+                }
+            }
+            for (size_t i = 0; i != scene.GetTriangleCount(); ++i) {
+                const auto expected = scene.GetTriangle(i);
+                if (Length(expected.polygon[0], object.polygon[0]) == 0 &&
+                    Length(expected.polygon[2], object.polygon[2]) == 0) {
+                    REQUIRE(expected.material_id == object.material_id);
+                    ++seen[i];
+                }
+            }
+        }
+    }
+    REQUIRE(seen == std::vector<int>(scene.GetTriangleCount(), 1));
+
+    // A zero budget keeps only the most recent cluster resident, while clusters still held by
+    // a caller stay usable.
+    auto first = store.Load(0);
+    store.Load(1);
+    REQUIRE(store.MemoryUsage() == store.Load(1)->ByteSize());
+    REQUIRE(first->objects.size() == 3);
+    const size_t page_ins = store.PageIns();
+    store.Load(1);
+    REQUIRE(store.PageIns() == page_ins);
+    store.Load(0);
+    REQUIRE(store.PageIns() == page_ins + 1);
+
+    const auto scene_only = WithoutTriangles(scene);
+    REQUIRE(scene_only.GetTriangleCount() == 0);
+    REQUIRE(scene_only.GetSphereObjects().size() == scene.GetSphereObjects().size());
+    REQUIRE(scene_only.GetLights().size() == scene.GetLights().size());
+    REQUIRE(scene_only.GetMaterials().Size() == scene.GetMaterials().Size());
+
+    REQUIRE_THROWS_AS(ClusterStore(dir_path + "tests/box/cube.obj", 0), std::runtime_error);
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Cluster file from OBJ", "[raytracer]") {
+    // Quads scattered over a box, with relative indices, material switches, spheres and
+    // lights, converted in blocks of a few lines and buckets of a few triangles.
+    const auto dir = std::filesystem::temp_directory_path();
+    const auto obj = (dir / "raytracer_clusters.obj").string();
+    {
+        std::ofstream mtl(dir / "raytracer_clusters.mtl");
+        mtl << "newmtl red\nKd 1 0 0\nnewmtl blue\nKd 0 0 1\n";
+        std::ofstream out(obj);
+        out << "mtllib raytracer_clusters.mtl\n";
+        for (int i = 0; i != 1000; ++i) {
+            if (i % 300 == 0) {
+                out << "usemtl " << (i % 600 ? "blue" : "red") << "\n";
+            }
+            const int x = i * 37 % 101;
+            const int y = i * 53 % 17;
+            out << "v " << x << " " << y << " " << i % 5 << "\nv " << x + 1 << " " << y << " 0\n";
+            out << "v " << x + 1 << " " << y + 1 << " 0\nv " << x << " " << y + 1 << " 1\n";
+            out << "vn 0 0 1\nf -4//-1 -3//-1 -2//-1 -1//-1\n";
+            if (i % 400 == 399) {
+                out << "S 0 " << i << " 0 0.5\nP 1 2 3 0.5 0.5 0.5\n";
+            }
+        }
+    }
+    const auto scene = ReadScene(obj);
+    const auto expected_path = (dir / "raytracer_expected.clusters").string();
+    const auto path = (dir / "raytracer_converted.clusters").string();
+    WriteClusterFile(scene, expected_path, 16);
+    ClusterStore expected(expected_path, 0);
+
+    for (size_t block_size : {700, 1 << 20}) {
+        ClusterConversionOptions options;
+        options.cluster_size = 16;
+        options.block_size = block_size;
+        options.threads = 2;
+        RequireSameScene(WithoutTriangles(scene), ConvertObjToClusterFile(obj, path, options));
+        REQUIRE_FALSE(std::filesystem::exists(path + ".triangles"));
+
+        ClusterStore store(path, 0);
+        REQUIRE(store.GetTriangleCount() == 2000);
+        REQUIRE(store.GetClusters().size() == expected.GetClusters().size());
+        size_t mismatches = 0;
+        for (size_t c = 0; c != expected.GetClusters().size(); ++c) {
+            const auto& lhs = expected.GetClusters()[c];
+            const auto& rhs = store.GetClusters()[c];
+            mismatches += lhs.first != rhs.first || lhs.count != rhs.count ||
+                          lhs.offset != rhs.offset || Length(lhs.bounds.min, rhs.bounds.min) != 0 ||
+                          Length(lhs.bounds.max, rhs.bounds.max) != 0;
+            const auto lhs_cluster = expected.Load(c);
+            const auto rhs_cluster = store.Load(c);
+            for (size_t i = 0; i != lhs_cluster->objects.size(); ++i) {
+                const auto& a = lhs_cluster->objects[i];
+                const auto& b = rhs_cluster->objects[i];
+                for (size_t v = 0; v != 3; ++v) {
+                    mismatches += a.material_id != b.material_id ||
+                                  Length(a.polygon[v], b.polygon[v]) != 0 ||
+                                  Length(a.normal[v], b.normal[v]) != 0;
+                }
+            }
+        }
+        REQUIRE(mismatches == 0);
+    }
+
+    std::filesystem::remove(obj);
+    std::filesystem::remove(dir / "raytracer_clusters.mtl");
+    std::filesystem::remove(expected_path);
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Mesh optimization", "[raytracer]") {
+    Scene scene;
+    // A strip of quads along x in scrambled order, each split into two triangles that repeat
+    // their shared corners, with one corner off by 1e-7.
+    for (int n = 0; n != 50; ++n) {
+        const int i = 7 * n % 50;
+        const double x = i;
+        const double jitter = i == 10 ? 1e-7 : 0;
+        scene.AddObject({0, Triangle{{x, 0, 0}, {x + 1, 0, 0}, {x + 1, 1, 0}}, {}, {}});
+        scene.AddObject({0, Triangle{{x, 0, 0}, {x + 1, 1 + jitter, 0}, {x, 1, 0}}, {}, {}});
+    }
+    // Collinear, collapsed and repeated (rotated but same winding) faces.
+    scene.AddObject({0, Triangle{{0, 0, 0}, {1, 1, 1}, {2, 2, 2}}, {}, {}});
+    scene.AddObject({0, Triangle{{3, 0, 0}, {3, 0, 0}, {4, 1, 0}}, {}, {}});
+    scene.AddObject({0, Triangle{{1, 1, 0}, {0, 0, 0}, {1, 0, 0}}, {}, {}});
+    // The reverse winding and another material are different faces.
+    scene.AddObject({0, Triangle{{0, 0, 0}, {1, 1, 0}, {1, 0, 0}}, {}, {}});
+    scene.AddObject({1, Triangle{{0, 0, 0}, {1, 0, 0}, {1, 1, 0}}, {}, {}});
+    scene.Commit();
+
+    auto exact = scene;
+    auto report = OptimizeMesh(exact);
+    REQUIRE(report.triangles_before == 105);
+    REQUIRE(report.degenerate_triangles == 2);
+    REQUIRE(report.duplicate_triangles == 1);
+    REQUIRE(report.triangles_after == 102);
+    REQUIRE(exact.GetObjects().size() == 102);
+    REQUIRE(report.vertices_before == 2 * 51 + 1 + 2);
+    REQUIRE(report.vertices_after == report.vertices_before);
+    REQUIRE(report.welded_corners == 0);
+    REQUIRE(report.bytes_after == 102 * sizeof(Object));
+    REQUIRE(report.bytes_before - report.bytes_after >= 3 * sizeof(Object));
+    REQUIRE(exact.IsCommitted());
+
+    // Welding closes the crack at the jittered corner.
+    auto welded = scene;
+    MeshOptimizationOptions options;
+    options.weld_distance = 1e-6;
+    report = OptimizeMesh(welded, options);
+    REQUIRE(report.welded_corners == 1);
+    REQUIRE(report.vertices_after == report.vertices_before - 1);
+    REQUIRE(report.triangles_after == 102);
+
+    // Morton order visits one half of the strip before the other, whatever the input order.
+    const auto& objects = welded.GetObjects();
+    auto center_x = [&objects](size_t i) {
+        const auto& p = objects[i].polygon;
+        return (p[0][0] + p[1][0] + p[2][0]) / 3;
+    };
+    size_t left = 0;
+    while (left != objects.size() && center_x(left) < 25) {
+        ++left;
+    }
+    REQUIRE(left >= 50);
+    for (size_t i = left; i != objects.size(); ++i) {
+        REQUIRE(center_x(i) > 25);
+    }
+
+    std::ostringstream out;
+    report.Print(out);
+    REQUIRE(out.str().find("2 degenerate, 1 duplicate removed") != std::string::npos);
+
+    options.weld_distance = -1;
+    REQUIRE_THROWS_AS(OptimizeMesh(welded, options), std::invalid_argument);
+
+    // Real scenes keep their geometry.
+    const std::string dir_path(SHAD_TASK_DIR);
+    auto box = ReadScene(dir_path + "tests/box/cube.obj");
+    const size_t triangles = box.GetTriangleCount();
+    report = OptimizeMesh(box);
+    REQUIRE(report.triangles_after + report.degenerate_triangles + report.duplicate_triangles ==
+            triangles);
+    REQUIRE(box.GetTriangleCount() == report.triangles_after);
+}
@@ -0,0 +1,324 @@
+#pragma once
+
+#include <scene.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+// Direct lighting of many hits at once. Hits are binned by material, so that every material is
+// loaded once per batch, and each light is applied to a whole bin in a loop over flat arrays
+// that GCC vectorizes. The square roots and powers of CalculateBase are replaced by the
+// branch-free approximations below, accurate to about 1e-13; integer specular exponents,
+// the usual case, are raised by repeated squaring instead.
+
+inline uint64_t DoubleBits(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline double BitsDouble(uint64_t bits) {
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// 1 / sqrt(x) for x > 0: the classic bit-pattern estimate refined by four Newton steps, each of
+// which doubles the correct digits.
+inline double FastInvSqrt(double x) {
+    double y = BitsDouble(0x5fe6eb50c7b537a9 - (DoubleBits(x) >> 1));
+    for (int i = 0; i != 4; ++i) {
+        y = y * (1.5 - 0.5 * x * y * y);
+    }
+    return y;
+}
+
+// log2(x) for x >= 0, about -1022.5 for 0. The exponent is read from the bits and converted to
+// double by the 2^52 trick, since SSE2 can't convert 64-bit integers.
+inline double FastLog2(double x) {
+    const uint64_t bits = DoubleBits(x);
+    const double mantissa = BitsDouble((bits & 0x000fffffffffffff) | 0x3ff0000000000000);
+    const double exponent = BitsDouble(0x4330000000000000 | (bits >> 52)) - 4503599627370496.0;
+    // ln(m) = ln(sqrt(2)) + 2 atanh(s) with s = (m - sqrt(2)) / (m + sqrt(2)), |s| < 0.172 for
+    // m in [1, 2). Centering on sqrt(2) avoids a select, which the vectorizer refuses as the
+    // arithmetic in it might trap.
+    const double s = (mantissa - 1.4142135623730951) / (mantissa + 1.4142135623730951);
+    const double s2 = s * s;
+    double p = 1.0 / 19;
+    p = p * s2 + 1.0 / 17;
+    p = p * s2 + 1.0 / 15;
+    p = p * s2 + 1.0 / 13;
+    p = p * s2 + 1.0 / 11;
+    p = p * s2 + 1.0 / 9;
+    p = p * s2 + 1.0 / 7;
+    p = p * s2 + 1.0 / 5;
+    p = p * s2 + 1.0 / 3;
+    p = p * s2 + 1;
+    return (exponent - 1022.5) + 2 * s * p * 1.4426950408889634;
+}
+
+// 2^y for y <= 0, clamped at 2^-512 so that products with it never turn into denormals,
+// which are slow enough to undo the vectorization.
+inline double FastExp2(double y) {
+    // max(y, -512) as arithmetic: GCC doesn't vectorize the select here.
+    y = 0.5 * (y - 512 + std::fabs(y + 512));
+    // Adding 1.5 * 2^52 rounds y to an integer n that lands in the low mantissa bits.
+    constexpr double kShift = 6755399441055744.0;
+    const double shifted = y + kShift;
+    const double n = shifted - kShift;
+    const uint64_t scale_bits = (DoubleBits(shifted) - DoubleBits(kShift) + 1023) << 52;
+    // e^t for |t| <= ln(2) / 2, Taylor polynomial.
+    const double t = (y - n) * 0.6931471805599453;
+    double p = 1.0 / 39916800;
+    p = p * t + 1.0 / 3628800;
+    p = p * t + 1.0 / 362880;
+    p = p * t + 1.0 / 40320;
+    p = p * t + 1.0 / 5040;
+    p = p * t + 1.0 / 720;
+    p = p * t + 1.0 / 120;
+    p = p * t + 1.0 / 24;
+    p = p * t + 1.0 / 6;
+    p = p * t + 0.5;
+    p = p * t + 1;
+    p = p * t + 1;
+    return p * BitsDouble(scale_bits);
+}
+
+// Exact max(x, 0) that vectorizes where a select doesn't.
+inline double PositivePart(double x) {
+    return 0.5 * (x + std::fabs(x));
+}
+
+// x^e for x in [0, 1] and e >= 0, with 0^0 = 1 like std::pow; results below 2^-512 are
+// rounded up to it.
+inline double FastUnitPow(double x, double e) {
+    return FastExp2(e * FastLog2(x));
+}
+
+// Points a light is applied to at a time.
+constexpr size_t kShadingChunk = 256;
+
+// CalculateBase arguments of one hit, apart from the scene.
+struct ShadingPoint {
+    Vector position;
+    Vector normal;
+    Vector from;
+    Vector diffuse_color;
+    MaterialId material_id;
+};
+
+// Planar arrays of the points of one material bin.
+struct ShadingPlanes {
+    const double* px;
+    const double* py;
+    const double* pz;
+    const double* nx;
+    const double* ny;
+    const double* nz;
+    // Unit vector towards the ray origin.
+    const double* ex;
+    const double* ey;
+    const double* ez;
+    const double* dr;
+    const double* dg;
+    const double* db;
+};
+
+// x[i]^n for x[i] in [0, 1] and an integer n >= 0 by repeated squaring, one pass over the
+// array per bit of n. Intermediate values are kept above 2^-256 for the reason of FastExp2.
+inline void UnitPowInt(double* __restrict x, size_t count, uint64_t n) {
+    constexpr double kFloor = 8.636168555094445e-78;  // 2^-256
+    double result[kShadingChunk];
+    for (size_t i = 0; i < count; ++i) {
+        result[i] = 1;
+    }
+    while (n) {
+        if (n & 1) {
+            for (size_t i = 0; i < count; ++i) {
+                const double v = result[i] * x[i];
+                result[i] = 0.5 * (v + kFloor + std::fabs(v - kFloor));
+            }
+        }
+        n >>= 1;
+        if (n) {
+            for (size_t i = 0; i < count; ++i) {
+                const double v = x[i] * x[i];
+                x[i] = 0.5 * (v + kFloor + std::fabs(v - kFloor));
+            }
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        x[i] = result[i];
+    }
+}
+
+// Adds one light to at most kShadingChunk points of a bin. visible is 1 or 0 per point;
+// albedo, the specular color and the exponent belong to the material of the bin. The specular
+// power gets a pass of its own, since a single loop doing everything runs out of vector
+// registers.
+template <bool kSpecular>
+void AccumulateLight(ShadingPlanes p, size_t count, const Light& light, double albedo,
+                     const Vector& specular_color, double exponent,
+                     const double* __restrict visible, double* __restrict r,
+                     double* __restrict g, double* __restrict b) {
+    const double lx = light.position[0];
+    const double ly = light.position[1];
+    const double lz = light.position[2];
+    const double ir = light.intensity[0];
+    const double ig = light.intensity[1];
+    const double ib = light.intensity[2];
+    const double* __restrict px = p.px;
+    const double* __restrict py = p.py;
+    const double* __restrict pz = p.pz;
+    const double* __restrict nx = p.nx;
+    const double* __restrict ny = p.ny;
+    const double* __restrict nz = p.nz;
+    double cos_eye[kShadingChunk];
+    for (size_t i = 0; i < count; ++i) {
+        double vx = lx - px[i];
+        double vy = ly - py[i];
+        double vz = lz - pz[i];
+        const double inv_length = FastInvSqrt(vx * vx + vy * vy + vz * vz);
+        vx *= inv_length;
+        vy *= inv_length;
+        vz *= inv_length;
+        const double cos_light = nx[i] * vx + ny[i] * vy + nz[i] * vz;
+        const double diffuse = albedo * PositivePart(cos_light) * visible[i];
+        r[i] += diffuse * p.dr[i] * ir;
+        g[i] += diffuse * p.dg[i] * ig;
+        b[i] += diffuse * p.db[i] * ib;
+        if constexpr (kSpecular) {
+            // Reflect(-v_l, normal).
+            const double rx = 2 * cos_light * nx[i] - vx;
+            const double ry = 2 * cos_light * ny[i] - vy;
+            const double rz = 2 * cos_light * nz[i] - vz;
+            cos_eye[i] = PositivePart(p.ex[i] * rx + p.ey[i] * ry + p.ez[i] * rz);
+        }
+    }
+    if constexpr (kSpecular) {
+        if (exponent < 0) {
+            // Powers the approximation doesn't cover; hidden lights add nothing even where
+            // the power is infinite.
+            for (size_t i = 0; i < count; ++i) {
+                cos_eye[i] = visible[i] != 0 ? std::pow(cos_eye[i], exponent) : 0;
+            }
+        } else if (exponent == std::floor(exponent) && exponent < 65536) {
+            UnitPowInt(cos_eye, count, static_cast<uint64_t>(exponent));
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                cos_eye[i] = FastUnitPow(cos_eye[i], exponent);
+            }
+        }
+        const double sr = albedo * specular_color[0] * ir;
+        const double sg = albedo * specular_color[1] * ig;
+        const double sb = albedo * specular_color[2] * ib;
+        for (size_t i = 0; i < count; ++i) {
+            const double specular = cos_eye[i] * visible[i];
+            r[i] += specular * sr;
+            g[i] += specular * sg;
+            b[i] += specular * sb;
+        }
+    }
+}
+
+// CalculateBase of every point; occluded[i * lights + k] tells whether light k is blocked for
+// point i, as FindOcclusions returns it for the shadow rays of the points in order.
+inline std::vector<Vector> CalculateBases(const Scene& scene,
+                                          const std::vector<ShadingPoint>& points,
+                                          const std::vector<char>& occluded) {
+    const auto& lights = scene.GetLights();
+    const auto& materials = scene.GetMaterials();
+    if (occluded.size() != points.size() * lights.size()) {
+        throw std::invalid_argument("Occlusion flags don't match the points and lights");
+    }
+
+    // Counting sort of the points by material.
+    std::vector<size_t> bin_begin(materials.Size() + 1, 0);
+    for (const auto& point : points) {
+        ++bin_begin[point.material_id + 1];
+    }
+    for (size_t m = 0; m != materials.Size(); ++m) {
+        bin_begin[m + 1] += bin_begin[m];
+    }
+    std::vector<uint32_t> order(points.size());
+    {
+        auto next = bin_begin;
+        for (uint32_t i = 0; i != points.size(); ++i) {
+            order[next[points[i].material_id]++] = i;
+        }
+    }
+
+    std::vector<Vector> bases(points.size());
+    std::vector<double> planes[12];
+    std::vector<double> visible;
+    std::vector<double> color[3];
+    for (MaterialId m = 0; m != materials.Size(); ++m) {
+        const size_t begin = bin_begin[m];
+        const size_t count = bin_begin[m + 1] - begin;
+        if (!count) {
+            continue;
+        }
+        const auto& material = materials[m];
+        const Vector emitted = Vector{0, 0, 0} + material.ambient_color + material.intensity;
+        const auto& specular = material.specular_color;
+        const bool has_specular = specular[0] != 0 || specular[1] != 0 || specular[2] != 0;
+        if (material.albedo[0] == 0 || lights.empty()) {
+            for (size_t j = begin; j != begin + count; ++j) {
+                bases[order[j]] = emitted;
+            }
+            continue;
+        }
+
+        for (auto& plane : planes) {
+            plane.resize(count);
+        }
+        visible.resize(count * lights.size());
+        for (size_t c = 0; c != 3; ++c) {
+            color[c].assign(count, emitted[c]);
+        }
+        for (size_t j = 0; j != count; ++j) {
+            const auto& point = points[order[begin + j]];
+            Vector eye(point.position, point.from);
+            eye.Normalize();
+            for (int c = 0; c != 3; ++c) {
+                planes[c][j] = point.position[c];
+                planes[3 + c][j] = point.normal[c];
+                planes[6 + c][j] = eye[c];
+                planes[9 + c][j] = point.diffuse_color[c];
+            }
+            const char* blocked = occluded.data() + order[begin + j] * lights.size();
+            for (size_t k = 0; k != lights.size(); ++k) {
+                visible[k * count + j] = blocked[k] ? 0 : 1;
+            }
+        }
+        // Chunk by chunk, so that the points stay in L1 while all the lights go over them.
+        for (size_t chunk = 0; chunk < count; chunk += kShadingChunk) {
+            const size_t n = std::min(kShadingChunk, count - chunk);
+            const ShadingPlanes p{&planes[0][chunk],  &planes[1][chunk], &planes[2][chunk],
+                                  &planes[3][chunk],  &planes[4][chunk], &planes[5][chunk],
+                                  &planes[6][chunk],  &planes[7][chunk], &planes[8][chunk],
+                                  &planes[9][chunk], &planes[10][chunk], &planes[11][chunk]};
+            double* r = &color[0][chunk];
+            double* g = &color[1][chunk];
+            double* b = &color[2][chunk];
+            for (size_t k = 0; k != lights.size(); ++k) {
+                const double* light_visible = &visible[k * count + chunk];
+                if (has_specular) {
+                    AccumulateLight<true>(p, n, lights[k], material.albedo[0], specular,
+                                          material.specular_exponent, light_visible, r, g, b);
+                } else {
+                    AccumulateLight<false>(p, n, lights[k], material.albedo[0], specular, 0,
+                                           light_visible, r, g, b);
+                }
+            }
+        }
+        for (size_t j = 0; j != count; ++j) {
+            bases[order[begin + j]] = {color[0][j], color[1][j], color[2][j]};
+        }
+    }
+    return bases;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <camera_options.h>
+#include <vector.h>
+#include <ray.h>
+
+#include <cmath>
+
+// Pinhole camera. The orthonormal basis and the screen scale are computed once; primary rays
+// are then generated on demand, so rendering needs no per-pixel direction table.
+class Camera {
+public:
+    static constexpr double kEps = 1e-9;
+
+    explicit Camera(const CameraOptions& camera_options)
+        : origin_(camera_options.look_from),
+          width_(camera_options.screen_width),
+          height_(camera_options.screen_height) {
+        forward_ = Vector(camera_options.look_from) - Vector(camera_options.look_to);
+        forward_.Normalize();
+        right_ = CrossProduct({0, 1, 0}, forward_);
+        if (1 - std::fabs(forward_[1]) < kEps) {
+            right_ = {1, 0, 0};
+        }
+        right_.Normalize();
+        up_ = CrossProduct(forward_, right_);
+        up_.Normalize();
+
+        double scale = std::tan(camera_options.fov / 2);
+        scale_x_ = scale * width_ / height_;
+        scale_y_ = scale;
+    }
+
+    // Ray through the point (x + dx, y + dy) of the screen, where (x, y) is a pixel and
+    // dx, dy in [0, 1) is the offset inside it; the defaults aim at the pixel center.
+    Ray GetRay(int x, int y, double dx = 0.5, double dy = 0.5) const {
+        double sx = (2 * (x + dx) / width_ - 1) * scale_x_;
+        double sy = (2 * (y + dy) / height_ - 1) * scale_y_;
+        Vector direction = sx * right_ + (-sy) * up_ - forward_;
+        direction.Normalize();
+        return Ray(origin_, direction);
+    }
+
+    const Vector& GetOrigin() const {
+        return origin_;
+    }
+
+    // Angle between the rays of vertically adjacent pixels near the center of the screen.
+    double GetPixelSpread() const {
+        return 2 * scale_y_ / height_;
+    }
+
+private:
+    Vector origin_;
+    Vector right_;
+    Vector up_;
+    Vector forward_;
+    double width_;
+    double height_;
+    double scale_x_;
+    double scale_y_;
+};
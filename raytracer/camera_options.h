@@ -2,6 +2,15 @@
 
 #include <array>
 #include <cmath>
+#include <optional>
+
+// Pixel rectangle of the full frame, top-left corner at (x, y).
+struct CropWindow {
+    int x;
+    int y;
+    int width;
+    int height;
+};
 
 struct CameraOptions {
     int screen_width;
@@ -9,6 +18,8 @@ struct CameraOptions {
     double fov;
     std::array<double, 3> look_from;
     std::array<double, 3> look_to;
+    // When set, only these pixels are traced; rays stay exactly those of the full frame.
+    std::optional<CropWindow> crop;
 
     CameraOptions(int width, int height, double fov = M_PI / 2,
                   std::array<double, 3> look_from = {0.0, 0.0, 0.0},
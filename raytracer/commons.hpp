@@ -1,6 +1,7 @@
 #pragma once
 
 #include <image.h>
+#include <image_diff.h>
 
 #include <cmath>
 #include <string>
@@ -23,20 +24,10 @@ inline double PixelDistance(const RGB& lhs, const RGB& rhs) {
 }
 
 inline void Compare(const Image& actual, const Image& expected) {
-    static const double kEps = 2;
-    int matches = 0;
-
     REQUIRE(actual.Width() == expected.Width());
     REQUIRE(actual.Height() == expected.Height());
-    for (int y = 0; y < actual.Height(); ++y) {
-        for (int x = 0; x < actual.Width(); ++x) {
-            auto actual_data = actual.GetPixel(y, x);
-            auto expected_data = expected.GetPixel(y, x);
-            auto diff = PixelDistance(actual_data, expected_data);
-            matches += diff < kEps;
-        }
-    }
-
-    double similarity = static_cast<double>(matches) / (actual.Width() * actual.Height());
-    REQUIRE(similarity >= 0.99);
-}
\ No newline at end of file
+    auto diff = DiffImages(actual, expected);
+    INFO("max " << diff.max_distance << ", mean " << diff.mean_distance << ", PSNR "
+                << diff.psnr << " dB");
+    REQUIRE(diff.Similarity() >= 0.99);
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <raytracer.h>
+#include <parallel_for.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+struct DenoiseOptions {
+    // À-trous passes; pass i spreads the 5x5 B3-spline kernel over taps 2^i pixels apart, so
+    // five passes cover a 125x125 footprint.
+    int iterations = 5;
+    // Edge-stopping tolerances. The color one is in units of the relative noise level of the
+    // frame (see EstimateNoise) and halves every pass, so that later, wider passes only
+    // average pixels that already agree.
+    float color_sigma = 2;
+    // Length of the difference of two unit normals.
+    float normal_sigma = 0.3;
+    // Depth difference relative to the depth, per pixel of tap distance.
+    float depth_sigma = 0.05;
+    // 0 means one per hardware thread.
+    size_t threads = 0;
+};
+
+// exp(x) for x <= 0 within 2e-5 relative error, plenty for filter weights, and written so
+// that loops over it vectorize: 2^x is split into an integer power built in the exponent
+// bits and a polynomial for the fraction.
+inline float FastExp(float x) {
+    // max(x, -87) on the bit patterns: for negative floats a larger magnitude is a larger
+    // unsigned integer, and GCC if-converts integer selects but not float compares, which
+    // may trap.
+    uint32_t x_bits;
+    std::memcpy(&x_bits, &x, sizeof(x_bits));
+    constexpr uint32_t kMinBits = 0xc2ae0000;  // -87.f
+    x_bits = x_bits > kMinBits ? kMinBits : x_bits;
+    std::memcpy(&x, &x_bits, sizeof(x));
+    float y = x * 1.44269504f;
+    int32_t whole = static_cast<int32_t>(y);
+    float f = y - static_cast<float>(whole);
+    // 2^f for f in (-1, 0], Taylor polynomial.
+    float p = 1.53533005e-4f;
+    p = p * f + 1.33995623e-3f;
+    p = p * f + 9.61817697e-3f;
+    p = p * f + 5.55036440e-2f;
+    p = p * f + 2.40226507e-1f;
+    p = p * f + 6.93147182e-1f;
+    p = p * f + 1.f;
+    int32_t bits = (whole + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+// Squared distance between two colors relative to their brightness. Monte Carlo noise grows with the
+// radiance, so this treats dim and bright regions alike.
+inline float RelativeDistance2(float r0, float g0, float b0, float r1, float g1, float b1) {
+    float dr = r1 - r0;
+    float dg = g1 - g0;
+    float db = b1 - b0;
+    return (dr * dr + dg * dg + db * db) /
+           (r0 * r0 + g0 * g0 + b0 * b0 + r1 * r1 + g1 * g1 + b1 * b1 + 1e-8f);
+}
+
+// Relative noise level of a frame: the median RelativeDistance2 between horizontal neighbours
+// whose guides agree, which on smooth surfaces is dominated by noise rather than shading.
+// Never 0, so that noiseless frames still get a finite tolerance.
+inline float EstimateNoise(const RadianceBuffer& buffer, const std::vector<double>& depth,
+                           const std::vector<Vector>& normals) {
+    std::vector<float> distances;
+    const float* px = buffer.Data().data();
+    for (int y = 0; y != buffer.Height(); ++y) {
+        for (int x = 0; x + 1 < buffer.Width(); ++x) {
+            size_t i = static_cast<size_t>(y) * buffer.Width() + x;
+            if (Length(normals[i], normals[i + 1]) > 1e-3 ||
+                std::fabs(depth[i] - depth[i + 1]) > 1e-2 * std::fabs(depth[i])) {
+                continue;
+            }
+            const float* a = px + 3 * i;
+            distances.push_back(RelativeDistance2(a[0], a[1], a[2], a[3], a[4], a[5]));
+        }
+    }
+    if (distances.empty()) {
+        return 1e-3;
+    }
+    auto median = distances.begin() + distances.size() / 2;
+    std::nth_element(distances.begin(), median, distances.end());
+    return std::max(std::sqrt(*median), 1e-3f);
+}
+
+// Pointers to one pixel of the planar color and guide buffers.
+struct DenoisePlanes {
+    const float* r;
+    const float* g;
+    const float* b;
+    const float* nx;
+    const float* ny;
+    const float* nz;
+    const float* z;
+};
+
+// Adds the tap `shift` pixels away to the weighted sums of the pixels [x_begin, x_end) of a
+// row. Kept out of line from the pass so that GCC vectorizes it; without __restrict it gives
+// up on the alias checks of so many arrays.
+inline void AccumulateTap(DenoisePlanes p, ptrdiff_t shift, int x_begin, int x_end, float h,
+                          float inv_color, float inv_normal, float inv_depth,
+                          float* __restrict sum_r, float* __restrict sum_g,
+                          float* __restrict sum_b, float* __restrict sum_w) {
+    for (int x = x_begin; x < x_end; ++x) {
+        const ptrdiff_t q = x + shift;
+        float dc = RelativeDistance2(p.r[x], p.g[x], p.b[x], p.r[q], p.g[q], p.b[q]);
+        float mx = p.nx[q] - p.nx[x];
+        float my = p.ny[q] - p.ny[x];
+        float mz = p.nz[q] - p.nz[x];
+        float zq = std::fabs(p.z[q]);
+        float zx = std::fabs(p.z[x]);
+        float dz = std::fabs(p.z[q] - p.z[x]) / ((zq > zx ? zq : zx) + 1e-6f);
+        float w = h * FastExp(-dc * inv_color - (mx * mx + my * my + mz * mz) * inv_normal -
+                              dz * inv_depth);
+        sum_r[x] += w * p.r[q];
+        sum_g[x] += w * p.g[q];
+        sum_b[x] += w * p.b[q];
+        sum_w[x] += w;
+    }
+}
+
+// Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010) of a noisy frame, guided by the
+// primary hit depth and normal of every pixel: depth and normals are row-major like the
+// buffer, with negative depth and zero normals where the primary ray escapes. Every pass
+// runs over planar float rows, one row per task, with the taps of a row as the inner loop.
+inline RadianceBuffer Denoise(const RadianceBuffer& buffer, const std::vector<double>& depth,
+                              const std::vector<Vector>& normals,
+                              const DenoiseOptions& options = {}) {
+    const int width = buffer.Width();
+    const int height = buffer.Height();
+    const size_t pixels = static_cast<size_t>(width) * height;
+    if (depth.size() != pixels || normals.size() != pixels) {
+        throw std::invalid_argument("Denoise guides don't match the frame size");
+    }
+
+    std::vector<float> color[3];
+    std::vector<float> normal[3];
+    std::vector<float> z(pixels);
+    for (size_t k = 0; k != 3; ++k) {
+        color[k].resize(pixels);
+        normal[k].resize(pixels);
+        for (size_t i = 0; i != pixels; ++i) {
+            color[k][i] = buffer.Data()[3 * i + k];
+            normal[k][i] = normals[i][k];
+        }
+    }
+    for (size_t i = 0; i != pixels; ++i) {
+        z[i] = depth[i];
+    }
+
+    const size_t threads =
+        options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    constexpr float kKernel[5] = {1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16};
+    const float inv_normal = 1 / (options.normal_sigma * options.normal_sigma);
+    std::vector<float> next[3];
+    for (auto& plane : next) {
+        plane.resize(pixels);
+    }
+
+    float color_sigma = options.color_sigma * EstimateNoise(buffer, depth, normals);
+    for (int pass = 0; pass < options.iterations; ++pass, color_sigma /= 2) {
+        const int step = 1 << pass;
+        const float inv_color = 1 / (color_sigma * color_sigma);
+        const float inv_depth = 1 / (options.depth_sigma * step);
+        ParallelFor(height, threads, [&](size_t y) {
+            std::vector<float> sum[4];
+            for (auto& row : sum) {
+                row.assign(width, 0);
+            }
+            const size_t row = y * width;
+            const DenoisePlanes planes{color[0].data() + row,  color[1].data() + row,
+                                       color[2].data() + row,  normal[0].data() + row,
+                                       normal[1].data() + row, normal[2].data() + row,
+                                       z.data() + row};
+            for (int dy = -2; dy <= 2; ++dy) {
+                const int yy = static_cast<int>(y) + dy * step;
+                if (yy < 0 || yy >= height) {
+                    continue;
+                }
+                for (int dx = -2; dx <= 2; ++dx) {
+                    const int offset = dx * step;
+                    const int x_begin = std::max(0, -offset);
+                    const int x_end = std::min(width, width - offset);
+                    const ptrdiff_t shift =
+                        static_cast<ptrdiff_t>(yy - static_cast<int>(y)) * width + offset;
+                    AccumulateTap(planes, shift, x_begin, x_end,
+                                  kKernel[dy + 2] * kKernel[dx + 2], inv_color, inv_normal,
+                                  inv_depth, sum[0].data(), sum[1].data(), sum[2].data(),
+                                  sum[3].data());
+                }
+            }
+            // The center tap has weight h > 0, so the sum never vanishes.
+            for (int x = 0; x != width; ++x) {
+                next[0][row + x] = sum[0][x] / sum[3][x];
+                next[1][row + x] = sum[1][x] / sum[3][x];
+                next[2][row + x] = sum[2][x] / sum[3][x];
+            }
+        });
+        for (size_t k = 0; k != 3; ++k) {
+            color[k].swap(next[k]);
+        }
+    }
+
+    RadianceBuffer result(width, height);
+    for (size_t i = 0; i != pixels; ++i) {
+        for (size_t k = 0; k != 3; ++k) {
+            result.Data()[3 * i + k] = color[k][i];
+        }
+    }
+    return result;
+}
+
+// Denoises the beauty pass of RenderAovs, which has to include kDepth and kNormal.
+inline RadianceBuffer Denoise(const AovBuffers& aovs, const DenoiseOptions& options = {}) {
+    if (!aovs.radiance || aovs.distance.empty() || aovs.normals.empty()) {
+        throw std::invalid_argument("Denoising needs the beauty, depth and normal AOVs");
+    }
+    return Denoise(*aovs.radiance, aovs.distance, aovs.normals, options);
+}
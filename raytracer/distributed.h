@@ -0,0 +1,408 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Tile farming over a byte stream. The coordinator sends one setup message per worker
+// (scene path and camera/render options) and then tile requests; the worker answers each
+// request with the tile rectangle followed by its linear radiance as width * height * 3
+// doubles. All values are in host byte order, so every node has to share the architecture.
+enum class WorkerMessage : char { kSetup = 'S', kTile = 'T', kResult = 'R', kQuit = 'Q' };
+
+static_assert(sizeof(Vector) == 3 * sizeof(double), "radiance is sent as raw Vector arrays");
+
+struct DistributedOptions {
+    // Workers forked from the current process.
+    int local_workers = 4;
+    // One argv per additional worker, e.g. {"ssh", "node7", "/opt/bin/render", "--worker"}.
+    // The launched program has to call RunRenderWorker() on its stdin/stdout and be able to
+    // open the scene under the same path as the coordinator.
+    std::vector<std::vector<std::string>> worker_commands;
+    int tile_size = kTileSize;
+    // Tiles sent to a worker ahead of its results, so it never waits for the next request.
+    size_t tiles_in_flight = 2;
+    // A worker that holds tiles without completing an answer for this long is treated as dead.
+    std::chrono::milliseconds worker_timeout = std::chrono::minutes(10);
+};
+
+inline bool ReadAll(int fd, void* data, size_t size) {
+    auto* cur = static_cast<char*>(data);
+    while (size) {
+        ssize_t got = read(fd, cur, size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        cur += got;
+        size -= got;
+    }
+    return true;
+}
+
+// Writes without raising SIGPIPE when the peer is a socket that is already gone.
+inline bool WriteAll(int fd, const void* data, size_t size) {
+    const auto* cur = static_cast<const char*>(data);
+    while (size) {
+        ssize_t sent = send(fd, cur, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == ENOTSOCK) {
+            sent = write(fd, cur, size);
+        }
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        cur += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+template <class T>
+bool WriteValue(int fd, const T& value) {
+    return WriteAll(fd, &value, sizeof(value));
+}
+
+template <class T>
+bool ReadValue(int fd, T& value) {
+    return ReadAll(fd, &value, sizeof(value));
+}
+
+inline bool WriteTile(int fd, WorkerMessage tag, const Tile& tile) {
+    int32_t rect[4] = {tile.x_begin, tile.y_begin, tile.x_end, tile.y_end};
+    return WriteValue(fd, tag) && WriteValue(fd, rect);
+}
+
+constexpr size_t kResultHeaderSize = sizeof(WorkerMessage) + 4 * sizeof(int32_t);
+
+inline bool ReadTile(int fd, Tile& tile) {
+    int32_t rect[4];
+    if (!ReadValue(fd, rect)) {
+        return false;
+    }
+    tile = {rect[0], rect[1], rect[2], rect[3]};
+    return tile.Width() >= 0 && tile.Height() >= 0;
+}
+
+inline bool WriteSetup(int fd, const std::string& filename, const CameraOptions& camera_options,
+                       const RenderOptions& render_options) {
+    uint32_t path_size = filename.size();
+    int32_t size[2] = {camera_options.screen_width, camera_options.screen_height};
+    int32_t depth = render_options.depth;
+    return WriteValue(fd, WorkerMessage::kSetup) && WriteValue(fd, path_size) &&
+           WriteAll(fd, filename.data(), path_size) && WriteValue(fd, size) &&
+           WriteValue(fd, camera_options.fov) && WriteValue(fd, camera_options.look_from) &&
+           WriteValue(fd, camera_options.look_to) && WriteValue(fd, depth);
+}
+
+// Worker side of the protocol: loads the scene once, on loader_threads threads (0 for one per
+// hardware thread), and traces tiles until told to quit or until the coordinator goes away.
+// Returns a process exit code.
+inline int RunRenderWorker(int in_fd = STDIN_FILENO, int out_fd = STDOUT_FILENO,
+                           size_t loader_threads = 0) {
+    WorkerMessage tag;
+    uint32_t path_size;
+    if (!ReadValue(in_fd, tag) || tag != WorkerMessage::kSetup || !ReadValue(in_fd, path_size)) {
+        return 1;
+    }
+    std::string filename(path_size, '\0');
+    int32_t size[2];
+    double fov;
+    std::array<double, 3> look_from;
+    std::array<double, 3> look_to;
+    int32_t depth;
+    if (!ReadAll(in_fd, filename.data(), path_size) || !ReadValue(in_fd, size) ||
+        !ReadValue(in_fd, fov) || !ReadValue(in_fd, look_from) || !ReadValue(in_fd, look_to) ||
+        !ReadValue(in_fd, depth)) {
+        return 1;
+    }
+
+    const auto scene = ReadSceneParallel(filename, loader_threads);
+    Camera camera(CameraOptions(size[0], size[1], fov, look_from, look_to));
+    RenderOptions render_options{depth};
+
+    Tile tile;
+    while (ReadValue(in_fd, tag) && tag == WorkerMessage::kTile) {
+        if (!ReadTile(in_fd, tile)) {
+            return 1;
+        }
+        auto radiance = TraceTile(scene, camera, render_options, tile);
+        if (!WriteTile(out_fd, WorkerMessage::kResult, tile) ||
+            !WriteAll(out_fd, radiance.data(), radiance.size() * sizeof(Vector))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+class RenderWorkerPool {
+public:
+    struct Worker {
+        pid_t pid = -1;
+        int fd = -1;
+        std::deque<Tile> in_flight;
+        // Bytes of results that haven't arrived completely yet.
+        std::vector<char> received;
+        // Last time the worker completed an answer or got work while idle.
+        std::chrono::steady_clock::time_point last_seen;
+    };
+
+    // Time workers get to exit after kQuit before they are killed.
+    static constexpr std::chrono::milliseconds kQuitGrace{1000};
+
+    RenderWorkerPool() = default;
+    RenderWorkerPool(const RenderWorkerPool&) = delete;
+    RenderWorkerPool& operator=(const RenderWorkerPool&) = delete;
+
+    // Starts a worker connected through a socket pair. Without a command the child runs
+    // RunRenderWorker directly with loader_threads; with one, the socket becomes the
+    // command's stdin and stdout.
+    void Spawn(const std::vector<std::string>& command = {}, size_t loader_threads = 0) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+            throw std::runtime_error("Can't create worker socket");
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(sv[0]);
+            close(sv[1]);
+            throw std::runtime_error("Can't fork render worker");
+        }
+        if (pid == 0) {
+            close(sv[0]);
+            for (const auto& worker : workers_) {
+                close(worker.fd);
+            }
+            if (command.empty()) {
+                int code = 1;
+                try {
+                    code = RunRenderWorker(sv[1], sv[1], loader_threads);
+                } catch (...) {
+                }
+                _exit(code);
+            }
+            dup2(sv[1], STDIN_FILENO);
+            dup2(sv[1], STDOUT_FILENO);
+            std::vector<char*> argv;
+            for (const auto& arg : command) {
+                argv.push_back(const_cast<char*>(arg.c_str()));
+            }
+            argv.push_back(nullptr);
+            execvp(argv[0], argv.data());
+            _exit(127);
+        }
+        close(sv[1]);
+        workers_.push_back({pid, sv[0], {}, {}, std::chrono::steady_clock::now()});
+    }
+
+    std::vector<Worker>& Workers() {
+        return workers_;
+    }
+
+    // Forgets a worker that failed, handing its unfinished tiles back to the caller.
+    void Drop(size_t index, std::deque<Tile>& pending) {
+        auto& worker = workers_[index];
+        pending.insert(pending.begin(), worker.in_flight.begin(), worker.in_flight.end());
+        close(worker.fd);
+        Kill(worker.pid);
+        workers_.erase(workers_.begin() + index);
+    }
+
+    // Idle workers exit on kQuit right away; ones still tracing or hung, as when the
+    // coordinator leaves by an exception, are killed after kQuitGrace.
+    ~RenderWorkerPool() {
+        for (auto& worker : workers_) {
+            WriteValue(worker.fd, WorkerMessage::kQuit);
+            close(worker.fd);
+        }
+        const auto deadline = std::chrono::steady_clock::now() + kQuitGrace;
+        for (auto& worker : workers_) {
+            while (true) {
+                pid_t pid = waitpid(worker.pid, nullptr, WNOHANG);
+                if (pid != 0 && !(pid < 0 && errno == EINTR)) {
+                    break;
+                }
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    Kill(worker.pid);
+                    break;
+                }
+                usleep(1000);
+            }
+        }
+    }
+
+private:
+    static void Kill(pid_t pid) {
+        kill(pid, SIGKILL);
+        while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {
+        }
+    }
+
+    std::vector<Worker> workers_;
+};
+
+// Takes what a worker has sent without blocking and calls on_result(tile, radiance) for every
+// answer that is now complete. Returns false when the worker closed the connection or sent
+// something other than the result of its oldest tile.
+template <class OnResult>
+bool ReceiveResults(RenderWorkerPool::Worker& worker, std::vector<Vector>& radiance,
+                    OnResult on_result) {
+    constexpr size_t kChunk = 1 << 16;
+    auto& received = worker.received;
+    const size_t size = received.size();
+    received.resize(size + kChunk);
+    ssize_t got;
+    do {
+        got = recv(worker.fd, received.data() + size, kChunk, MSG_DONTWAIT);
+    } while (got < 0 && errno == EINTR);
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        return false;
+    }
+    received.resize(size + std::max<ssize_t>(got, 0));
+
+    size_t used = 0;
+    while (!worker.in_flight.empty()) {
+        const auto& expected = worker.in_flight.front();
+        const size_t pixels = static_cast<size_t>(expected.Width()) * expected.Height();
+        if (received.size() - used < kResultHeaderSize + pixels * sizeof(Vector)) {
+            break;
+        }
+        WorkerMessage tag;
+        int32_t rect[4];
+        std::memcpy(&tag, received.data() + used, sizeof(tag));
+        std::memcpy(rect, received.data() + used + sizeof(tag), sizeof(rect));
+        if (tag != WorkerMessage::kResult || rect[0] != expected.x_begin ||
+            rect[1] != expected.y_begin || rect[2] != expected.x_end ||
+            rect[3] != expected.y_end) {
+            return false;
+        }
+        radiance.resize(pixels);
+        std::memcpy(radiance.data(), received.data() + used + kResultHeaderSize,
+                    pixels * sizeof(Vector));
+        used += kResultHeaderSize + pixels * sizeof(Vector);
+        const Tile tile = expected;
+        worker.in_flight.pop_front();
+        on_result(tile, radiance);
+    }
+    received.erase(received.begin(), received.begin() + used);
+    // Anything beyond the answers to the tiles sent is malformed.
+    return !(worker.in_flight.empty() && !received.empty());
+}
+
+// Same image as RenderFull, traced by a pool of worker processes. Results are assembled from
+// whatever each worker has sent so far, so one that stalls, even partway through an answer,
+// never blocks the others. Tiles of a worker that dies, stalls past worker_timeout or sends a
+// malformed answer are reassigned to the remaining workers; the render fails only when no
+// worker is left.
+inline Image RenderDistributed(const std::string& filename, const CameraOptions& camera_options,
+                               const RenderOptions& render_options,
+                               const DistributedOptions& options = {}) {
+    RenderWorkerPool pool;
+    // Local workers load the scene at the same time, so they split the cores between them.
+    const size_t loader_threads = std::max<size_t>(
+        1, std::thread::hardware_concurrency() / std::max(options.local_workers, 1));
+    for (int i = 0; i != options.local_workers; ++i) {
+        pool.Spawn({}, loader_threads);
+    }
+    for (const auto& command : options.worker_commands) {
+        pool.Spawn(command);
+    }
+    auto& workers = pool.Workers();
+    std::deque<Tile> pending;
+    for (size_t i = 0; i != workers.size();) {
+        if (WriteSetup(workers[i].fd, filename, camera_options, render_options)) {
+            ++i;
+        } else {
+            pool.Drop(i, pending);
+        }
+    }
+
+    const auto region = GetRenderRegion(camera_options);
+    const auto tiles = MakeTiles(region, options.tile_size);
+    pending.insert(pending.end(), tiles.begin(), tiles.end());
+    RadianceBuffer buffer(region.Width(), region.Height());
+    size_t done = 0;
+    std::vector<Vector> radiance;
+    while (done != tiles.size()) {
+        for (size_t i = 0; i != workers.size();) {
+            auto& worker = workers[i];
+            bool alive = true;
+            while (alive && worker.in_flight.size() < options.tiles_in_flight &&
+                   !pending.empty()) {
+                alive = WriteTile(worker.fd, WorkerMessage::kTile, pending.front());
+                if (alive && worker.in_flight.empty()) {
+                    worker.last_seen = std::chrono::steady_clock::now();
+                }
+                if (alive) {
+                    worker.in_flight.push_back(pending.front());
+                    pending.pop_front();
+                }
+            }
+            if (alive) {
+                ++i;
+            } else {
+                pool.Drop(i, pending);
+            }
+        }
+        if (workers.empty()) {
+            throw std::runtime_error("All render workers died");
+        }
+
+        std::vector<pollfd> fds;
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        for (const auto& worker : workers) {
+            fds.push_back({worker.fd, POLLIN, 0});
+            if (!worker.in_flight.empty()) {
+                deadline = std::min(deadline, worker.last_seen + options.worker_timeout);
+            }
+        }
+        int timeout = -1;
+        if (deadline != std::chrono::steady_clock::time_point::max()) {
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            timeout = std::clamp<int64_t>(wait.count(), 0, std::numeric_limits<int>::max());
+        }
+        if (poll(fds.data(), fds.size(), timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("poll failed while waiting for render workers");
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (size_t i = fds.size(); i-- != 0;) {
+            auto& worker = workers[i];
+            bool ok = true;
+            if (fds[i].revents) {
+                ok = ReceiveResults(worker, radiance, [&](const Tile& tile, const auto& result) {
+                    worker.last_seen = now;
+                    PasteTile(tile, result, buffer, region);
+                    ++done;
+                });
+            }
+            if (!ok || (!worker.in_flight.empty() &&
+                        now - worker.last_seen >= options.worker_timeout)) {
+                pool.Drop(i, pending);
+            }
+        }
+    }
+    return ToneMap(buffer);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+// Primary visibility of a render region: the camera ray and the closest hit of every pixel,
+// row-major. Only geometry is cached; materials are looked up again through the object index
+// on every Reshade, so material and light edits don't invalidate it.
+struct GBuffer {
+    Tile region;
+    size_t object_count = 0;
+    double pixel_spread = 0;
+    std::vector<Ray> rays;
+    std::vector<std::optional<Hit>> hits;
+    TrackedBytes memory{MemoryCategory::kRays};
+};
+
+inline GBuffer BuildGBuffer(const Scene& scene, const CameraOptions& camera_options) {
+    Camera camera(camera_options);
+    GBuffer gbuffer;
+    gbuffer.region = GetRenderRegion(camera_options);
+    gbuffer.pixel_spread = camera.GetPixelSpread();
+    gbuffer.object_count = scene.GetTriangleCount() + scene.GetSphereObjects().size();
+    size_t pixels = static_cast<size_t>(gbuffer.region.Width()) * gbuffer.region.Height();
+    gbuffer.rays.reserve(pixels);
+    gbuffer.hits.reserve(pixels);
+    for (int j = gbuffer.region.y_begin; j != gbuffer.region.y_end; ++j) {
+        for (int i = gbuffer.region.x_begin; i != gbuffer.region.x_end; ++i) {
+            gbuffer.rays.push_back(camera.GetRay(i, j));
+            gbuffer.hits.push_back(FindClosestHit(scene, gbuffer.rays.back()));
+        }
+    }
+    gbuffer.memory.Set(gbuffer.rays.capacity() * sizeof(Ray) +
+                       gbuffer.hits.capacity() * sizeof(std::optional<Hit>));
+    return gbuffer;
+}
+
+inline MaterialId GetMaterialId(const Scene& scene, size_t object_index) {
+    if (object_index < scene.GetTriangleCount()) {
+        return scene.GetTriangle(object_index).material_id;
+    }
+    return scene.GetSphereObjects()[object_index - scene.GetTriangleCount()].material_id;
+}
+
+// Same radiance as RenderRadiance for a scene whose geometry matches the one the G-buffer was
+// built from, but only direct lighting and secondary bounces are traced.
+inline RadianceBuffer Reshade(const Scene& scene, const GBuffer& gbuffer,
+                              const RenderOptions& options) {
+    if (scene.GetTriangleCount() + scene.GetSphereObjects().size() != gbuffer.object_count) {
+        throw std::runtime_error("Scene geometry changed since the G-buffer was built");
+    }
+    auto render_options = options;
+    if (render_options.pixel_spread == 0) {
+        render_options.pixel_spread = gbuffer.pixel_spread;
+    }
+    RadianceBuffer buffer(gbuffer.region.Width(), gbuffer.region.Height());
+    if (render_options.depth <= 0) {
+        return buffer;
+    }
+    const auto tiles = MakeTiles(Tile{0, 0, buffer.Width(), buffer.Height()});
+    // Features of the current materials, which may differ from those the G-buffer saw.
+    WithSceneFeatures(GetSceneFeatures(scene), [&](auto features) {
+        ForEachPixel(tiles, [&](int x, int y) {
+            size_t index = static_cast<size_t>(y) * buffer.Width() + x;
+            if (!gbuffer.hits[index]) {
+                return;
+            }
+            Hit hit = *gbuffer.hits[index];
+            hit.material_id = GetMaterialId(scene, hit.object_index);
+            buffer.Set(Shade<decltype(features)::value>(scene, gbuffer.rays[index], hit,
+                                                        render_options, false, 0),
+                       x, y);
+        });
+    });
+    return buffer;
+}
@@ -2,7 +2,14 @@
 
 #include <png.h>
 #include <jpeglib.h>
+#include <memory_accounting.h>
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 struct RGB {
     int r, g, b;
@@ -11,6 +18,61 @@ struct RGB {
     }
 };
 
+// Heatmap color of a value scaled to [0, 1]: black through red and yellow to white.
+inline RGB HeatmapColor(double t) {
+    t = std::clamp(t, 0.0, 1.0);
+    return {static_cast<int>(255 * std::min(1.0, 3 * t)),
+            static_cast<int>(255 * std::clamp(3 * t - 1, 0.0, 1.0)),
+            static_cast<int>(255 * std::clamp(3 * t - 2, 0.0, 1.0))};
+}
+
+// Asks libpng for 8-bit RGBA rows whatever the color type and bit depth of the file.
+// See http://www.libpng.org/pub/png/libpng-manual.txt
+inline void SetPngReadTransforms(png_structp png, png_infop info) {
+    png_byte color_type = png_get_color_type(png, info);
+    png_byte bit_depth = png_get_bit_depth(png, info);
+
+    if (bit_depth == 16) {
+        png_set_strip_16(png);
+    }
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_set_palette_to_rgb(png);
+    }
+
+    // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
+        png_set_expand_gray_1_2_4_to_8(png);
+    }
+
+    if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+        png_set_tRNS_to_alpha(png);
+    }
+
+    // These color_type don't have an alpha channel then fill it with 0xff.
+    if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+    }
+
+    if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+        png_set_gray_to_rgb(png);
+    }
+
+    png_read_update_info(png, info);
+}
+
+// Expands a decoded RGB or grayscale JPEG scanline to RGBA.
+inline void JpegRowToRgba(const JSAMPLE* in, int components, int width, png_byte* out) {
+    for (int x = 0; x < width; ++x) {
+        const JSAMPLE* px = &in[x * components];
+        out[x * 4] = px[0];
+        out[x * 4 + 1] = components == 3 ? px[1] : px[0];
+        out[x * 4 + 2] = components == 3 ? px[2] : px[0];
+        out[x * 4 + 3] = 255;
+    }
+}
+
 class Image {
 public:
     Image(int width, int height) {
@@ -28,6 +90,28 @@ public:
                 bytes_[y][x * 4 + 3] = 255;
             }
         }
+        memory_.Set(static_cast<size_t>(height_) *
+                    (sizeof(png_bytep) + static_cast<size_t>(width_) * 4));
+    }
+
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
+
+    Image(Image&& other) noexcept
+        : width_(other.width_),
+          height_(other.height_),
+          bytes_(other.bytes_),
+          memory_(std::move(other.memory_)) {
+        other.width_ = other.height_ = 0;
+        other.bytes_ = nullptr;
+    }
+
+    Image& operator=(Image&& other) noexcept {
+        std::swap(width_, other.width_);
+        std::swap(height_, other.height_);
+        std::swap(bytes_, other.bytes_);
+        std::swap(memory_, other.memory_);
+        return *this;
     }
 
     explicit Image(const std::string& filename) {
@@ -63,46 +147,15 @@ public:
 
         width_ = png_get_image_width(png, info);
         height_ = png_get_image_height(png, info);
-        png_byte color_type = png_get_color_type(png, info);
-        png_byte bit_depth = png_get_bit_depth(png, info);
-
-        // Read any color_type into 8bit depth, RGBA format.
-        // See http://www.libpng.org/pub/png/libpng-manual.txt
-
-        if (bit_depth == 16) {
-            png_set_strip_16(png);
-        }
-
-        if (color_type == PNG_COLOR_TYPE_PALETTE) {
-            png_set_palette_to_rgb(png);
-        }
-
-        // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
-        if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
-            png_set_expand_gray_1_2_4_to_8(png);
-        }
-
-        if (png_get_valid(png, info, PNG_INFO_tRNS)) {
-            png_set_tRNS_to_alpha(png);
-        }
-
-        // These color_type don't have an alpha channel then fill it with 0xff.
-        if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY ||
-            color_type == PNG_COLOR_TYPE_PALETTE) {
-            png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
-        }
-
-        if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
-            png_set_gray_to_rgb(png);
-        }
-
-        png_read_update_info(png, info);
+        SetPngReadTransforms(png, info);
 
         bytes_ = static_cast<png_bytep*>(malloc(sizeof(png_bytep) * height_));
         for (int y = 0; y < height_; y++) {
             bytes_[y] = static_cast<png_byte*>(malloc(png_get_rowbytes(png, info)));
         }
 
+        memory_.Set(static_cast<size_t>(height_) *
+                    (sizeof(png_bytep) + png_get_rowbytes(png, info)));
         png_read_image(png, bytes_);
         png_destroy_read_struct(&png, &info, nullptr);
         fclose(fp);
@@ -133,17 +186,7 @@ public:
 
         while (cinfo.output_scanline < cinfo.output_height) {
             (void)jpeg_read_scanlines(&cinfo, buffer, 1);
-            for (int x = 0; x < Width(); ++x) {
-                RGB pixel;
-                if (cinfo.output_components == 3) {
-                    pixel.r = buffer[0][x * 3];
-                    pixel.g = buffer[0][x * 3 + 1];
-                    pixel.b = buffer[0][x * 3 + 2];
-                } else {
-                    pixel.r = pixel.g = pixel.b = buffer[0][x];
-                }
-                SetPixel(pixel, y, x);
-            }
+            JpegRowToRgba(buffer[0], cinfo.output_components, Width(), bytes_[y]);
             ++y;
         }
 
@@ -153,11 +196,20 @@ public:
     }
 
     void Write(const std::string& filename) {
+        const auto data = EncodePng();
         FILE* fp = fopen(filename.c_str(), "wb");
         if (!fp) {
             throw std::runtime_error("Can't open file " + filename);
         }
+        const bool written = fwrite(data.data(), 1, data.size(), fp) == data.size();
+        if (fclose(fp) != 0 || !written) {
+            throw std::runtime_error("Can't write file " + filename);
+        }
+    }
 
+    // Contents of the PNG file Write produces, without touching the disk. Output is 8bit
+    // depth, RGBA format.
+    std::vector<unsigned char> EncodePng() const {
         png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
         if (!png) {
             throw std::runtime_error("Can't create png write struct");
@@ -165,29 +217,65 @@ public:
 
         png_infop info = png_create_info_struct(png);
         if (!info) {
+            png_destroy_write_struct(&png, nullptr);
             throw std::runtime_error("Can't create png info struct");
         }
 
+        std::vector<unsigned char> data;
         if (setjmp(png_jmpbuf(png))) {
             abort();
         }
-
-        png_init_io(png, fp);
-
-        // Output is 8bit depth, RGBA format.
+        png_set_write_fn(
+            png, &data,
+            [](png_structp png, png_bytep bytes, png_size_t size) {
+                auto* out = static_cast<std::vector<unsigned char>*>(png_get_io_ptr(png));
+                out->insert(out->end(), bytes, bytes + size);
+            },
+            nullptr);
         png_set_IHDR(png, info, width_, height_, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
                      PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
         png_write_info(png, info);
-
-        // To remove the alpha channel for PNG_COLOR_TYPE_RGB format,
-        // Use png_set_filler().
-        // png_set_filler(png, 0, PNG_FILLER_AFTER);
-
         png_write_image(png, bytes_);
         png_write_end(png, nullptr);
-
-        fclose(fp);
         png_destroy_write_struct(&png, &info);
+        return data;
+    }
+
+    // Baseline JPEG of the RGB channels, quality from 1 to 100.
+    std::vector<unsigned char> EncodeJpeg(int quality = 90) const {
+        struct jpeg_compress_struct cinfo;
+        struct jpeg_error_mgr err;
+        cinfo.err = jpeg_std_error(&err);
+        jpeg_create_compress(&cinfo);
+        unsigned char* buffer = nullptr;
+        unsigned long size = 0;
+        jpeg_mem_dest(&cinfo, &buffer, &size);
+
+        cinfo.image_width = width_;
+        cinfo.image_height = height_;
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, std::clamp(quality, 1, 100), true);
+        jpeg_start_compress(&cinfo, true);
+
+        std::vector<JSAMPLE> row(static_cast<size_t>(width_) * 3);
+        while (cinfo.next_scanline < cinfo.image_height) {
+            const png_byte* px = bytes_[cinfo.next_scanline];
+            for (int x = 0; x < width_; ++x) {
+                row[3 * x] = px[4 * x];
+                row[3 * x + 1] = px[4 * x + 1];
+                row[3 * x + 2] = px[4 * x + 2];
+            }
+            JSAMPROW rows[] = {row.data()};
+            (void)jpeg_write_scanlines(&cinfo, rows, 1);
+        }
+        jpeg_finish_compress(&cinfo);
+        jpeg_destroy_compress(&cinfo);
+
+        std::vector<unsigned char> data(buffer, buffer + size);
+        free(buffer);
+        return data;
     }
 
     RGB GetPixel(int y, int x) const {
@@ -204,6 +292,21 @@ public:
         px[2] = pixel.b;
     }
 
+    // Pixels of row y as contiguous RGBA bytes.
+    const png_byte* Row(int y) const {
+        return bytes_[y];
+    }
+
+    // Copies all of image into this one with its top-left corner at (x, y), clipping at the
+    // borders.
+    void Paste(const Image& image, int x, int y) {
+        for (int row = std::max(0, -y); row < image.Height() && y + row < height_; ++row) {
+            for (int col = std::max(0, -x); col < image.Width() && x + col < width_; ++col) {
+                SetPixel(image.GetPixel(row, col), x + col, y + row);
+            }
+        }
+    }
+
     int Height() const {
         return height_;
     }
@@ -222,4 +325,129 @@ public:
 private:
     int width_, height_;
     png_bytep* bytes_;
+    TrackedBytes memory_{MemoryCategory::kImages};
+};
+
+// Decodes a PNG or JPEG file one row at a time, top to bottom, so that images too big to keep
+// whole can be processed in bands. Interlaced PNGs only have complete rows after the last
+// pass, so they are decoded whole.
+class ImageRowReader {
+public:
+    explicit ImageRowReader(const std::string& filename) {
+        if (filename.find(".png") == std::string::npos) {
+            OpenJpeg(filename);
+        } else {
+            OpenPng(filename);
+        }
+    }
+
+    ImageRowReader(const ImageRowReader&) = delete;
+    ImageRowReader& operator=(const ImageRowReader&) = delete;
+
+    ~ImageRowReader() {
+        if (png_) {
+            png_destroy_read_struct(&png_, &info_, nullptr);
+        }
+        if (jpeg_) {
+            jpeg_destroy_decompress(jpeg_.get());
+        }
+        if (file_) {
+            fclose(file_);
+        }
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+    // RGBA bytes of the next row, valid until the following call.
+    const png_byte* NextRow() {
+        if (next_row_ == height_) {
+            throw std::logic_error("Read past the last image row");
+        }
+        if (whole_) {
+            return whole_->Row(next_row_++);
+        }
+        ++next_row_;
+        if (png_) {
+            if (setjmp(png_jmpbuf(png_))) {
+                abort();
+            }
+            png_read_row(png_, row_.data(), nullptr);
+        } else {
+            (void)jpeg_read_scanlines(jpeg_.get(), &scanline_, 1);
+            JpegRowToRgba(scanline_, jpeg_->output_components, width_, row_.data());
+        }
+        return row_.data();
+    }
+
+private:
+    void Open(const std::string& filename) {
+        file_ = fopen(filename.c_str(), "rb");
+        if (!file_) {
+            throw std::runtime_error("Can't open file " + filename);
+        }
+    }
+
+    void OpenPng(const std::string& filename) {
+        Open(filename);
+        png_ = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        if (!png_) {
+            throw std::runtime_error("Can't create png read struct");
+        }
+        info_ = png_create_info_struct(png_);
+        if (!info_) {
+            throw std::runtime_error("Can't create png info struct");
+        }
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+        png_init_io(png_, file_);
+        png_read_info(png_, info_);
+        if (png_get_interlace_type(png_, info_) != PNG_INTERLACE_NONE) {
+            png_destroy_read_struct(&png_, &info_, nullptr);
+            fclose(file_);
+            file_ = nullptr;
+            whole_.emplace(filename);
+            width_ = whole_->Width();
+            height_ = whole_->Height();
+            return;
+        }
+        width_ = png_get_image_width(png_, info_);
+        height_ = png_get_image_height(png_, info_);
+        SetPngReadTransforms(png_, info_);
+        row_.resize(png_get_rowbytes(png_, info_));
+    }
+
+    void OpenJpeg(const std::string& filename) {
+        Open(filename);
+        jpeg_ = std::make_unique<jpeg_decompress_struct>();
+        jpeg_->err = jpeg_std_error(&jpeg_error_);
+        jpeg_create_decompress(jpeg_.get());
+        jpeg_stdio_src(jpeg_.get(), file_);
+        (void)jpeg_read_header(jpeg_.get(), true);
+        (void)jpeg_start_decompress(jpeg_.get());
+        width_ = jpeg_->output_width;
+        height_ = jpeg_->output_height;
+        scanline_ = (*jpeg_->mem->alloc_sarray)(reinterpret_cast<j_common_ptr>(jpeg_.get()),
+                                                JPOOL_IMAGE,
+                                                width_ * jpeg_->output_components, 1)[0];
+        row_.resize(static_cast<size_t>(width_) * 4);
+    }
+
+    FILE* file_ = nullptr;
+    png_structp png_ = nullptr;
+    png_infop info_ = nullptr;
+    std::unique_ptr<jpeg_decompress_struct> jpeg_;
+    jpeg_error_mgr jpeg_error_;
+    JSAMPROW scanline_ = nullptr;
+    std::optional<Image> whole_;
+    int width_ = 0;
+    int height_ = 0;
+    int next_row_ = 0;
+    std::vector<png_byte> row_;
 };
@@ -0,0 +1,130 @@
+// Regression image comparison:
+//
+//   image_diff [options] ACTUAL EXPECTED
+//
+// ACTUAL and EXPECTED are two images, or two directories whose images with the same names
+// are compared. Prints one line of metrics per pair and exits with 0 if every pair is at
+// least --min-similarity similar, 1 if some pair is not, and 2 on errors.
+//
+//   --tolerance D        RGB distance below which pixels match (2)
+//   --min-similarity S   share of matching pixels needed to pass (0.99)
+//   --heatmap PATH       write the distance heatmap to PATH (a directory for directories)
+//   --heatmap-max D      distance drawn at full intensity (the largest one found)
+//   --threads N          threads per comparison (one per hardware thread)
+
+#include <image_diff.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+void Usage() {
+    std::fprintf(stderr,
+                 "usage: image_diff [--tolerance D] [--min-similarity S] [--heatmap PATH]\n"
+                 "                  [--heatmap-max D] [--threads N] ACTUAL EXPECTED\n");
+}
+
+bool IsImage(const std::filesystem::path& path) {
+    auto extension = path.extension().string();
+    return extension == ".png" || extension == ".jpg" || extension == ".jpeg";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    ImageDiffOptions options;
+    double min_similarity = 0.99;
+    std::string heatmap_path;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) == 0 && i + 1 < argc) {
+            std::string value = argv[++i];
+            if (arg == "--tolerance") {
+                options.tolerance = std::atof(value.c_str());
+            } else if (arg == "--min-similarity") {
+                min_similarity = std::atof(value.c_str());
+            } else if (arg == "--heatmap") {
+                heatmap_path = value;
+            } else if (arg == "--heatmap-max") {
+                options.heatmap_max = std::atof(value.c_str());
+            } else if (arg == "--threads") {
+                options.threads = std::atoi(value.c_str());
+            } else {
+                Usage();
+                return 2;
+            }
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() != 2) {
+        Usage();
+        return 2;
+    }
+
+    namespace fs = std::filesystem;
+    try {
+        std::vector<std::pair<fs::path, fs::path>> pairs;
+        const fs::path actual_root = positional[0];
+        const fs::path expected_root = positional[1];
+        const bool directories = fs::is_directory(actual_root);
+        if (directories) {
+            for (const auto& entry : fs::directory_iterator(expected_root)) {
+                if (entry.is_regular_file() && IsImage(entry.path())) {
+                    pairs.emplace_back(actual_root / entry.path().filename(), entry.path());
+                }
+            }
+            std::sort(pairs.begin(), pairs.end());
+            if (!heatmap_path.empty()) {
+                fs::create_directories(heatmap_path);
+            }
+        } else {
+            pairs.emplace_back(actual_root, expected_root);
+        }
+
+        int status = 0;
+        for (const auto& [actual_path, expected_path] : pairs) {
+            if (!fs::exists(actual_path)) {
+                std::printf("%s: missing\n", actual_path.c_str());
+                status = 1;
+                continue;
+            }
+            Image actual(actual_path.string());
+            Image expected(expected_path.string());
+            if (actual.Width() != expected.Width() || actual.Height() != expected.Height()) {
+                std::printf("%s: size %dx%d, expected %dx%d\n", actual_path.c_str(),
+                            actual.Width(), actual.Height(), expected.Width(), expected.Height());
+                status = 1;
+                continue;
+            }
+            std::string heatmap_file = heatmap_path;
+            if (directories && !heatmap_path.empty()) {
+                auto name = actual_path.filename().replace_extension(".png");
+                heatmap_file = (fs::path(heatmap_path) / name).string();
+            }
+            Image heatmap(0, 0);
+            auto diff = DiffImages(actual, expected, options,
+                                   heatmap_file.empty() ? nullptr : &heatmap);
+            bool ok = diff.Similarity() >= min_similarity;
+            std::printf("%s: %s similarity %.6f max %.3f mean %.6f psnr %.2f dB\n",
+                        actual_path.c_str(), ok ? "ok" : "FAIL", diff.Similarity(),
+                        diff.max_distance, diff.mean_distance, diff.psnr);
+            if (!heatmap_file.empty()) {
+                heatmap.Write(heatmap_file);
+            }
+            status = ok ? status : 1;
+        }
+        return status;
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "image_diff: %s\n", e.what());
+        return 2;
+    }
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <image.h>
+#include <parallel_for.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+struct ImageDiffOptions {
+    // Pixels whose RGB distance is below this match, as in Compare.
+    double tolerance = 2;
+    // Distance drawn at full intensity in the heatmap; 0 means the largest distance found.
+    double heatmap_max = 0;
+    // 0 means one per hardware thread.
+    size_t threads = 0;
+};
+
+// Distances are Euclidean distances between the RGB values of matching pixels (0 to 441.7).
+struct ImageDiff {
+    double max_distance = 0;
+    double mean_distance = 0;
+    // Mean squared error per channel, and the PSNR in dB derived from it; infinite for
+    // identical images.
+    double mse = 0;
+    double psnr = std::numeric_limits<double>::infinity();
+    size_t mismatches = 0;
+    size_t pixels = 0;
+
+    // Share of matching pixels, 1 for empty images.
+    double Similarity() const {
+        return pixels ? 1 - static_cast<double>(mismatches) / pixels : 1;
+    }
+};
+
+// Squared distances of one row of RGBA pixels into d2, with the row statistics that need no
+// square root. Plain integer arithmetic over contiguous bytes, which GCC vectorizes.
+struct RowDiff {
+    int64_t sum = 0;
+    int32_t max = 0;
+    int32_t mismatches = 0;
+};
+
+inline RowDiff DiffRow(const uint8_t* __restrict lhs, const uint8_t* __restrict rhs, int width,
+                       int32_t mismatch_d2, int32_t* __restrict d2) {
+    int64_t sum = 0;
+    int32_t max = 0;
+    int32_t mismatches = 0;
+    for (int x = 0; x < width; ++x) {
+        int32_t dr = lhs[4 * x] - rhs[4 * x];
+        int32_t dg = lhs[4 * x + 1] - rhs[4 * x + 1];
+        int32_t db = lhs[4 * x + 2] - rhs[4 * x + 2];
+        int32_t value = dr * dr + dg * dg + db * db;
+        max = max > value ? max : value;
+        sum += value;
+        mismatches += value >= mismatch_d2;
+        d2[x] = value;
+    }
+    return {sum, max, mismatches};
+}
+
+// Compares two images of the same size row by row on several threads. If heatmap is given,
+// it is filled with an image of the per-pixel distances.
+inline ImageDiff DiffImages(const Image& actual, const Image& expected,
+                            const ImageDiffOptions& options = {}, Image* heatmap = nullptr) {
+    if (actual.Width() != expected.Width() || actual.Height() != expected.Height()) {
+        throw std::invalid_argument("Compared images differ in size");
+    }
+    const int width = actual.Width();
+    const int height = actual.Height();
+    const size_t threads =
+        options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    // d < tolerance <=> d2 < tolerance^2 <=> d2 < ceil(tolerance^2) for integer d2.
+    const auto mismatch_d2 = static_cast<int32_t>(
+        std::ceil(std::min(options.tolerance * options.tolerance, 3 * 255.0 * 255 + 1)));
+
+    struct RowResult {
+        RowDiff diff;
+        double distance_sum = 0;
+    };
+    std::vector<RowResult> rows(height);
+    std::vector<int32_t> d2(heatmap ? static_cast<size_t>(width) * height : 0);
+    ParallelFor(height, threads, [&](size_t y) {
+        std::vector<int32_t> local;
+        int32_t* row_d2 = d2.data() + y * width;
+        if (!heatmap) {
+            local.resize(width);
+            row_d2 = local.data();
+        }
+        auto& row = rows[y];
+        row.diff = DiffRow(actual.Row(y), expected.Row(y), width, mismatch_d2, row_d2);
+        // Square roots only where something differs, which is rare in regression runs.
+        for (int x = 0; row.diff.max && x != width; ++x) {
+            if (row_d2[x]) {
+                row.distance_sum += std::sqrt(static_cast<double>(row_d2[x]));
+            }
+        }
+    });
+
+    ImageDiff diff;
+    diff.pixels = static_cast<size_t>(width) * height;
+    int64_t sum = 0;
+    int32_t max = 0;
+    double distance_sum = 0;
+    for (const auto& row : rows) {
+        sum += row.diff.sum;
+        max = std::max(max, row.diff.max);
+        diff.mismatches += row.diff.mismatches;
+        distance_sum += row.distance_sum;
+    }
+    diff.max_distance = std::sqrt(static_cast<double>(max));
+    if (diff.pixels) {
+        diff.mean_distance = distance_sum / diff.pixels;
+        diff.mse = static_cast<double>(sum) / (3 * diff.pixels);
+    }
+    if (diff.mse > 0) {
+        diff.psnr = 10 * std::log10(255.0 * 255.0 / diff.mse);
+    }
+
+    if (heatmap) {
+        *heatmap = Image(width, height);
+        const double scale = options.heatmap_max > 0 ? options.heatmap_max : diff.max_distance;
+        ParallelFor(height, threads, [&](size_t y) {
+            for (int x = 0; x != width; ++x) {
+                double distance = std::sqrt(static_cast<double>(d2[y * width + x]));
+                heatmap->SetPixel(HeatmapColor(scale > 0 ? distance / scale : 0), x, y);
+            }
+        });
+    }
+    return diff;
+}
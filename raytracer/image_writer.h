@@ -0,0 +1,179 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ImageWriterOptions {
+    // Encoding threads.
+    size_t threads = 1;
+    // Frames waiting to be encoded; Submit blocks beyond this, so a renderer that outpaces
+    // the encoders can't pile up frames in memory.
+    size_t queue_size = 2;
+    // For .jpg and .jpeg outputs, 1 to 100.
+    int jpeg_quality = 90;
+};
+
+// Output stage that encodes and writes frames on background threads, so that the caller can
+// render the next frame meanwhile. The format follows the extension: JPEG for .jpg and
+// .jpeg, PNG otherwise. The first error of a write is rethrown by the next Submit or Flush.
+class ImageWriter {
+public:
+    explicit ImageWriter(const ImageWriterOptions& options = {}) : options_(options) {
+        if (!options_.threads || !options_.queue_size) {
+            throw std::invalid_argument("Image writer needs threads and queue room");
+        }
+        for (size_t i = 0; i != options_.threads; ++i) {
+            threads_.emplace_back([this] { RunEncoder(); });
+        }
+    }
+
+    ImageWriter(const ImageWriter&) = delete;
+    ImageWriter& operator=(const ImageWriter&) = delete;
+
+    // Writes what is queued; errors that nobody asked for are dropped.
+    ~ImageWriter() {
+        {
+            std::lock_guard lock(mutex_);
+            closing_ = true;
+        }
+        has_work_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    void Submit(Image image, std::string path) {
+        std::unique_lock lock(mutex_);
+        auto start = std::chrono::steady_clock::now();
+        has_room_.wait(lock, [this] { return queue_.size() < options_.queue_size; });
+        stalled_ += std::chrono::steady_clock::now() - start;
+        RethrowError();
+        queue_.push_back({std::move(image), std::move(path)});
+        has_work_.notify_one();
+    }
+
+    // Waits until every submitted frame is on disk.
+    void Flush() {
+        std::unique_lock lock(mutex_);
+        has_room_.wait(lock, [this] { return queue_.empty() && !encoding_; });
+        RethrowError();
+    }
+
+    // Time Submit spent waiting for queue room, i.e. encoding that rendering didn't hide.
+    std::chrono::duration<double> Stalled() const {
+        std::lock_guard lock(mutex_);
+        return stalled_;
+    }
+
+    // Time spent encoding and writing, summed over the threads.
+    std::chrono::duration<double> Encoding() const {
+        std::lock_guard lock(mutex_);
+        return encoding_time_;
+    }
+
+private:
+    struct Frame {
+        Image image;
+        std::string path;
+    };
+
+    static bool IsJpeg(const std::string& path) {
+        auto dot = path.rfind('.');
+        auto extension = dot == std::string::npos ? std::string() : path.substr(dot);
+        std::transform(extension.begin(), extension.end(), extension.begin(),
+                       [](unsigned char c) { return std::tolower(c); });
+        return extension == ".jpg" || extension == ".jpeg";
+    }
+
+    void Encode(const Frame& frame) const {
+        auto data = IsJpeg(frame.path) ? frame.image.EncodeJpeg(options_.jpeg_quality)
+                                       : frame.image.EncodePng();
+        FILE* fp = std::fopen(frame.path.c_str(), "wb");
+        if (!fp) {
+            throw std::runtime_error("Can't open file " + frame.path);
+        }
+        bool written = std::fwrite(data.data(), 1, data.size(), fp) == data.size();
+        if (std::fclose(fp) != 0 || !written) {
+            throw std::runtime_error("Can't write file " + frame.path);
+        }
+    }
+
+    void RunEncoder() {
+        std::unique_lock lock(mutex_);
+        while (true) {
+            has_work_.wait(lock, [this] { return closing_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            auto frame = std::move(queue_.front());
+            queue_.pop_front();
+            ++encoding_;
+            has_room_.notify_all();
+            lock.unlock();
+
+            auto start = std::chrono::steady_clock::now();
+            std::exception_ptr error;
+            try {
+                Encode(frame);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            lock.lock();
+            encoding_time_ += std::chrono::steady_clock::now() - start;
+            if (error && !error_) {
+                error_ = error;
+            }
+            --encoding_;
+            has_room_.notify_all();
+        }
+    }
+
+    // Called with the mutex held.
+    void RethrowError() {
+        if (error_) {
+            auto error = error_;
+            error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    ImageWriterOptions options_;
+    mutable std::mutex mutex_;
+    std::condition_variable has_work_;
+    std::condition_variable has_room_;
+    std::deque<Frame> queue_;
+    size_t encoding_ = 0;
+    bool closing_ = false;
+    std::exception_ptr error_;
+    std::chrono::duration<double> stalled_{0};
+    std::chrono::duration<double> encoding_time_{0};
+    std::vector<std::thread> threads_;
+};
+
+// Renders an animation of one scene, frame i seen through cameras[i] and written to paths[i].
+// Frames are encoded by the writer while the next one renders, so encoding costs no wall time
+// as long as it is faster than rendering.
+inline void RenderFrames(const Scene& scene, const std::vector<CameraOptions>& cameras,
+                         const RenderOptions& render_options, const std::vector<std::string>& paths,
+                         ImageWriter& writer) {
+    if (cameras.size() != paths.size()) {
+        throw std::invalid_argument("Every frame needs an output path");
+    }
+    for (size_t i = 0; i != cameras.size(); ++i) {
+        writer.Submit(Render(scene, cameras[i], render_options), paths[i]);
+    }
+    writer.Flush();
+}
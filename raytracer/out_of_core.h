@@ -0,0 +1,336 @@
+#pragma once
+
+#include <raytracer.h>
+#include <batch_shading.h>
+#include <cluster_file.h>
+#include <parallel_for.h>
+
+#include <limits>
+#include <thread>
+
+// Rendering of triangle meshes that live in a cluster file instead of memory. Rays are traced
+// in batches: every ray waits in the queue of the next cluster it enters, clusters are paged
+// in one at a time, and each page-in serves the whole queue. Spheres, lights and materials
+// come from an in-memory Scene without triangles (see WithoutTriangles). Triangle object
+// indices follow the cluster file numbering and spheres come after them, as in Hit.
+
+// Runs a batch of rays against the clusters of a store. intersect(r, cluster, info) tests ray
+// r against one resident cluster; it may lower max_t[r] (ray parameter units) and returns true
+// once the ray needs no further clusters. Queues are served in cluster file order, sweeping
+// again while rays wait for clusters behind the current one; the Morton order of the file
+// keeps those sweeps few.
+template <class F>
+void TraceClusterQueues(ClusterStore& store, const std::vector<Ray>& rays,
+                        std::vector<double>& max_t, F&& intersect) {
+    const auto& clusters = store.GetClusters();
+    const auto& order = store.GetBvh().Order();
+    // Clusters the rays enter, those of ray r in [begin[r], begin[r + 1]) sorted by entry
+    // parameter, and the next one each ray goes through.
+    std::vector<std::pair<double, uint32_t>> entries;
+    std::vector<size_t> begin(rays.size() + 1);
+    std::vector<size_t> next(rays.size());
+    std::vector<std::vector<uint32_t>> queues(clusters.size());
+    size_t waiting = 0;
+
+    auto enqueue = [&](uint32_t r) {
+        if (next[r] != begin[r + 1] && entries[next[r]].first <= max_t[r]) {
+            queues[entries[next[r]].second].push_back(r);
+            ++waiting;
+        }
+    };
+
+    for (uint32_t r = 0; r != rays.size(); ++r) {
+        const auto& origin = rays[r].GetOrigin();
+        const auto& direction = rays[r].GetDirection();
+        Vector inv_direction{1 / direction[0], 1 / direction[1], 1 / direction[2]};
+        begin[r] = next[r] = entries.size();
+        store.GetBvh().Traverse(origin, direction, max_t[r], [&](uint32_t first, uint32_t) {
+            uint32_t c = order[first];
+            entries.emplace_back(clusters[c].bounds.Entry(origin, inv_direction, max_t[r]), c);
+            return false;
+        });
+        std::sort(entries.begin() + begin[r], entries.end());
+    }
+    begin[rays.size()] = entries.size();
+    TrackedBytes queue_memory(MemoryCategory::kRays);
+    queue_memory.Set(entries.capacity() * sizeof(entries[0]) +
+                     (begin.capacity() + next.capacity()) * sizeof(size_t) +
+                     queues.capacity() * sizeof(queues[0]) +
+                     // A ray waits in one queue at a time.
+                     rays.size() * sizeof(uint32_t));
+    for (uint32_t r = 0; r != rays.size(); ++r) {
+        enqueue(r);
+    }
+
+    // Short queues, common in late sweeps and sparse shadow waves, aren't worth waking threads.
+    constexpr size_t kRaysPerThread = 64;
+    const size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    while (waiting) {
+        for (uint32_t c = 0; c != clusters.size(); ++c) {
+            if (queues[c].empty()) {
+                continue;
+            }
+            auto queue = std::move(queues[c]);
+            queues[c].clear();
+            waiting -= queue.size();
+            auto cluster = store.Load(c);
+            std::vector<char> done(queue.size());
+            const size_t queue_threads = std::min(threads, queue.size() / kRaysPerThread);
+            ParallelFor(queue.size(), queue_threads, [&](size_t k) {
+                done[k] = intersect(queue[k], *cluster, clusters[c]);
+            });
+            for (size_t k = 0; k != queue.size(); ++k) {
+                ++next[queue[k]];
+                if (!done[k]) {
+                    enqueue(queue[k]);
+                }
+            }
+        }
+    }
+}
+
+// Closest hits of a batch of rays, triangles from the store and spheres from the scene.
+inline std::vector<std::optional<Hit>> FindClosestHits(ClusterStore& store, const Scene& scene,
+                                                       const std::vector<Ray>& rays,
+                                                       std::vector<TexturePoint>* texture_points) {
+    std::vector<std::optional<Hit>> hits(rays.size());
+    std::vector<double> max_t(rays.size(), std::numeric_limits<double>::infinity());
+    for (size_t r = 0; r != rays.size(); ++r) {
+        hits[r] = FindClosestHit(scene, rays[r]);
+        if (hits[r]) {
+            hits[r]->object_index += store.GetTriangleCount();
+            max_t[r] = hits[r]->intersection.GetDistance() / Length(rays[r].GetDirection());
+        }
+    }
+
+    // Triangles win ties against spheres, as in FindClosestHit.
+    std::vector<std::optional<Hit>> triangle_hits(rays.size());
+    if (texture_points) {
+        texture_points->assign(rays.size(), {{0, 0, 0}, 0});
+    }
+    TraceClusterQueues(store, rays, max_t, [&](uint32_t r, const Cluster& cluster,
+                                               const ClusterInfo& info) {
+        const auto& ray = rays[r];
+        const double direction_length = Length(ray.GetDirection());
+        auto& best = triangle_hits[r];
+        cluster.bvh.Traverse(ray.GetOrigin(), ray.GetDirection(), max_t[r],
+                             [&](uint32_t first, uint32_t count) {
+            for (uint32_t k = first; k != first + count; ++k) {
+                const auto& object = cluster.objects[cluster.bvh.Order()[k]];
+                auto intersection = GetIntersection(ray, object.polygon);
+                if (!intersection || (best && intersection->GetDistance() >=
+                                                  best->intersection.GetDistance())) {
+                    continue;
+                }
+                best = Hit{*intersection, GetNormal(*intersection, object), object.material_id,
+                           info.first + cluster.bvh.Order()[k]};
+                max_t[r] = intersection->GetDistance() / direction_length;
+                if (texture_points) {
+                    (*texture_points)[r] = GetTexturePoint(object, intersection->GetPosition());
+                }
+            }
+            return false;
+        });
+        return false;
+    });
+
+    for (size_t r = 0; r != rays.size(); ++r) {
+        if (triangle_hits[r] &&
+            (!hits[r] || triangle_hits[r]->intersection.GetDistance() <=
+                             hits[r]->intersection.GetDistance())) {
+            hits[r] = triangle_hits[r];
+        }
+    }
+    return hits;
+}
+
+// Whether anything blocks each segment, with the same tolerance as HasIntersections.
+inline std::vector<char> FindOcclusions(ClusterStore& store, const Scene& scene,
+                                        const std::vector<ShadowRay>& shadow_rays) {
+    std::vector<char> occluded(shadow_rays.size());
+    std::vector<Ray> rays;
+    std::vector<double> max_t;
+    std::vector<uint32_t> source;
+    for (size_t s = 0; s != shadow_rays.size(); ++s) {
+        const auto& shadow = shadow_rays[s];
+        occluded[s] = HasIntersections(scene, shadow.ray, shadow.length);
+        if (!occluded[s]) {
+            rays.push_back(shadow.ray);
+            max_t.push_back((shadow.length + 1e-5) / Length(shadow.ray.GetDirection()));
+            source.push_back(s);
+        }
+    }
+    TraceClusterQueues(store, rays, max_t, [&](uint32_t r, const Cluster& cluster,
+                                               const ClusterInfo&) {
+        const auto& ray = rays[r];
+        const double len = shadow_rays[source[r]].length;
+        bool found = false;
+        cluster.bvh.Traverse(ray.GetOrigin(), ray.GetDirection(), max_t[r],
+                             [&](uint32_t first, uint32_t count) {
+            for (uint32_t k = first; k != first + count && !found; ++k) {
+                const auto& object = cluster.objects[cluster.bvh.Order()[k]];
+                auto intersection = GetIntersection(ray, object.polygon);
+                found = intersection &&
+                        len + 1e-5 > Length(ray.GetOrigin(), intersection->GetPosition());
+            }
+            return found;
+        });
+        if (found) {
+            occluded[source[r]] = true;
+        }
+        return found;
+    });
+    return occluded;
+}
+
+// Same radiance as RenderRadiance on the full scene. Cast is unrolled into waves of rays of
+// equal depth: a ray carries the product of the albedos along its path and adds its weighted
+// direct lighting to its pixel.
+inline RadianceBuffer RenderRadiance(ClusterStore& store, const Scene& scene,
+                                     const CameraOptions& camera_options,
+                                     const RenderOptions& options,
+                                     size_t max_rays = size_t{1} << 18) {
+    struct PathRay {
+        Ray ray;
+        double weight;
+        size_t pixel;
+        bool inside;
+    };
+
+    Camera camera(camera_options);
+    const auto render_options = ForCamera(options, camera);
+    const auto region = GetRenderRegion(camera_options);
+    const int width = region.Width();
+    std::vector<Vector> radiance(static_cast<size_t>(width) * region.Height(), {0, 0, 0});
+    TrackedBytes radiance_memory(MemoryCategory::kFramebuffers);
+    radiance_memory.Set(radiance.capacity() * sizeof(Vector));
+
+    // Waves are cut into batches of at most max_rays rays, shadow rays included, starting
+    // with the pixels of a band of rows. Rays waiting for a batch are kept per depth and the
+    // deepest are traced first, so at most two batches per depth wait and ray memory doesn't
+    // grow with the frame.
+    const auto& lights = scene.GetLights();
+    const size_t batch_size = std::max<size_t>(1, max_rays / (1 + lights.size()));
+    const size_t pixels = radiance.size();
+    size_t next_pixel = 0;
+    std::vector<std::vector<PathRay>> pending(std::max(render_options.depth, 0));
+    TrackedBytes ray_memory(MemoryCategory::kRays);
+    while (!pending.empty()) {
+        int depth = static_cast<int>(pending.size()) - 1;
+        while (depth >= 0 && pending[depth].empty()) {
+            --depth;
+        }
+        std::vector<PathRay> wave;
+        if (depth >= 0) {
+            auto& queue = pending[depth];
+            const size_t take = std::min(batch_size, queue.size());
+            wave.assign(queue.end() - take, queue.end());
+            queue.erase(queue.end() - take, queue.end());
+        } else if (next_pixel != pixels) {
+            depth = 0;
+            for (; next_pixel != pixels && wave.size() != batch_size; ++next_pixel) {
+                const int x = static_cast<int>(next_pixel % width);
+                const int y = static_cast<int>(next_pixel / width);
+                wave.push_back(
+                    {camera.GetRay(region.x_begin + x, region.y_begin + y), 1, next_pixel, false});
+            }
+        } else {
+            break;
+        }
+
+        std::vector<Ray> rays;
+        rays.reserve(wave.size());
+        for (const auto& path : wave) {
+            rays.push_back(path.ray);
+        }
+        std::vector<TexturePoint> texture_points;
+        auto hits = FindClosestHits(store, scene, rays, &texture_points);
+
+        std::vector<ShadowRay> shadow_rays;
+        for (const auto& hit : hits) {
+            for (size_t k = 0; hit && k != lights.size(); ++k) {
+                shadow_rays.push_back(GetShadowRay(hit->intersection, hit->normal, lights[k]));
+            }
+        }
+        auto occluded = FindOcclusions(store, scene, shadow_rays);
+
+        // Direct lighting of the whole wave at once, binned by material.
+        std::vector<ShadingPoint> points;
+        for (size_t r = 0; r != wave.size(); ++r) {
+            if (!hits[r]) {
+                continue;
+            }
+            const auto& hit = *hits[r];
+            const auto& material = scene.GetMaterials()[hit.material_id];
+            Vector diffuse_color = material.diffuse_color;
+            if (!material.diffuse_map.empty() && hit.object_index < store.GetTriangleCount()) {
+                diffuse_color = diffuse_color * SampleDiffuseMap(texture_points[r],
+                                                                 hit.intersection.GetDistance(),
+                                                                 material, render_options);
+            }
+            points.push_back({hit.intersection.GetPosition(), hit.normal, wave[r].ray.GetOrigin(),
+                              diffuse_color, hit.material_id});
+        }
+        auto bases = CalculateBases(scene, points, occluded);
+        size_t pending_rays = 0;
+        for (const auto& queue : pending) {
+            pending_rays += queue.capacity();
+        }
+        ray_memory.Set((wave.capacity() + pending_rays) * sizeof(PathRay) +
+                       rays.capacity() * sizeof(Ray) +
+                       hits.capacity() * sizeof(hits[0]) +
+                       texture_points.capacity() * sizeof(TexturePoint) +
+                       shadow_rays.capacity() * sizeof(ShadowRay) + occluded.capacity() +
+                       points.capacity() * sizeof(ShadingPoint) +
+                       bases.capacity() * sizeof(Vector));
+
+        std::vector<PathRay> next_wave;
+        size_t point_index = 0;
+        for (size_t r = 0; r != wave.size(); ++r) {
+            if (!hits[r]) {
+                continue;
+            }
+            const auto& path = wave[r];
+            const auto& hit = *hits[r];
+            const auto& intersection = hit.intersection;
+            const auto& normal = hit.normal;
+            const auto& material = scene.GetMaterials()[hit.material_id];
+            const Vector& base = bases[point_index++];
+            radiance[path.pixel] = radiance[path.pixel] + path.weight * base;
+
+            auto cur_vec = Vector(path.ray.GetOrigin(), intersection.GetPosition());
+            cur_vec.Normalize();
+            // Rays with zero weight add nothing, so they are not traced.
+            auto spawn = [&](double albedo, const Ray& ray, bool inside) {
+                if (albedo != 0) {
+                    next_wave.push_back({ray, path.weight * albedo, path.pixel, inside});
+                }
+            };
+            if (path.inside) {
+                Vector refracted = *Refract(cur_vec, normal, material.refraction_index);
+                spawn(material.albedo[1] + material.albedo[2],
+                      Ray(intersection.GetPosition() - kErrSame * normal, refracted), false);
+            } else {
+                Vector refracted = *Refract(cur_vec, normal, 1 / material.refraction_index);
+                spawn(material.albedo[1],
+                      Ray(intersection.GetPosition() + kErrSame * normal,
+                          Reflect(cur_vec, normal)),
+                      false);
+                spawn(material.albedo[2],
+                      Ray(intersection.GetPosition() - kErrSame * normal, refracted), true);
+            }
+        }
+        if (depth + 1 != render_options.depth) {
+            auto& queue = pending[depth + 1];
+            queue.insert(queue.end(), next_wave.begin(), next_wave.end());
+        }
+    }
+
+    RadianceBuffer buffer(width, region.Height());
+    for (int y = 0; y != region.Height(); ++y) {
+        for (int x = 0; x != width; ++x) {
+            buffer.Set(radiance[static_cast<size_t>(y) * width + x], x, y);
+        }
+    }
+    return buffer;
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <image.h>
+#include <vector.h>
+#include <memory_accounting.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Linear radiance before tone mapping, row-major RGB floats.
+class RadianceBuffer {
+public:
+    RadianceBuffer() = default;
+
+    RadianceBuffer(int width, int height)
+        : width_(width), height_(height), data_(static_cast<size_t>(width) * height * 3) {
+        memory_.Set(data_.capacity() * sizeof(float));
+    }
+
+    Vector Get(int x, int y) const {
+        const float* px = &data_[Offset(x, y)];
+        return {px[0], px[1], px[2]};
+    }
+
+    void Set(const Vector& radiance, int x, int y) {
+        float* px = &data_[Offset(x, y)];
+        px[0] = radiance[0];
+        px[1] = radiance[1];
+        px[2] = radiance[2];
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+    const std::vector<float>& Data() const {
+        return data_;
+    }
+
+    std::vector<float>& Data() {
+        return data_;
+    }
+
+private:
+    size_t Offset(int x, int y) const {
+        return (static_cast<size_t>(y) * width_ + x) * 3;
+    }
+
+    int width_ = 0;
+    int height_ = 0;
+    std::vector<float> data_;
+    TrackedBytes memory_{MemoryCategory::kFramebuffers};
+};
+
+struct ToneMapOptions {
+    // Scale applied to the radiance before anything else.
+    double exposure = 1;
+    // Radiance mapped to white. By default it is the brightest channel of the (exposed)
+    // frame, which is what RenderFull uses.
+    std::optional<double> white_point;
+    double gamma = 2.2;
+};
+
+// Extended Reinhard operator: white_point maps to 1.
+inline double PostProcess(double value, double white_point) {
+    return value * (1 + value / (white_point * white_point)) / (1 + value);
+}
+
+inline double GammaCorrection(double value, double gamma) {
+    return std::pow(value, 1 / gamma);
+}
+
+inline double MaxChannel(const RadianceBuffer& buffer) {
+    double max = 0;
+    for (float value : buffer.Data()) {
+        max = std::max<double>(max, value);
+    }
+    return max;
+}
+
+// White point ToneMap uses for a frame whose brightest channel is max_channel.
+inline double GetWhitePoint(const ToneMapOptions& options, double max_channel) {
+    double white_point = options.white_point.value_or(options.exposure * max_channel);
+    // Only an all-black frame gets here, and it stays black for any white point.
+    return white_point > 0 ? white_point : 1;
+}
+
+// Display color of one RGB radiance triple with a resolved white point.
+inline RGB ToneMapPixel(const float* px, const ToneMapOptions& options, double white_point) {
+    int rgb[3];
+    for (int k = 0; k != 3; ++k) {
+        double value = PostProcess(options.exposure * px[k], white_point);
+        value = GammaCorrection(std::clamp(value, 0.0, 1.0), options.gamma);
+        rgb[k] = static_cast<int>(255 * value);
+    }
+    return {rgb[0], rgb[1], rgb[2]};
+}
+
+// Turns linear radiance into a displayable image. Cheap enough to rerun on every exposure
+// or gamma tweak of a stored buffer.
+inline Image ToneMap(const RadianceBuffer& buffer, const ToneMapOptions& options = {}) {
+    const double white_point = GetWhitePoint(options, MaxChannel(buffer));
+    Image image(buffer.Width(), buffer.Height());
+    const float* px = buffer.Data().data();
+    for (int y = 0; y != buffer.Height(); ++y) {
+        for (int x = 0; x != buffer.Width(); ++x, px += 3) {
+            image.SetPixel(ToneMapPixel(px, options, white_point), x, y);
+        }
+    }
+    return image;
+}
+
+// PFM marks little-endian floats with a negative scale.
+constexpr bool kLittleEndianHost = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+
+// Portable float map: a text header followed by float rows stored bottom-up, in host byte order
+// as the sign of the scale records.
+inline void WritePfm(const RadianceBuffer& buffer, const std::string& filename) {
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (!fp) {
+        throw std::runtime_error("Can't open file " + filename);
+    }
+    std::string header = "PF\n" + std::to_string(buffer.Width()) + " " +
+                          std::to_string(buffer.Height()) +
+                          (kLittleEndianHost ? "\n-1.0\n" : "\n1.0\n");
+    bool ok = fwrite(header.data(), 1, header.size(), fp) == header.size();
+    size_t row_size = static_cast<size_t>(buffer.Width()) * 3;
+    for (int y = buffer.Height(); ok && y-- != 0;) {
+        ok = fwrite(buffer.Data().data() + y * row_size, sizeof(float), row_size, fp) == row_size;
+    }
+    if (fclose(fp) != 0 || !ok) {
+        throw std::runtime_error("Can't write file " + filename);
+    }
+}
+
+inline RadianceBuffer ReadPfm(const std::string& filename) {
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (!fp) {
+        throw std::runtime_error("Can't open file " + filename);
+    }
+    char magic[3] = {};
+    int width;
+    int height;
+    double scale;
+    if (fscanf(fp, "%2s %d %d %lf", magic, &width, &height, &scale) != 4 ||
+        std::strcmp(magic, "PF") != 0 || width < 0 || height < 0 || fgetc(fp) == EOF) {
+        fclose(fp);
+        throw std::runtime_error("Not a color PFM file " + filename);
+    }
+    RadianceBuffer buffer(width, height);
+    size_t row_size = static_cast<size_t>(width) * 3;
+    bool ok = true;
+    for (int y = height; ok && y-- != 0;) {
+        ok = fread(buffer.Data().data() + y * row_size, sizeof(float), row_size, fp) == row_size;
+    }
+    fclose(fp);
+    if (!ok) {
+        throw std::runtime_error("Truncated PFM file " + filename);
+    }
+    if ((scale < 0) != kLittleEndianHost) {
+        for (float& value : buffer.Data()) {
+            uint32_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            bits = __builtin_bswap32(bits);
+            std::memcpy(&value, &bits, sizeof(bits));
+        }
+    }
+    return buffer;
+}
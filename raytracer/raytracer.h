@@ -5,221 +5,326 @@
 #include <render_options.h>
 #include <string>
 #include <scene.h>
+#include <parallel_reader.h>
 #include <geometry.h>
+#include <tile_order.h>
+#include <camera.h>
+#include <radiance_buffer.h>
+#include <texture_cache.h>
+#include <batch_shading.h>
 
-std::vector<std::vector<Vector>> GetRayDirs(const CameraOptions& camera_options) {
-    std::vector<std::vector<Vector>> ans(camera_options.screen_width,
-                                         std::vector<Vector>(camera_options.screen_height));
+#include <limits>
 
-    Vector forward = Vector(camera_options.look_from) - Vector(camera_options.look_to);
-    forward.Normalize();
-    Vector right = CrossProduct({0, 1, 0}, forward);
-    if (1 - std::fabs(forward[1]) < kEps) {
-        right = {1, 0, 0};
+// Pixels to trace: the crop window clipped to the frame, or the whole frame.
+Tile GetRenderRegion(const CameraOptions& camera_options) {
+    Tile frame{0, 0, camera_options.screen_width, camera_options.screen_height};
+    if (!camera_options.crop) {
+        return frame;
     }
-    right.Normalize();
-    Vector up = CrossProduct(forward, right);
-    up.Normalize();
+    const auto& crop = *camera_options.crop;
+    int x_begin = std::clamp(crop.x, 0, frame.x_end);
+    int y_begin = std::clamp(crop.y, 0, frame.y_end);
+    return {x_begin, y_begin, std::clamp(crop.x + crop.width, x_begin, frame.x_end),
+            std::clamp(crop.y + crop.height, y_begin, frame.y_end)};
+}
+
+constexpr double kErrSame = 1e-6;
 
-    const Vector& u = right;
-    const Vector& v = up;
-    const Vector& w = forward;
+// What a scene makes the integrator do. The tracing functions below take a set of these as a
+// template parameter and compile out the work for the missing ones; the default set handles
+// any scene.
+enum SceneFeature : unsigned {
+    kTriangles = 1,
+    kSpheres = 2,
+    // Lights and a material with a diffuse albedo, i.e. shadow rays.
+    kDiffuseLight = 4,
+    // Of those, a material with a specular color.
+    kSpecularLight = 8,
+    // A material with albedo[1], i.e. reflected rays.
+    kReflection = 16,
+    // A material with albedo[2], i.e. refracted rays and rays inside objects.
+    kRefraction = 32,
+    // Not a scene property: makes the functions record their work in CurrentTraceCost().
+    kCountCost = 64,
+};
 
-    double scale = std::tan(camera_options.fov / 2);
-    double image_aspect_ratio = 1.0 * camera_options.screen_width / camera_options.screen_height;
-    for (int i = 0; i != camera_options.screen_width; ++i) {
-        for (int j = 0; j != camera_options.screen_height; ++j) {
-            double x =
-                (2 * (i + 0.5) / camera_options.screen_width - 1) * image_aspect_ratio * scale;
-            double y = (2 * (j + 0.5) / camera_options.screen_height - 1) * scale;
-            Vector t = {x, -y, -1};
-            t.Normalize();
-            ans[i][j] = t[0] * u + t[1] * v + t[2] * w;
-            ans[i][j].Normalize();
-        }
+constexpr unsigned kGeometryFeatures = kTriangles | kSpheres;
+constexpr unsigned kAllSceneFeatures = 63;
+
+// Work spent on one pixel, for finding the expensive parts of a frame.
+struct TraceCost {
+    // Triangles and spheres tested against rays.
+    size_t intersection_tests = 0;
+    // BVH nodes whose boxes were tested.
+    size_t traversal_steps = 0;
+    size_t shadow_rays = 0;
+    // Segments of the longest path that hit something: 1 for a primary hit only.
+    size_t depth = 0;
+};
+
+// Counters of the pixel the calling thread traces with kCountCost.
+inline TraceCost& CurrentTraceCost() {
+    thread_local TraceCost cost;
+    return cost;
+}
+
+template <unsigned kFeatures>
+size_t* TraversalCounter() {
+    if constexpr (kFeatures & kCountCost) {
+        return &CurrentTraceCost().traversal_steps;
+    } else {
+        return nullptr;
     }
+}
 
-    return ans;
+template <unsigned kFeatures>
+void CountIntersectionTests(size_t count) {
+    if constexpr (kFeatures & kCountCost) {
+        CurrentTraceCost().intersection_tests += count;
+    }
 }
 
-Image RenderDepth(const std::string& filename, const CameraOptions& camera_options) {
-    const auto& scene = ReadScene(filename);
-    Image image(camera_options.screen_width, camera_options.screen_height);
-    std::vector<std::vector<Vector>> ray_dirs = GetRayDirs(camera_options);
-    std::vector<std::vector<double>> ans(camera_options.screen_width,
-                                         std::vector<double>(camera_options.screen_height, -1));
-    double max = 0;
-    for (int i = 0; i != camera_options.screen_width; ++i) {
-        for (int j = 0; j != camera_options.screen_height; ++j) {
-            Ray ray(Vector(camera_options.look_from), ray_dirs[i][j]);
-            double dst;
-            bool updated = false;
-            for (const auto& object : scene.GetObjects()) {
-                auto intersection = GetIntersection(ray, object.polygon);
-                if (!intersection) {
-                    continue;
-                }
-                if (!updated) {
-                    dst = Length(ray.GetOrigin(), intersection->GetPosition());
-                    updated = true;
-                } else {
-                    dst = std::min(dst, Length(ray.GetOrigin(), intersection->GetPosition()));
-                }
-            }
-            for (const auto& object : scene.GetSphereObjects()) {
-                auto intersection = GetIntersection(ray, object.sphere);
-                if (!intersection) {
-                    continue;
-                }
-                if (!updated) {
-                    dst = Length(ray.GetOrigin(), intersection->GetPosition());
-                    updated = true;
-                } else {
-                    dst = std::min(dst, Length(ray.GetOrigin(), intersection->GetPosition()));
-                }
-            }
-            if (updated) {
-                ans[i][j] = dst;
-                max = std::max(max, dst);
-            }
-        }
+unsigned GetSceneFeatures(const Scene& scene) {
+    unsigned features = 0;
+    if (scene.GetTriangleCount()) {
+        features |= kTriangles;
     }
-    for (int i = 0; i != camera_options.screen_width; ++i) {
-        for (int j = 0; j != camera_options.screen_height; ++j) {
-            double val = 255.0 / 256;
-            if (ans[i][j] > 0) {
-                val = ans[i][j] / max;
+    if (!scene.GetSphereObjects().empty()) {
+        features |= kSpheres;
+    }
+    const auto& materials = scene.GetMaterials();
+    for (MaterialId id = 0; id != materials.Size(); ++id) {
+        const auto& material = materials[id];
+        if (material.albedo[0] != 0 && !scene.GetLights().empty()) {
+            features |= kDiffuseLight;
+            const auto& specular = material.specular_color;
+            if (specular[0] != 0 || specular[1] != 0 || specular[2] != 0) {
+                features |= kSpecularLight;
             }
-            val *= 256;
-            int ans = val;
-            image.SetPixel({ans, ans, ans}, i, j);
+        }
+        if (material.albedo[1] != 0) {
+            features |= kReflection;
+        }
+        if (material.albedo[2] != 0) {
+            features |= kRefraction;
         }
     }
-    return image;
+    return features;
 }
 
-Image RenderNormal(const std::string& filename, const CameraOptions& camera_options) {
-    const auto& scene = ReadScene(filename);
-    Image image(camera_options.screen_width, camera_options.screen_height);
-    std::vector<std::vector<Vector>> ray_dirs = GetRayDirs(camera_options);
-    std::vector<std::vector<Vector>> ans(
-        camera_options.screen_width,
-        std::vector<Vector>(camera_options.screen_height, {-100, -100, -100}));
-    for (int i = 0; i != camera_options.screen_width; ++i) {
-        for (int j = 0; j != camera_options.screen_height; ++j) {
-            Ray ray(Vector(camera_options.look_from), ray_dirs[i][j]);
-            double dst;
-            bool updated = false;
-            Vector normal;
-
-            for (const auto& object : scene.GetObjects()) {
-                auto intersection = GetIntersection(ray, object.polygon);
-                if (!intersection) {
-                    continue;
-                }
-                if (!updated) {
-                    dst = Length(ray.GetOrigin(), intersection->GetPosition());
-                    if (!object.NormalExists()) {
-                        normal = intersection->GetNormal();
-                    } else {
-                        normal = {0, 0, 0};
-                        Vector barycentric =
-                            GetBarycentricCoords(object.polygon, intersection->GetPosition());
-                        for (int i = 0; i != 3; ++i) {
-                            normal = normal + barycentric[i] * object.normal[i];
-                        }
-                    }
-                    updated = true;
-                } else {
-                    if (Length(ray.GetOrigin(), intersection->GetPosition()) < dst) {
-                        if (!object.NormalExists()) {
-                            normal = intersection->GetNormal();
-                        } else {
-                            normal = {0, 0, 0};
-                            Vector barycentric =
-                                GetBarycentricCoords(object.polygon, intersection->GetPosition());
-                            for (int i = 0; i != 3; ++i) {
-                                normal = normal + barycentric[i] * object.normal[i];
-                            }
-                        }
-                    }
-                    dst = std::min(dst, Length(ray.GetOrigin(), intersection->GetPosition()));
-                }
-            }
+// Calls f with std::integral_constant<unsigned, features>, instantiating it only for the
+// distinct feature sets: specular light needs diffuse light, and a scene without triangles is
+// traced as a sphere scene.
+template <unsigned kKnown = 0, unsigned kBit = 1, class F>
+decltype(auto) WithSceneFeatures(unsigned features, F&& f) {
+    if constexpr (kBit > kAllSceneFeatures) {
+        return f(std::integral_constant<unsigned, kKnown>{});
+    } else if constexpr (kBit == kSpheres && !(kKnown & kTriangles)) {
+        return WithSceneFeatures<kKnown | kBit, (kBit << 1)>(features, f);
+    } else if constexpr (kBit == kSpecularLight && !(kKnown & kDiffuseLight)) {
+        return WithSceneFeatures<kKnown, (kBit << 1)>(features, f);
+    } else {
+        if (features & kBit) {
+            return WithSceneFeatures<kKnown | kBit, (kBit << 1)>(features, f);
+        }
+        return WithSceneFeatures<kKnown, (kBit << 1)>(features, f);
+    }
+}
 
-            for (const auto& object : scene.GetSphereObjects()) {
-                auto intersection = GetIntersection(ray, object.sphere);
-                if (!intersection) {
-                    continue;
-                }
-                if (!updated) {
-                    dst = Length(ray.GetOrigin(), intersection->GetPosition());
-                    normal = intersection->GetNormal();
-                    updated = true;
-                } else {
-                    if (Length(ray.GetOrigin(), intersection->GetPosition()) < dst) {
-                        normal = intersection->GetNormal();
-                    }
-                    dst = std::min(dst, Length(ray.GetOrigin(), intersection->GetPosition()));
-                }
-            }
-            if (updated) {
-                ans[i][j] = normal;
+// Calls f(index, polygon) for the triangles of a BVH leaf until it returns true. Compressed
+// geometry is decoded on the fly, one triangle at a time.
+template <class F>
+bool ForEachLeafTriangle(const Scene& scene, uint32_t first, uint32_t count, F&& f) {
+    const auto& order = scene.GetTriangleBvh().Order();
+    if (scene.IsCompressed()) {
+        const auto& mesh = scene.GetCompressedMesh();
+        for (uint32_t k = first; k != first + count; ++k) {
+            if (f(order[k], mesh.GetPolygon(order[k]))) {
+                return true;
             }
         }
+        return false;
     }
-    for (int i = 0; i != camera_options.screen_width; ++i) {
-        for (int j = 0; j != camera_options.screen_height; ++j) {
-            if (ans[i][j][0] < -99) {
-                image.SetPixel({0, 0, 0}, i, j);
-                continue;
-            }
-            Vector cur = 255 * (0.5 * ans[i][j] + Vector{0.5, 0.5, 0.5});
-            image.SetPixel(
-                {static_cast<int>(cur[0]), static_cast<int>(cur[1]), static_cast<int>(cur[2])}, i,
-                j);
+    const auto& objects = scene.GetObjects();
+    for (uint32_t k = first; k != first + count; ++k) {
+        if (f(order[k], objects[order[k]].polygon)) {
+            return true;
         }
     }
-    return image;
+    return false;
 }
 
-constexpr double kErrSame = 1e-6;
-
+template <unsigned kFeatures = kAllSceneFeatures>
 bool HasIntersections(const Scene& scene, const Ray& ray, double len) {
-    for (const auto& object : scene.GetObjects()) {
-        auto cur_intersection = GetIntersection(ray, object.polygon);
-        if (cur_intersection &&
-            len + 1e-5 > Length(ray.GetOrigin(), cur_intersection->GetPosition())) {
+    const auto& origin = ray.GetOrigin();
+    const auto& direction = ray.GetDirection();
+    // Traversal runs in ray parameter units, intersections report distances.
+    const double max_t = (len + 1e-5) / Length(direction);
+    auto blocks = [&](size_t, const Triangle& polygon) {
+        CountIntersectionTests<kFeatures>(1);
+        auto cur_intersection = GetIntersection(ray, polygon);
+        return cur_intersection && len + 1e-5 > Length(origin, cur_intersection->GetPosition());
+    };
+    bool found = false;
+    if constexpr (kFeatures & kTriangles) {
+        scene.GetTriangleBvh().Traverse(
+            origin, direction, max_t,
+            [&](uint32_t first, uint32_t count) {
+                return found = ForEachLeafTriangle(scene, first, count, blocks);
+            },
+            TraversalCounter<kFeatures>());
+        if (found) {
             return true;
         }
     }
-    for (const auto& object : scene.GetSphereObjects()) {
-        auto cur_intersection = GetIntersection(ray, object.sphere);
-        if (cur_intersection &&
-            len + 1e-5 > Length(ray.GetOrigin(), cur_intersection->GetPosition())) {
-            return true;
+    if constexpr (kFeatures & kSpheres) {
+        const auto& batch = scene.GetSphereBatch();
+        scene.GetSphereBvh().Traverse(
+            origin, direction, max_t,
+            [&](uint32_t first, uint32_t count) {
+                CountIntersectionTests<kFeatures>(count);
+                return found = AnySphereBefore(origin, direction, batch, first, first + count,
+                                               len + 1e-5);
+            },
+            TraversalCounter<kFeatures>());
+    }
+    return found;
+}
+
+// Segment from a surface point to a light, starting just off the surface.
+struct ShadowRay {
+    Ray ray;
+    double length;
+};
+
+ShadowRay GetShadowRay(const Intersection& intersection, const Vector& normal,
+                       const Light& light) {
+    Vector dir(intersection.GetPosition(), light.position);
+    dir.Normalize();
+    return {Ray(intersection.GetPosition() + kErrSame * normal, dir),
+            Length(intersection.GetPosition(), light.position)};
+}
+
+// 1 or -1 if the whole box is strictly on the front or the back side of the plane of the
+// triangle, 0 if the plane may cut it.
+int GetPlaneSide(const Triangle& polygon, const Aabb& box) {
+    const auto normal = CrossProduct(polygon[1] - polygon[0], polygon[2] - polygon[0]);
+    const double offset = DotProduct(normal, polygon[0]);
+    double scale = 1;
+    for (size_t k = 0; k != 3; ++k) {
+        scale += std::max(std::fabs(box.min[k]), std::fabs(box.max[k])) +
+                 std::fabs(polygon[0][k]);
+    }
+    const double margin = 1e-9 * Length(normal) * scale;
+    int side = 0;
+    for (int corner = 0; corner != 8; ++corner) {
+        Vector point{corner & 1 ? box.max[0] : box.min[0], corner & 2 ? box.max[1] : box.min[1],
+                     corner & 4 ? box.max[2] : box.min[2]};
+        const double distance = DotProduct(normal, point) - offset;
+        const int corner_side = distance > margin ? 1 : distance < -margin ? -1 : 0;
+        if (corner_side == 0 || (side != 0 && corner_side != side)) {
+            return 0;
         }
+        side = corner_side;
     }
-    return false;
+    return side;
 }
 
+// HasIntersections of every shadow ray, traced through the BVHs as one packet. It pays off
+// for coherent rays, e.g. those of the points of a tile towards one light: a triangle whose
+// plane has the starts and the ends of all the segments on one side is skipped for the whole
+// packet. The work is not recorded in CurrentTraceCost(), which is kept per pixel.
+template <unsigned kFeatures = kAllSceneFeatures>
+std::vector<char> FindOcclusions(const Scene& scene, const std::vector<ShadowRay>& shadow_rays) {
+    std::vector<char> occluded(shadow_rays.size());
+    std::vector<Vector> origins;
+    std::vector<Vector> directions;
+    std::vector<double> max_t;
+    origins.reserve(shadow_rays.size());
+    directions.reserve(shadow_rays.size());
+    max_t.reserve(shadow_rays.size());
+    Aabb starts;
+    Aabb ends;
+    for (const auto& shadow : shadow_rays) {
+        const auto& direction = shadow.ray.GetDirection();
+        origins.push_back(shadow.ray.GetOrigin());
+        directions.push_back(direction);
+        max_t.push_back((shadow.length + 1e-5) / Length(direction));
+        starts.Extend(origins.back());
+        ends.Extend(origins.back() + max_t.back() * direction);
+    }
+    // A blocked ray gets a negative max_t, which drops it from the rest of both traversals.
+    if constexpr (kFeatures & kTriangles) {
+        scene.GetTriangleBvh().TraversePacket(
+            origins, directions, max_t,
+            [&](uint32_t first, uint32_t count, const uint32_t* rays, size_t size) {
+                ForEachLeafTriangle(scene, first, count, [&](size_t, const Triangle& polygon) {
+                    // For a few rays the plane test costs more than it saves.
+                    if (size >= 8) {
+                        const int side = GetPlaneSide(polygon, starts);
+                        if (side != 0 && side == GetPlaneSide(polygon, ends)) {
+                            return false;
+                        }
+                    }
+                    for (size_t i = 0; i != size; ++i) {
+                        const uint32_t r = rays[i];
+                        if (occluded[r]) {
+                            continue;
+                        }
+                        const auto& shadow = shadow_rays[r];
+                        auto hit = GetIntersection(shadow.ray, polygon);
+                        if (hit && shadow.length + 1e-5 > Length(origins[r], hit->GetPosition())) {
+                            occluded[r] = true;
+                            max_t[r] = -1;
+                        }
+                    }
+                    return false;
+                });
+            });
+    }
+    if constexpr (kFeatures & kSpheres) {
+        const auto& batch = scene.GetSphereBatch();
+        scene.GetSphereBvh().TraversePacket(
+            origins, directions, max_t,
+            [&](uint32_t first, uint32_t count, const uint32_t* rays, size_t size) {
+                for (size_t i = 0; i != size; ++i) {
+                    const uint32_t r = rays[i];
+                    if (AnySphereBefore(origins[r], directions[r], batch, first, first + count,
+                                        shadow_rays[r].length + 1e-5)) {
+                        occluded[r] = true;
+                        max_t[r] = -1;
+                    }
+                }
+            });
+    }
+    return occluded;
+}
+
+// Emitted, ambient and direct light; occluded(k) tells whether scene.GetLights()[k] is blocked
+// along its GetShadowRay.
+template <unsigned kFeatures = kAllSceneFeatures, class F>
 Vector CalculateBase(const Scene& scene, const Intersection& intersection, const Material& material,
-                     const Vector& normal, const Vector& from) {
+                     const Vector& diffuse_color, const Vector& normal, const Vector& from,
+                     F&& occluded) {
     Vector ans{0, 0, 0};
     ans = ans + material.ambient_color;
     ans = ans + material.intensity;
-    for (const auto& light : scene.GetLights()) {
-        Vector dir(intersection.GetPosition(), light.position);
-        dir.Normalize();
-        double len = Length(intersection.GetPosition(), light.position);
-        if (HasIntersections(scene, Ray(intersection.GetPosition() + kErrSame * normal, dir),
-                             len)) {
+    if constexpr (!(kFeatures & kDiffuseLight)) {
+        return ans;
+    }
+    const auto& lights = scene.GetLights();
+    for (size_t k = 0; k != lights.size(); ++k) {
+        const auto& light = lights[k];
+        if (occluded(k)) {
             continue;
         }
         Vector v_l(intersection.GetPosition(), light.position);
         v_l.Normalize();
         ans = ans + material.albedo[0] * std::max(0.0, DotProduct(normal, v_l)) *
-                        material.diffuse_color * light.intensity;
+                        diffuse_color * light.intensity;
+        if constexpr (!(kFeatures & kSpecularLight)) {
+            continue;
+        }
         Vector v_e(intersection.GetPosition(), from);
         v_e.Normalize();
         ans = ans + material.albedo[0] *
@@ -230,6 +335,20 @@ Vector CalculateBase(const Scene& scene, const Intersection& intersection, const
     return ans;
 }
 
+template <unsigned kFeatures = kAllSceneFeatures>
+Vector CalculateBase(const Scene& scene, const Intersection& intersection, const Material& material,
+                     const Vector& diffuse_color, const Vector& normal, const Vector& from) {
+    return CalculateBase<kFeatures>(
+        scene, intersection, material, diffuse_color, normal, from, [&](size_t k) {
+            auto shadow = GetShadowRay(intersection, normal, scene.GetLights()[k]);
+            if constexpr (kFeatures & kCountCost) {
+                ++CurrentTraceCost().shadow_rays;
+            }
+            return HasIntersections<kFeatures & (kGeometryFeatures | kCountCost)>(
+                scene, shadow.ray, shadow.length);
+        });
+}
+
 Vector GetNormal(const Intersection& intersection, const Object& object) {
     if (!object.NormalExists()) {
         return intersection.GetNormal();
@@ -247,117 +366,325 @@ Vector GetNormal(const Intersection& intersection, const SphereObject&) {
     return intersection.GetNormal();
 }
 
-Vector Cast(const Scene& scene, const Ray& ray, const RenderOptions& render_options,
-            bool inside = false, int depth = 0) {
-    if (depth == render_options.depth) {
-        return {0, 0, 0};
-    }
-    double dst;
-    bool updated = false;
+// Closest surface along a ray. Triangles are numbered first and spheres after them, so the
+// sphere with index k in scene.GetSphereObjects() has object_index GetTriangleCount() + k.
+struct Hit {
+    Intersection intersection;
     Vector normal;
+    MaterialId material_id;
+    size_t object_index;
+};
 
-    const Material* material;
-    Intersection intersection;
+template <unsigned kFeatures = kAllSceneFeatures>
+std::optional<Hit> FindClosestHit(const Scene& scene, const Ray& ray) {
+    std::optional<Hit> hit;
+    const auto& origin = ray.GetOrigin();
+    const auto& direction = ray.GetDirection();
+    const double direction_length = Length(direction);
+    double max_t = std::numeric_limits<double>::infinity();
 
-    for (const auto& object : scene.GetObjects()) {
-        auto cur_intersection = GetIntersection(ray, object.polygon);
-        if (!cur_intersection) {
-            continue;
-        }
-        if (!updated || Length(ray.GetOrigin(), cur_intersection->GetPosition()) < dst) {
-            dst = Length(ray.GetOrigin(), cur_intersection->GetPosition());
-            normal = GetNormal(*cur_intersection, object);
-            updated = true;
-            material = object.material;
-            intersection = *cur_intersection;
+    if constexpr (kFeatures & kTriangles) {
+        std::optional<Intersection> closest;
+        size_t closest_index = 0;
+        scene.GetTriangleBvh().Traverse(
+            origin, direction, max_t,
+            [&](uint32_t first, uint32_t count) {
+                CountIntersectionTests<kFeatures>(count);
+                return ForEachLeafTriangle(
+                    scene, first, count, [&](size_t i, const Triangle& polygon) {
+                        auto intersection = GetIntersection(ray, polygon);
+                        if (intersection &&
+                            (!closest || intersection->GetDistance() < closest->GetDistance())) {
+                            closest = intersection;
+                            closest_index = i;
+                            max_t = intersection->GetDistance() / direction_length;
+                        }
+                        return false;
+                    });
+            },
+            TraversalCounter<kFeatures>());
+        if (closest) {
+            auto object = scene.GetTriangle(closest_index);
+            hit = Hit{*closest, GetNormal(*closest, object), object.material_id, closest_index};
         }
     }
+    if constexpr (!(kFeatures & kSpheres)) {
+        return hit;
+    }
 
-    for (const auto& object : scene.GetSphereObjects()) {
-        auto cur_intersection = GetIntersection(ray, object.sphere);
-        if (!cur_intersection) {
-            continue;
-        }
-        if (!updated || Length(ray.GetOrigin(), cur_intersection->GetPosition()) < dst) {
-            dst = Length(ray.GetOrigin(), cur_intersection->GetPosition());
-            normal = GetNormal(*cur_intersection, object);
-            updated = true;
-            material = object.material;
-            intersection = *cur_intersection;
+    const auto& batch = scene.GetSphereBatch();
+    SphereHit sphere_hit;
+    scene.GetSphereBvh().Traverse(
+        origin, direction, max_t,
+        [&](uint32_t first, uint32_t count) {
+            CountIntersectionTests<kFeatures>(count);
+            auto leaf_hit = ClosestSphere(origin, direction, batch, first, first + count);
+            if (leaf_hit.t < sphere_hit.t) {
+                sphere_hit = leaf_hit;
+                max_t = std::min(max_t, leaf_hit.t);
+            }
+            return false;
+        },
+        TraversalCounter<kFeatures>());
+    if (sphere_hit.t != kNoHit) {
+        size_t index = scene.GetSphereBvh().Order()[sphere_hit.index];
+        const auto& object = scene.GetSphereObjects()[index];
+        auto intersection = MakeSphereIntersection(ray, object.sphere, sphere_hit.t);
+        if (!hit || intersection.GetDistance() < hit->intersection.GetDistance()) {
+            hit = Hit{intersection, GetNormal(intersection, object), object.material_id,
+                      scene.GetTriangleCount() + index};
         }
     }
+    return hit;
+}
 
-    if (!updated) {
-        return {0, 0, 0};
+// Texture coordinates of a point on a triangle, and how much texture one unit of surface
+// length spans there.
+struct TexturePoint {
+    Vector uv;
+    double scale;
+};
+
+TexturePoint GetTexturePoint(const Object& object, const Vector& position) {
+    Vector barycentric = GetBarycentricCoords(object.polygon, position);
+    Vector uv{0, 0, 0};
+    for (int i = 0; i != 3; ++i) {
+        uv = uv + barycentric[i] * object.texture[i];
+    }
+    double area = object.polygon.Area();
+    return {uv, area > 0 ? std::sqrt(object.texture.Area() / area) : 0};
+}
+
+// Texture color at a point seen from the given distance. The mip level follows the texture
+// coordinate span of the pixel footprint, estimated from the distance and the pixel spread.
+Vector SampleDiffuseMap(const TexturePoint& point, double distance, const Material& material,
+                        const RenderOptions& render_options) {
+    double footprint = distance * render_options.pixel_spread * point.scale;
+    auto& cache =
+        render_options.texture_cache ? *render_options.texture_cache : DefaultTextureCache();
+    return cache.Sample(material.diffuse_map, point.uv[0], point.uv[1], footprint);
+}
+
+Vector SampleDiffuseMap(const Scene& scene, const Hit& hit, const Material& material,
+                        const RenderOptions& render_options) {
+    auto point = GetTexturePoint(scene.GetTriangle(hit.object_index),
+                                 hit.intersection.GetPosition());
+    return SampleDiffuseMap(point, hit.intersection.GetDistance(), material, render_options);
+}
+
+// Fills in the options that derive from the camera, unless the caller set them.
+RenderOptions ForCamera(RenderOptions render_options, const Camera& camera) {
+    if (render_options.pixel_spread == 0) {
+        render_options.pixel_spread = camera.GetPixelSpread();
+    }
+    return render_options;
+}
+
+template <unsigned kFeatures = kAllSceneFeatures>
+Vector Cast(const Scene& scene, const Ray& ray, const RenderOptions& render_options,
+            bool inside = false, int depth = 0);
+
+Vector GetDiffuseColor(const Scene& scene, const Hit& hit, const Material& material,
+                       const RenderOptions& render_options) {
+    if (!material.diffuse_map.empty() && hit.object_index < scene.GetTriangleCount()) {
+        return material.diffuse_color * SampleDiffuseMap(scene, hit, material, render_options);
     }
+    return material.diffuse_color;
+}
 
+// Adds the reflected and refracted rays of a hit, traced with Cast, to its direct lighting ans.
+template <unsigned kFeatures = kAllSceneFeatures>
+Vector AddSecondaryRays(const Scene& scene, const Ray& ray, const Hit& hit,
+                        const RenderOptions& render_options, bool inside, int depth, Vector ans) {
+    if constexpr (!(kFeatures & (kReflection | kRefraction))) {
+        return ans;
+    }
+    const auto& intersection = hit.intersection;
+    const auto& normal = hit.normal;
+    const auto* material = &scene.GetMaterials()[hit.material_id];
     auto cur_vec = Vector(ray.GetOrigin(), intersection.GetPosition());
     cur_vec.Normalize();
-    Vector reflected = Reflect(cur_vec, normal);
-
-    if (inside) {
-        Vector refracted = *Refract(cur_vec, normal, material->refraction_index);
-        return CalculateBase(scene, intersection, *material, normal, ray.GetOrigin()) +
-               (material->albedo[1] + material->albedo[2]) *
-                   Cast(scene, Ray(intersection.GetPosition() - kErrSame * normal, refracted),
-                        render_options, !inside, depth + 1);
-    } else {
+
+    // Only refracted rays start inside an object.
+    if constexpr (kFeatures & kRefraction) {
+        if (inside) {
+            Vector refracted = *Refract(cur_vec, normal, material->refraction_index);
+            return ans + (material->albedo[1] + material->albedo[2]) *
+                             Cast<kFeatures>(scene,
+                                             Ray(intersection.GetPosition() - kErrSame * normal,
+                                                 refracted),
+                                             render_options, !inside, depth + 1);
+        }
+    }
+    if constexpr (kFeatures & kReflection) {
+        Vector reflected = Reflect(cur_vec, normal);
+        ans = ans + material->albedo[1] *
+                        Cast<kFeatures>(scene,
+                                        Ray(intersection.GetPosition() + kErrSame * normal,
+                                            reflected),
+                                        render_options, false, depth + 1);
+    }
+    if constexpr (kFeatures & kRefraction) {
         Vector refracted = *Refract(cur_vec, normal, 1 / material->refraction_index);
-        return CalculateBase(scene, intersection, *material, normal, ray.GetOrigin()) +
-               material->albedo[1] *
-                   Cast(scene, Ray(intersection.GetPosition() + kErrSame * normal, reflected),
-                        render_options, false, depth + 1) +
-               material->albedo[2] *
-                   Cast(scene, Ray(intersection.GetPosition() - kErrSame * normal, refracted),
-                        render_options, !inside, depth + 1);
-    }
-}
-
-void PostProcess(std::vector<std::vector<Vector>>& ans) {
-    double c = 0;
-    for (size_t i = 0; i != ans.size(); ++i) {
-        for (size_t j = 0; j != ans[0].size(); ++j) {
-            for (size_t k = 0; k != 3; ++k) {
-                c = std::max(c, ans[i][j][k]);
+        ans = ans + material->albedo[2] *
+                        Cast<kFeatures>(scene,
+                                        Ray(intersection.GetPosition() - kErrSame * normal,
+                                            refracted),
+                                        render_options, !inside, depth + 1);
+    }
+    return ans;
+}
+
+// Radiance leaving the hit point towards the ray origin: direct lighting plus the reflected
+// and refracted rays traced with Cast.
+template <unsigned kFeatures = kAllSceneFeatures>
+Vector Shade(const Scene& scene, const Ray& ray, const Hit& hit,
+             const RenderOptions& render_options, bool inside, int depth) {
+    const auto& material = scene.GetMaterials()[hit.material_id];
+    Vector base = CalculateBase<kFeatures>(scene, hit.intersection, material,
+                                           GetDiffuseColor(scene, hit, material, render_options),
+                                           hit.normal, ray.GetOrigin());
+    return AddSecondaryRays<kFeatures>(scene, ray, hit, render_options, inside, depth, base);
+}
+
+template <unsigned kFeatures>
+Vector Cast(const Scene& scene, const Ray& ray, const RenderOptions& render_options, bool inside,
+            int depth) {
+    if (depth == render_options.depth) {
+        return {0, 0, 0};
+    }
+    auto hit = FindClosestHit<kFeatures & (kGeometryFeatures | kCountCost)>(scene, ray);
+    if (!hit) {
+        return {0, 0, 0};
+    }
+    if constexpr (kFeatures & kCountCost) {
+        auto& cost = CurrentTraceCost();
+        cost.depth = std::max<size_t>(cost.depth, depth + 1);
+    }
+    return Shade<kFeatures>(scene, ray, *hit, render_options, inside, depth);
+}
+
+// Linear radiance of the pixels of a tile, row by row. With lights in the scene, the direct
+// lighting of the primary hits of the whole tile is computed at once: FindOcclusions tests
+// their shadow rays as one packet per light and CalculateBases shades them. The rays they
+// spawn are still shaded one hit at a time by Cast.
+std::vector<Vector> TraceTile(const Scene& scene, const Camera& camera,
+                              const RenderOptions& options, const Tile& tile) {
+    const auto render_options = ForCamera(options, camera);
+    const size_t pixels = static_cast<size_t>(tile.Width()) * tile.Height();
+    std::vector<Vector> radiance;
+    radiance.reserve(pixels);
+    WithSceneFeatures(GetSceneFeatures(scene), [&](auto features) {
+        constexpr unsigned kFeatures = decltype(features)::value;
+        if constexpr (!(kFeatures & kDiffuseLight)) {
+            for (int j = tile.y_begin; j != tile.y_end; ++j) {
+                for (int i = tile.x_begin; i != tile.x_end; ++i) {
+                    radiance.push_back(Cast<kFeatures>(scene, camera.GetRay(i, j), render_options));
+                }
+            }
+        } else {
+            if (render_options.depth == 0) {
+                radiance.assign(pixels, {0, 0, 0});
+                return;
+            }
+            const auto& lights = scene.GetLights();
+            std::vector<Ray> rays;
+            std::vector<std::optional<Hit>> hits;
+            std::vector<ShadingPoint> points;
+            rays.reserve(pixels);
+            hits.reserve(pixels);
+            for (int j = tile.y_begin; j != tile.y_end; ++j) {
+                for (int i = tile.x_begin; i != tile.x_end; ++i) {
+                    const auto& ray = rays.emplace_back(camera.GetRay(i, j));
+                    const auto& hit = hits.emplace_back(
+                        FindClosestHit<kFeatures & kGeometryFeatures>(scene, ray));
+                    if (!hit) {
+                        continue;
+                    }
+                    const auto& material = scene.GetMaterials()[hit->material_id];
+                    points.push_back({hit->intersection.GetPosition(), hit->normal,
+                                      ray.GetOrigin(),
+                                      GetDiffuseColor(scene, *hit, material, render_options),
+                                      hit->material_id});
+                }
+            }
+            std::vector<char> occluded(points.size() * lights.size());
+            std::vector<ShadowRay> shadow_rays;
+            shadow_rays.reserve(points.size());
+            for (size_t k = 0; k != lights.size(); ++k) {
+                shadow_rays.clear();
+                for (size_t r = 0; r != rays.size(); ++r) {
+                    if (hits[r]) {
+                        shadow_rays.push_back(
+                            GetShadowRay(hits[r]->intersection, hits[r]->normal, lights[k]));
+                    }
+                }
+                auto blocked = FindOcclusions<kFeatures & kGeometryFeatures>(scene, shadow_rays);
+                for (size_t i = 0; i != blocked.size(); ++i) {
+                    occluded[i * lights.size() + k] = blocked[i];
+                }
+            }
+            auto bases = CalculateBases(scene, points, occluded);
+            size_t point = 0;
+            for (size_t r = 0; r != rays.size(); ++r) {
+                radiance.push_back(hits[r] ? AddSecondaryRays<kFeatures>(scene, rays[r], *hits[r],
+                                                                         render_options, false, 0,
+                                                                         bases[point++])
+                                           : Vector{0, 0, 0});
             }
         }
-    }
-    for (size_t i = 0; i != ans.size(); ++i) {
-        for (size_t j = 0; j != ans[0].size(); ++j) {
-            ans[i][j] = ans[i][j] * (Vector(1., 1., 1.) + ans[i][j] / Vector(c * c, c * c, c * c)) /
-                        (Vector(1., 1., 1.) + ans[i][j]);
+    });
+    return radiance;
+}
+
+// Copies the radiance of a tile into the buffer of the region it belongs to.
+void PasteTile(const Tile& tile, const std::vector<Vector>& radiance, RadianceBuffer& buffer,
+               const Tile& region) {
+    auto cur = radiance.begin();
+    for (int j = tile.y_begin; j != tile.y_end; ++j) {
+        for (int i = tile.x_begin; i != tile.x_end; ++i) {
+            buffer.Set(*cur++, i - region.x_begin, j - region.y_begin);
         }
     }
 }
 
-void GammaCorrection(std::vector<std::vector<Vector>>& ans) {
-    for (size_t i = 0; i != ans.size(); ++i) {
-        for (size_t j = 0; j != ans[0].size(); ++j) {
-            for (size_t k = 0; k != 3; ++k) {
-                ans[i][j][k] = std::pow(ans[i][j][k], 1 / 2.2);
+// Distances are shaded relative to max, by default the largest of them.
+Image DepthToImage(const std::vector<std::vector<double>>& ans, double max = 0) {
+    int height = ans.size();
+    int width = height ? ans[0].size() : 0;
+    Image image(width, height);
+    if (max <= 0) {
+        for (const auto& row : ans) {
+            for (double dst : row) {
+                max = std::max(max, dst);
             }
         }
     }
+    for (int j = 0; j != height; ++j) {
+        for (int i = 0; i != width; ++i) {
+            double val = 255.0 / 256;
+            if (ans[j][i] > 0) {
+                val = ans[j][i] / max;
+            }
+            val *= 256;
+            int ans = val;
+            image.SetPixel({ans, ans, ans}, i, j);
+        }
+    }
+    return image;
 }
 
-Image RenderFull(const std::string& filename, const CameraOptions& camera_options,
-                 const RenderOptions& render_options) {
-    const auto& scene = ReadScene(filename);
-    Image image(camera_options.screen_width, camera_options.screen_height);
-    std::vector<std::vector<Vector>> ray_dirs = GetRayDirs(camera_options);
-    std::vector<std::vector<Vector>> ans(camera_options.screen_width,
-                                         std::vector<Vector>(camera_options.screen_height));
-    for (int i = 0; i != camera_options.screen_width; ++i) {
-        for (int j = 0; j != camera_options.screen_height; ++j) {
-            Ray ray(Vector(camera_options.look_from), ray_dirs[i][j]);
-            ans[i][j] = Cast(scene, ray, render_options);
-        }
-    }
-    PostProcess(ans);
-    GammaCorrection(ans);
-    for (int i = 0; i != camera_options.screen_width; ++i) {
-        for (int j = 0; j != camera_options.screen_height; ++j) {
-            Vector cur = 255 * ans[i][j];
+Image NormalToImage(const std::vector<std::vector<Vector>>& ans) {
+    int height = ans.size();
+    int width = height ? ans[0].size() : 0;
+    Image image(width, height);
+    for (int j = 0; j != height; ++j) {
+        for (int i = 0; i != width; ++i) {
+            if (ans[j][i][0] < -99) {
+                image.SetPixel({0, 0, 0}, i, j);
+                continue;
+            }
+            Vector cur = 255 * (0.5 * ans[j][i] + Vector{0.5, 0.5, 0.5});
             image.SetPixel(
                 {static_cast<int>(cur[0]), static_cast<int>(cur[1]), static_cast<int>(cur[2])}, i,
                 j);
@@ -366,13 +693,338 @@ Image RenderFull(const std::string& filename, const CameraOptions& camera_option
     return image;
 }
 
+enum class Aov { kBeauty, kDepth, kNormal, kMaterialIndex, kObjectIndex, kCost };
+
+enum class CostMetric { kIntersectionTests, kTraversalSteps, kShadowRays, kDepth };
+
+// One counter of every pixel, as a raw buffer.
+std::vector<double> GetCostPlane(const std::vector<TraceCost>& cost, CostMetric metric) {
+    std::vector<double> plane;
+    plane.reserve(cost.size());
+    for (const auto& pixel : cost) {
+        switch (metric) {
+            case CostMetric::kIntersectionTests:
+                plane.push_back(pixel.intersection_tests);
+                break;
+            case CostMetric::kTraversalSteps:
+                plane.push_back(pixel.traversal_steps);
+                break;
+            case CostMetric::kShadowRays:
+                plane.push_back(pixel.shadow_rays);
+                break;
+            case CostMetric::kDepth:
+                plane.push_back(pixel.depth);
+                break;
+        }
+    }
+    return plane;
+}
+
+// False-color image of one counter, in the colors of the image diff heatmap. max is the
+// value drawn at full intensity; 0 means the largest one in the frame.
+Image CostToImage(const std::vector<TraceCost>& cost, int width, CostMetric metric,
+                  double max = 0) {
+    const auto plane = GetCostPlane(cost, metric);
+    const int height = width ? plane.size() / width : 0;
+    if (static_cast<size_t>(width) * height != plane.size()) {
+        throw std::invalid_argument("Cost buffer doesn't match the width");
+    }
+    if (max <= 0 && !plane.empty()) {
+        max = *std::max_element(plane.begin(), plane.end());
+    }
+    Image image(width, height);
+    for (int y = 0; y != height; ++y) {
+        for (int x = 0; x != width; ++x) {
+            double value = plane[static_cast<size_t>(y) * width + x];
+            image.SetPixel(HeatmapColor(max > 0 ? value / max : 0), x, y);
+        }
+    }
+    return image;
+}
+
+// Requested outputs of RenderAovs; the rest stay empty. Images look exactly like the ones
+// produced by the matching RenderMode. Raw buffers are row-major over the render region and
+// hold -1 where the primary ray escapes.
+struct AovBuffers {
+    std::optional<Image> beauty;
+    // Linear radiance behind beauty, for re-tone-mapping without tracing again.
+    std::optional<RadianceBuffer> radiance;
+    std::optional<Image> depth;
+    std::optional<Image> normal;
+    // Shading normal at the primary hit, filled together with normal; zero where the ray escapes.
+    std::vector<Vector> normals;
+    // Distance to the primary hit, filled together with depth.
+    std::vector<double> distance;
+    // Hit::material_id.
+    std::vector<int> material_index;
+    // Hit::object_index.
+    std::vector<int> object_index;
+    // Work behind each beauty pixel, escaped primary rays included; see CostToImage.
+    std::vector<TraceCost> cost;
+};
+
+// Traces primary visibility once and derives every requested output from the same hits.
+AovBuffers RenderAovs(const Scene& scene, const CameraOptions& camera_options,
+                      const RenderOptions& options, const std::vector<Aov>& aovs) {
+    auto wants = [&aovs](Aov aov) {
+        return std::find(aovs.begin(), aovs.end(), aov) != aovs.end();
+    };
+    const bool beauty = wants(Aov::kBeauty);
+    const bool depth = wants(Aov::kDepth);
+    const bool normal = wants(Aov::kNormal);
+    const bool material_index = wants(Aov::kMaterialIndex);
+    const bool object_index = wants(Aov::kObjectIndex);
+    const bool cost = wants(Aov::kCost);
+
+    const auto region = GetRenderRegion(camera_options);
+    const int width = region.Width();
+    const int height = region.Height();
+    const size_t pixels = static_cast<size_t>(width) * height;
+    Camera camera(camera_options);
+    const auto render_options = ForCamera(options, camera);
+
+    RadianceBuffer radiance(beauty ? width : 0, beauty ? height : 0);
+    std::vector<std::vector<double>> distances(depth ? height : 0,
+                                               std::vector<double>(width, -1));
+    std::vector<std::vector<Vector>> normals(normal ? height : 0,
+                                             std::vector<Vector>(width, {-100, -100, -100}));
+    AovBuffers result;
+    if (material_index) {
+        result.material_index.assign(pixels, -1);
+    }
+    if (object_index) {
+        result.object_index.assign(pixels, -1);
+    }
+    if (cost) {
+        result.cost.resize(pixels);
+    }
+    TrackedBytes aov_memory(MemoryCategory::kFramebuffers);
+    aov_memory.Set((depth ? pixels * sizeof(double) : 0) +
+                   (normal ? pixels * sizeof(Vector) : 0) +
+                   (result.material_index.size() + result.object_index.size()) * sizeof(int) +
+                   result.cost.size() * sizeof(TraceCost));
+
+    // Costs are those of the kernel a plain render of the scene would use.
+    auto trace = [&](auto features, int i, int j) {
+        constexpr unsigned kFeatures = decltype(features)::value;
+        Ray ray = camera.GetRay(i, j);
+        int x = i - region.x_begin;
+        int y = j - region.y_begin;
+        if constexpr (kFeatures & kCountCost) {
+            CurrentTraceCost() = {};
+        }
+        auto hit = FindClosestHit<kFeatures & (kGeometryFeatures | kCountCost)>(scene, ray);
+        if constexpr (kFeatures & kCountCost) {
+            if (hit && render_options.depth > 0) {
+                CurrentTraceCost().depth = 1;
+                auto value = Shade<kFeatures>(scene, ray, *hit, render_options, false, 0);
+                if (beauty) {
+                    radiance.Set(value, x, y);
+                }
+            }
+            result.cost[static_cast<size_t>(y) * width + x] = CurrentTraceCost();
+        } else if (hit && beauty && render_options.depth > 0) {
+            radiance.Set(Shade<kFeatures>(scene, ray, *hit, render_options, false, 0), x, y);
+        }
+        if (!hit) {
+            return;
+        }
+        if (depth) {
+            distances[y][x] = hit->intersection.GetDistance();
+        }
+        if (normal) {
+            normals[y][x] = hit->normal;
+        }
+        if (material_index) {
+            result.material_index[static_cast<size_t>(y) * width + x] = hit->material_id;
+        }
+        if (object_index) {
+            result.object_index[static_cast<size_t>(y) * width + x] = hit->object_index;
+        }
+    };
+    WithSceneFeatures(GetSceneFeatures(scene), [&](auto features) {
+        constexpr unsigned kFeatures = decltype(features)::value;
+        ForEachPixel(MakeTiles(region), [&](int i, int j) {
+            if (cost) {
+                trace(std::integral_constant<unsigned, kFeatures | kCountCost>{}, i, j);
+            } else {
+                trace(features, i, j);
+            }
+        });
+    });
+
+    if (beauty) {
+        result.beauty = ToneMap(radiance);
+        result.radiance = std::move(radiance);
+    }
+    if (depth) {
+        result.depth = DepthToImage(distances);
+        result.distance.reserve(pixels);
+        for (const auto& row : distances) {
+            result.distance.insert(result.distance.end(), row.begin(), row.end());
+        }
+    }
+    if (normal) {
+        result.normal = NormalToImage(normals);
+        result.normals.reserve(pixels);
+        for (const auto& row : normals) {
+            for (const auto& value : row) {
+                result.normals.push_back(value[0] < -99 ? Vector{0, 0, 0} : value);
+            }
+        }
+    }
+    return result;
+}
+
+AovBuffers RenderAovs(const std::string& filename, const CameraOptions& camera_options,
+                      const RenderOptions& render_options, const std::vector<Aov>& aovs) {
+    return RenderAovs(ReadSceneParallel(filename), camera_options, render_options, aovs);
+}
+
+Image RenderDepth(const std::string& filename, const CameraOptions& camera_options) {
+    return std::move(*RenderAovs(filename, camera_options, {}, {Aov::kDepth}).depth);
+}
+
+Image RenderNormal(const std::string& filename, const CameraOptions& camera_options) {
+    return std::move(*RenderAovs(filename, camera_options, {}, {Aov::kNormal}).normal);
+}
+
+RadianceBuffer RenderRadiance(const Scene& scene, const CameraOptions& camera_options,
+                              const RenderOptions& render_options) {
+    Camera camera(camera_options);
+    const auto region = GetRenderRegion(camera_options);
+    RadianceBuffer buffer(region.Width(), region.Height());
+    for (const auto& tile : MakeTiles(region)) {
+        PasteTile(tile, TraceTile(scene, camera, render_options, tile), buffer, region);
+    }
+    return buffer;
+}
+
+RadianceBuffer RenderRadiance(const std::string& filename, const CameraOptions& camera_options,
+                              const RenderOptions& render_options) {
+    return RenderRadiance(ReadSceneParallel(filename), camera_options, render_options);
+}
+
+Image RenderFull(const std::string& filename, const CameraOptions& camera_options,
+                 const RenderOptions& render_options) {
+    return ToneMap(RenderRadiance(filename, camera_options, render_options));
+}
+
+void ReportMemory(const RenderOptions& render_options) {
+    if (render_options.memory_report) {
+        GetMemoryAccounting().Print(*render_options.memory_report);
+    }
+}
+
+// Same image as Render for a scene that is already loaded.
+Image Render(const Scene& scene, const CameraOptions& camera_options,
+             const RenderOptions& render_options) {
+    std::optional<Image> image;
+    if (render_options.mode == RenderMode::kDepth) {
+        image = std::move(*RenderAovs(scene, camera_options, {}, {Aov::kDepth}).depth);
+    } else if (render_options.mode == RenderMode::kNormal) {
+        image = std::move(*RenderAovs(scene, camera_options, {}, {Aov::kNormal}).normal);
+    } else {
+        image = ToneMap(RenderRadiance(scene, camera_options, render_options));
+    }
+    ReportMemory(render_options);
+    return std::move(*image);
+}
+
 Image Render(const std::string& filename, const CameraOptions& camera_options,
              const RenderOptions& render_options) {
+    std::optional<Image> image;
     if (render_options.mode == RenderMode::kDepth) {
-        return RenderDepth(filename, camera_options);
+        image = RenderDepth(filename, camera_options);
     } else if (render_options.mode == RenderMode::kNormal) {
-        return RenderNormal(filename, camera_options);
+        image = RenderNormal(filename, camera_options);
+    } else {
+        image = RenderFull(filename, camera_options, render_options);
+    }
+    ReportMemory(render_options);
+    return std::move(*image);
+}
+
+// Bytes per memory category that loading a scene of these sizes and rendering it in full
+// holds at its peak, from the layouts alone: what to provision before dispatching a job.
+// Loaders may leave up to twice the triangle and sphere arrays reserved.
+std::array<size_t, kMemoryCategoryCount> EstimateRenderMemory(size_t triangles, size_t spheres,
+                                                              size_t materials,
+                                                              const CameraOptions& camera_options) {
+    auto bvh_bytes = [](size_t count) {
+        return count ? (2 * count / 4 + 1) * sizeof(Bvh::Node) + count * sizeof(uint32_t) : 0;
+    };
+    // Handle tables hold a size_t and a uint32_t per element.
+    constexpr size_t kHandleBytes = sizeof(size_t) + sizeof(uint32_t);
+    const auto region = GetRenderRegion(camera_options);
+    const size_t pixels = static_cast<size_t>(region.Width()) * region.Height();
+    std::array<size_t, kMemoryCategoryCount> bytes{};
+    bytes[static_cast<size_t>(MemoryCategory::kObjects)] =
+        triangles * (sizeof(Object) + kHandleBytes);
+    bytes[static_cast<size_t>(MemoryCategory::kSpheres)] =
+        spheres * (sizeof(SphereObject) + kHandleBytes);
+    bytes[static_cast<size_t>(MemoryCategory::kMaterials)] =
+        materials * (sizeof(Material) + 2 * sizeof(std::string) + sizeof(MaterialId));
+    bytes[static_cast<size_t>(MemoryCategory::kAcceleration)] =
+        bvh_bytes(triangles) + bvh_bytes(spheres) + 4 * spheres * sizeof(double);
+    bytes[static_cast<size_t>(MemoryCategory::kFramebuffers)] = 3 * pixels * sizeof(float);
+    bytes[static_cast<size_t>(MemoryCategory::kImages)] =
+        region.Height() * sizeof(png_bytep) + 4 * pixels;
+    return bytes;
+}
+
+// Normalization of a full frame. Beauty and depth images scale by the frame's brightest
+// channel and farthest hit, so a crop composited into the frame has to reuse them.
+struct FrameScale {
+    // ToneMapOptions::white_point of the beauty pass.
+    std::optional<double> white_point;
+    // Distance shaded white in the depth pass.
+    std::optional<double> max_distance;
+};
+
+// Scale of a full frame rendered with the beauty and/or depth AOVs.
+FrameScale GetFrameScale(const AovBuffers& frame) {
+    FrameScale scale;
+    if (frame.radiance) {
+        scale.white_point = GetWhitePoint({}, MaxChannel(*frame.radiance));
+    }
+    if (!frame.distance.empty()) {
+        scale.max_distance = *std::max_element(frame.distance.begin(), frame.distance.end());
+    }
+    return scale;
+}
+
+// Renders the crop window of camera_options (or the whole frame) straight into a full-frame
+// image, leaving the pixels outside the window untouched. Full and depth renders are scaled
+// like the frame they go into, which frame_scale has to describe; normal renders need no scale.
+void RenderInto(Image& image, const std::string& filename, const CameraOptions& camera_options,
+                const RenderOptions& render_options, const FrameScale& frame_scale = {}) {
+    if (image.Width() != camera_options.screen_width ||
+        image.Height() != camera_options.screen_height) {
+        throw std::runtime_error("Target image doesn't match the frame size");
+    }
+    const auto region = GetRenderRegion(camera_options);
+    std::optional<Image> crop;
+    if (render_options.mode == RenderMode::kNormal) {
+        crop = RenderNormal(filename, camera_options);
+    } else if (render_options.mode == RenderMode::kDepth) {
+        if (!frame_scale.max_distance) {
+            throw std::invalid_argument("Depth crops need the frame's maximum distance");
+        }
+        const auto distance = RenderAovs(filename, camera_options, {}, {Aov::kDepth}).distance;
+        std::vector<std::vector<double>> rows;
+        for (auto row = distance.begin(); row != distance.end(); row += region.Width()) {
+            rows.emplace_back(row, row + region.Width());
+        }
+        crop = DepthToImage(rows, *frame_scale.max_distance);
     } else {
-        return RenderFull(filename, camera_options, render_options);
+        if (!frame_scale.white_point) {
+            throw std::invalid_argument("Full crops need the frame's white point");
+        }
+        ToneMapOptions tone_map;
+        tone_map.white_point = frame_scale.white_point;
+        crop = ToneMap(RenderRadiance(filename, camera_options, render_options), tone_map);
     }
-}
\ No newline at end of file
+    ReportMemory(render_options);
+    image.Paste(*crop, region.x_begin, region.y_begin);
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+enum class RenderJobState { kQueued, kRunning, kDone, kCancelled, kFailed };
+
+struct RenderJobProgress {
+    size_t tiles_done = 0;
+    size_t tiles_total = 0;
+};
+
+class RenderScheduler;
+
+// Handle of a render submitted to a RenderScheduler. Dropping it doesn't cancel the job.
+class RenderJob {
+public:
+    // Stops the job at the next tile boundary; tiles being traced finish first. Get then
+    // throws.
+    void Cancel() {
+        job_->cancelled = true;
+    }
+
+    RenderJobState State() const {
+        return job_->state;
+    }
+
+    RenderJobProgress Progress() const {
+        return {job_->tiles_done, job_->tiles.size()};
+    }
+
+    void Wait() const {
+        result_.wait();
+    }
+
+    // The image Render would produce, once; rethrows what stopped the job.
+    Image Get() {
+        return result_.get();
+    }
+
+private:
+    friend class RenderScheduler;
+
+    struct Job {
+        Job(std::shared_ptr<const Scene> scene, const CameraOptions& camera_options,
+            const RenderOptions& render_options, int priority)
+            : scene(std::move(scene)),
+              camera(camera_options),
+              render_options(render_options),
+              region(GetRenderRegion(camera_options)),
+              tiles(MakeTiles(region)),
+              radiance(region.Width(), region.Height()),
+              priority(priority) {
+        }
+
+        std::shared_ptr<const Scene> scene;
+        Camera camera;
+        RenderOptions render_options;
+        Tile region;
+        std::vector<Tile> tiles;
+        RadianceBuffer radiance;
+        int priority;
+        std::promise<Image> promise;
+        std::atomic<bool> cancelled{false};
+        std::atomic<size_t> tiles_done{0};
+        std::atomic<RenderJobState> state{RenderJobState::kQueued};
+        // Guarded by the scheduler mutex.
+        size_t next_tile = 0;
+        size_t running = 0;
+        std::exception_ptr error;
+    };
+
+    RenderJob(std::shared_ptr<Job> job, std::future<Image> result)
+        : job_(std::move(job)), result_(std::move(result)) {
+    }
+
+    std::shared_ptr<Job> job_;
+    std::future<Image> result_;
+};
+
+// Fixed pool of threads that renders the tiles of all submitted jobs. A free thread always
+// takes the next tile of the highest-priority job (the oldest among equals), so a preview
+// submitted with a higher priority starts at the next tile boundary and batch frames resume
+// when it is done, while the machine never runs more render threads than the pool has.
+class RenderScheduler {
+public:
+    // 0 threads means one per hardware thread.
+    explicit RenderScheduler(size_t threads = 0) {
+        threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i != threads; ++i) {
+            workers_.emplace_back([this] { RunWorker(); });
+        }
+    }
+
+    RenderScheduler(const RenderScheduler&) = delete;
+    RenderScheduler& operator=(const RenderScheduler&) = delete;
+
+    // Cancels what is still pending.
+    ~RenderScheduler() {
+        {
+            std::lock_guard lock(mutex_);
+            closing_ = true;
+            for (auto& job : jobs_) {
+                job->cancelled = true;
+            }
+        }
+        has_work_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    // Full render of the crop window (or the whole frame) of scene, which the job keeps alive.
+    RenderJob Submit(std::shared_ptr<const Scene> scene, const CameraOptions& camera_options,
+                     const RenderOptions& render_options, int priority = 0) {
+        if (render_options.mode != RenderMode::kFull) {
+            throw std::invalid_argument("Only full renders can be scheduled");
+        }
+        auto job = std::make_shared<RenderJob::Job>(std::move(scene), camera_options,
+                                                    render_options, priority);
+        RenderJob handle(job, job->promise.get_future());
+        {
+            std::lock_guard lock(mutex_);
+            if (closing_) {
+                throw std::logic_error("Render scheduler is shutting down");
+            }
+            jobs_.push_back(std::move(job));
+        }
+        has_work_.notify_all();
+        return handle;
+    }
+
+private:
+    using Job = RenderJob::Job;
+
+    static constexpr size_t kComplete = SIZE_MAX;
+
+    // Called with the mutex held. Picks the next tile to trace, or takes out a job that will
+    // hand out no more tiles and has none running, which is then completed as kComplete.
+    bool NextTask(std::shared_ptr<Job>& job, size_t& tile) {
+        std::shared_ptr<Job> best;
+        for (auto it = jobs_.begin(); it != jobs_.end(); ++it) {
+            auto& candidate = *it;
+            if (candidate->cancelled || candidate->error ||
+                candidate->next_tile == candidate->tiles.size()) {
+                if (!candidate->running) {
+                    job = std::move(candidate);
+                    jobs_.erase(it);
+                    tile = kComplete;
+                    return true;
+                }
+                continue;
+            }
+            if (!best || candidate->priority > best->priority) {
+                best = candidate;
+            }
+        }
+        if (!best) {
+            return false;
+        }
+        job = std::move(best);
+        tile = job->next_tile++;
+        ++job->running;
+        return true;
+    }
+
+    static void Complete(Job& job) {
+        if (job.error) {
+            job.state = RenderJobState::kFailed;
+            job.promise.set_exception(job.error);
+        } else if (job.cancelled) {
+            job.state = RenderJobState::kCancelled;
+            job.promise.set_exception(
+                std::make_exception_ptr(std::runtime_error("Render job was cancelled")));
+        } else {
+            try {
+                auto image = ToneMap(job.radiance);
+                job.state = RenderJobState::kDone;
+                job.promise.set_value(std::move(image));
+            } catch (...) {
+                job.state = RenderJobState::kFailed;
+                job.promise.set_exception(std::current_exception());
+            }
+        }
+        job.radiance = RadianceBuffer();
+        job.scene.reset();
+    }
+
+    void RunWorker() {
+        std::unique_lock lock(mutex_);
+        while (true) {
+            std::shared_ptr<Job> job;
+            size_t tile = 0;
+            has_work_.wait(lock,
+                           [&] { return NextTask(job, tile) || (closing_ && jobs_.empty()); });
+            if (!job) {
+                return;
+            }
+            lock.unlock();
+            if (tile == kComplete) {
+                Complete(*job);
+            } else {
+                job->state = RenderJobState::kRunning;
+                std::exception_ptr error;
+                try {
+                    const auto& t = job->tiles[tile];
+                    PasteTile(t, TraceTile(*job->scene, job->camera, job->render_options, t),
+                              job->radiance, job->region);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                ++job->tiles_done;
+                lock.lock();
+                if (error && !job->error) {
+                    job->error = error;
+                }
+                --job->running;
+                continue;
+            }
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable has_work_;
+    // In submission order.
+    std::vector<std::shared_ptr<Job>> jobs_;
+    bool closing_ = false;
+    std::vector<std::thread> workers_;
+};
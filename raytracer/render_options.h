@@ -1,8 +1,19 @@
 #pragma once
 
+#include <iosfwd>
+
+class TextureCache;
+
 enum class RenderMode { kDepth, kNormal, kFull };
 
 struct RenderOptions {
     int depth;
     RenderMode mode = RenderMode::kFull;
+    // Texture tiles come from here; nullptr means DefaultTextureCache().
+    TextureCache* texture_cache = nullptr;
+    // Angle seen by one pixel, which picks texture mip levels. 0 lets the renderer take it
+    // from the camera.
+    double pixel_spread = 0;
+    // Render prints current and peak memory per category here when it is done.
+    std::ostream* memory_report = nullptr;
 };
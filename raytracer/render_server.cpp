@@ -0,0 +1,68 @@
+// Render daemon:
+//
+//   render_server [--threads N] [--max-scenes N] [--idle-timeout SECONDS] SOCKET
+//
+// Listens on the Unix socket SOCKET for requests in the format of render_server.h until it
+// gets SIGINT or SIGTERM.
+//
+//   --threads N      connections served at once (one per hardware thread)
+//   --max-scenes N   scenes kept loaded between requests (8)
+//   --idle-timeout SECONDS
+//                    connections silent this long are closed (30)
+
+#include <render_server.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+
+namespace {
+
+RenderServer* server = nullptr;
+
+void HandleSignal(int) {
+    server->Stop();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    RenderServerOptions options;
+    std::string socket_path;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (arg == "--max-scenes" && i + 1 < argc) {
+            options.max_scenes = std::atoi(argv[++i]);
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            options.idle_timeout = std::chrono::seconds(std::atoi(argv[++i]));
+        } else if (socket_path.empty() && arg.rfind("--", 0) != 0) {
+            socket_path = arg;
+        } else {
+            socket_path.clear();
+            break;
+        }
+    }
+    if (socket_path.empty()) {
+        std::fprintf(stderr, "usage: render_server [--threads N] [--max-scenes N] "
+                             "[--idle-timeout SECONDS] SOCKET\n");
+        return 2;
+    }
+
+    try {
+        RenderServer instance(socket_path, options);
+        server = &instance;
+        std::signal(SIGINT, HandleSignal);
+        std::signal(SIGTERM, HandleSignal);
+        instance.Serve();
+        server = nullptr;
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "render_server: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
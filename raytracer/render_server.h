@@ -0,0 +1,531 @@
+#pragma once
+
+#include <raytracer.h>
+#include <distributed.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Render daemon protocol over a Unix stream socket. A connection carries any number of
+// requests, each a block of "keyword values" lines ended by an empty line:
+//
+//   scene /path/to/scene.obj
+//   size 640 480
+//   fov 1.0471975511965976
+//   look_from 0 0.7 1.75
+//   look_to 0 0.7 0
+//   crop 0 0 320 240        (optional)
+//   depth 4
+//   mode full               (full, depth or normal)
+//   output /path/to/out.png (optional)
+//
+// and answered with "ok <size>\n" followed by <size> bytes of PNG, or "error <message>\n".
+// With an output path the server writes the image there itself and returns no bytes.
+struct RenderRequest {
+    std::string scene;
+    CameraOptions camera_options{0, 0};
+    RenderOptions render_options{1};
+    std::string output;
+};
+
+inline std::string FormatRenderRequest(const RenderRequest& request) {
+    const auto& camera = request.camera_options;
+    char buffer[512];
+    std::string text = "scene " + request.scene + "\n";
+    std::snprintf(buffer, sizeof(buffer),
+                  "size %d %d\nfov %.17g\nlook_from %.17g %.17g %.17g\nlook_to %.17g %.17g %.17g\n",
+                  camera.screen_width, camera.screen_height, camera.fov, camera.look_from[0],
+                  camera.look_from[1], camera.look_from[2], camera.look_to[0], camera.look_to[1],
+                  camera.look_to[2]);
+    text += buffer;
+    if (camera.crop) {
+        text += "crop " + std::to_string(camera.crop->x) + " " + std::to_string(camera.crop->y) +
+                " " + std::to_string(camera.crop->width) + " " +
+                std::to_string(camera.crop->height) + "\n";
+    }
+    text += "depth " + std::to_string(request.render_options.depth) + "\n";
+    const auto mode = request.render_options.mode;
+    text += std::string("mode ") +
+            (mode == RenderMode::kDepth ? "depth" : mode == RenderMode::kNormal ? "normal" : "full") +
+            "\n";
+    if (!request.output.empty()) {
+        text += "output " + request.output + "\n";
+    }
+    return text + "\n";
+}
+
+// Parses the lines of one request, without the terminating empty line.
+inline RenderRequest ParseRenderRequest(const std::vector<std::string>& lines) {
+    RenderRequest request;
+    bool has_size = false;
+    for (const auto& line : lines) {
+        std::istringstream in(line);
+        std::string keyword;
+        in >> keyword;
+        // Paths are the rest of the line, so they may contain spaces.
+        auto rest = [&line, &keyword] {
+            auto begin = line.find_first_not_of(' ', line.find(keyword) + keyword.size());
+            return begin == std::string::npos ? std::string() : line.substr(begin);
+        };
+        auto& camera = request.camera_options;
+        if (keyword == "scene") {
+            request.scene = rest();
+        } else if (keyword == "output") {
+            request.output = rest();
+        } else if (keyword == "size") {
+            in >> camera.screen_width >> camera.screen_height;
+            has_size = true;
+        } else if (keyword == "fov") {
+            in >> camera.fov;
+        } else if (keyword == "look_from") {
+            in >> camera.look_from[0] >> camera.look_from[1] >> camera.look_from[2];
+        } else if (keyword == "look_to") {
+            in >> camera.look_to[0] >> camera.look_to[1] >> camera.look_to[2];
+        } else if (keyword == "crop") {
+            CropWindow crop;
+            in >> crop.x >> crop.y >> crop.width >> crop.height;
+            camera.crop = crop;
+        } else if (keyword == "depth") {
+            in >> request.render_options.depth;
+        } else if (keyword == "mode") {
+            std::string mode;
+            in >> mode;
+            if (mode == "full") {
+                request.render_options.mode = RenderMode::kFull;
+            } else if (mode == "depth") {
+                request.render_options.mode = RenderMode::kDepth;
+            } else if (mode == "normal") {
+                request.render_options.mode = RenderMode::kNormal;
+            } else {
+                throw std::runtime_error("Unknown render mode " + mode);
+            }
+        } else {
+            throw std::runtime_error("Unknown request field " + keyword);
+        }
+        if (in.fail()) {
+            throw std::runtime_error("Malformed request line: " + line);
+        }
+    }
+    if (request.scene.empty() || !has_size || request.camera_options.screen_width <= 0 ||
+        request.camera_options.screen_height <= 0) {
+        throw std::runtime_error("Request needs a scene and a positive size");
+    }
+    return request;
+}
+
+// Buffered reads of lines and byte blocks from a socket. Every read waits at most timeout_ms
+// for data (-1 waits forever) and then fails as if the connection was closed.
+class SocketReader {
+public:
+    explicit SocketReader(int fd, int timeout_ms = -1) : fd_(fd), timeout_ms_(timeout_ms) {
+    }
+
+    // Throws when no line ends within max_size bytes.
+    bool ReadLine(std::string& line, size_t max_size = std::string::npos) {
+        line.clear();
+        while (true) {
+            auto end = buffer_.find('\n', pos_);
+            if (end != std::string::npos && end - pos_ <= max_size) {
+                line.assign(buffer_, pos_, end - pos_);
+                pos_ = end + 1;
+                return true;
+            }
+            if (buffer_.size() - pos_ > max_size) {
+                throw std::runtime_error("Line is longer than " + std::to_string(max_size) +
+                                         " bytes");
+            }
+            if (!Fill()) {
+                return false;
+            }
+        }
+    }
+
+    bool Read(void* data, size_t size) {
+        auto* cur = static_cast<char*>(data);
+        while (size) {
+            if (pos_ == buffer_.size() && !Fill()) {
+                return false;
+            }
+            size_t chunk = std::min(size, buffer_.size() - pos_);
+            std::copy_n(buffer_.data() + pos_, chunk, cur);
+            pos_ += chunk;
+            cur += chunk;
+            size -= chunk;
+        }
+        return true;
+    }
+
+private:
+    bool Fill() {
+        buffer_.erase(0, pos_);
+        pos_ = 0;
+        char chunk[4096];
+        while (true) {
+            pollfd fds = {fd_, POLLIN, 0};
+            int ready = poll(&fds, 1, timeout_ms_);
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready <= 0) {
+                return false;
+            }
+            ssize_t got = read(fd_, chunk, sizeof(chunk));
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            buffer_.append(chunk, got);
+            return true;
+        }
+    }
+
+    int fd_;
+    int timeout_ms_;
+    std::string buffer_;
+    size_t pos_ = 0;
+};
+
+// Loaded scenes by path, least recently used ones dropped beyond capacity. A scene is loaded
+// again when its OBJ file was modified (material libraries are not watched). Concurrent
+// requests for a scene that is still loading wait for that one load.
+class SceneCache {
+public:
+    explicit SceneCache(size_t capacity) : capacity_(std::max<size_t>(capacity, 1)) {
+    }
+
+    std::shared_ptr<const Scene> Get(const std::string& path) {
+        const auto mtime = std::filesystem::last_write_time(path);
+        std::promise<std::shared_ptr<const Scene>> promise;
+        std::shared_future<std::shared_ptr<const Scene>> future;
+        bool load = false;
+        {
+            std::lock_guard lock(mutex_);
+            auto it = entries_.find(path);
+            if (it != entries_.end() && it->second->mtime == mtime) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                future = it->second->scene;
+            } else {
+                if (it != entries_.end()) {
+                    lru_.erase(it->second);
+                    entries_.erase(it);
+                }
+                future = promise.get_future().share();
+                lru_.push_front({path, mtime, future});
+                entries_[path] = lru_.begin();
+                // Requests still holding an evicted scene keep it alive until they finish.
+                while (lru_.size() > capacity_) {
+                    entries_.erase(lru_.back().path);
+                    lru_.pop_back();
+                }
+                ++loads_;
+                load = true;
+            }
+        }
+        if (load) {
+            try {
+                promise.set_value(std::make_shared<const Scene>(ReadSceneParallel(path)));
+            } catch (...) {
+                promise.set_exception(std::current_exception());
+                // Failed loads are not cached, so that the next request tries again.
+                std::lock_guard lock(mutex_);
+                auto it = entries_.find(path);
+                if (it != entries_.end() && it->second->mtime == mtime) {
+                    lru_.erase(it->second);
+                    entries_.erase(it);
+                }
+            }
+        }
+        return future.get();
+    }
+
+    // Scenes read from disk so far.
+    size_t Loads() const {
+        std::lock_guard lock(mutex_);
+        return loads_;
+    }
+
+private:
+    struct Entry {
+        std::string path;
+        std::filesystem::file_time_type mtime;
+        std::shared_future<std::shared_ptr<const Scene>> scene;
+    };
+
+    size_t capacity_;
+    mutable std::mutex mutex_;
+    std::list<Entry> lru_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+    size_t loads_ = 0;
+};
+
+struct RenderServerOptions {
+    // Connections served at once; 0 means one per hardware thread.
+    size_t threads = 0;
+    // Scenes kept loaded between requests.
+    size_t max_scenes = 8;
+    // Connections that send nothing for this long are closed, so that idle clients don't hold
+    // on to the workers.
+    std::chrono::milliseconds idle_timeout{30000};
+    // Longest request accepted, in bytes; a larger one gets an error reply and is cut off.
+    size_t max_request_size = 64 * 1024;
+};
+
+// Long-lived render process listening on a Unix socket. Scenes stay loaded, with their BVHs,
+// across requests (see SceneCache), so repeated renders of a scene skip parsing and
+// acceleration structure builds. Every connection is served by one worker thread at a time.
+class RenderServer {
+public:
+    // Binds and listens right away, so clients can connect before Serve runs. A stale socket
+    // file left at the path is replaced.
+    RenderServer(std::string socket_path, const RenderServerOptions& options = {})
+        : socket_path_(std::move(socket_path)), options_(options), cache_(options.max_scenes) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socket_path_.size() >= sizeof(address.sun_path)) {
+            throw std::invalid_argument("Socket path is too long: " + socket_path_);
+        }
+        std::copy(socket_path_.begin(), socket_path_.end(), address.sun_path);
+        unlink(socket_path_.c_str());
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0 || pipe(wake_) != 0) {
+            Close();
+            throw std::runtime_error("Can't create the render server socket");
+        }
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(listen_fd_, SOMAXCONN) != 0) {
+            Close();
+            throw std::runtime_error("Can't listen on " + socket_path_);
+        }
+    }
+
+    RenderServer(const RenderServer&) = delete;
+    RenderServer& operator=(const RenderServer&) = delete;
+
+    ~RenderServer() {
+        Close();
+        unlink(socket_path_.c_str());
+    }
+
+    // Accepts and serves connections until Stop is called.
+    void Serve() {
+        const size_t threads = options_.threads
+                                   ? options_.threads
+                                   : std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i != threads; ++i) {
+            workers.emplace_back([this] { RunWorker(); });
+        }
+        pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {wake_[0], POLLIN, 0}};
+        while (true) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (fds[1].revents) {
+                break;
+            }
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                std::lock_guard lock(mutex_);
+                pending_.push_back(fd);
+                has_work_.notify_one();
+            }
+        }
+        {
+            // Clients blocked on an open connection are cut off, so that the workers finish.
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+            for (int fd : active_) {
+                shutdown(fd, SHUT_RDWR);
+            }
+            has_work_.notify_all();
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        for (int fd : pending_) {
+            close(fd);
+        }
+        pending_.clear();
+    }
+
+    // Makes Serve return; safe to call from any thread, including signal handlers.
+    void Stop() {
+        char byte = 0;
+        [[maybe_unused]] auto written = write(wake_[1], &byte, 1);
+    }
+
+    SceneCache& GetSceneCache() {
+        return cache_;
+    }
+
+    // Renders one request; errors become an error reply rather than ending the connection.
+    std::string Handle(const std::vector<std::string>& lines, std::vector<unsigned char>* png) {
+        png->clear();
+        try {
+            auto request = ParseRenderRequest(lines);
+            auto scene = cache_.Get(request.scene);
+            auto image = Render(*scene, request.camera_options, request.render_options);
+            if (request.output.empty()) {
+                *png = image.EncodePng();
+            } else {
+                image.Write(request.output);
+            }
+            return "ok " + std::to_string(png->size()) + "\n";
+        } catch (const std::exception& e) {
+            std::string message = e.what();
+            std::replace(message.begin(), message.end(), '\n', ' ');
+            return "error " + message + "\n";
+        }
+    }
+
+private:
+    void RunWorker() {
+        while (true) {
+            int fd;
+            {
+                std::unique_lock lock(mutex_);
+                has_work_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+                if (stopping_) {
+                    return;
+                }
+                fd = pending_.front();
+                pending_.pop_front();
+                active_.insert(fd);
+            }
+            ServeConnection(fd);
+            {
+                std::lock_guard lock(mutex_);
+                active_.erase(fd);
+            }
+            close(fd);
+        }
+    }
+
+    void ServeConnection(int fd) {
+        SocketReader reader(fd, static_cast<int>(options_.idle_timeout.count()));
+        std::vector<std::string> lines;
+        std::vector<unsigned char> png;
+        std::string line;
+        size_t request_size = 0;
+        while (true) {
+            try {
+                const auto left =
+                    options_.max_request_size - std::min(request_size, options_.max_request_size);
+                if (!reader.ReadLine(line, left)) {
+                    return;
+                }
+            } catch (const std::runtime_error&) {
+                std::string reply = "error Request is longer than " +
+                                    std::to_string(options_.max_request_size) + " bytes\n";
+                WriteAll(fd, reply.data(), reply.size());
+                return;
+            }
+            request_size += line.size() + 1;
+            if (!line.empty()) {
+                lines.push_back(std::move(line));
+                continue;
+            }
+            request_size = 0;
+            if (lines.empty()) {
+                continue;
+            }
+            auto reply = Handle(lines, &png);
+            lines.clear();
+            if (!WriteAll(fd, reply.data(), reply.size()) ||
+                !WriteAll(fd, png.data(), png.size())) {
+                return;
+            }
+        }
+    }
+
+    void Close() {
+        for (int* fd : {&listen_fd_, &wake_[0], &wake_[1]}) {
+            if (*fd >= 0) {
+                close(*fd);
+                *fd = -1;
+            }
+        }
+    }
+
+    std::string socket_path_;
+    RenderServerOptions options_;
+    SceneCache cache_;
+    int listen_fd_ = -1;
+    int wake_[2] = {-1, -1};
+    std::mutex mutex_;
+    std::condition_variable has_work_;
+    std::deque<int> pending_;
+    std::unordered_set<int> active_;
+    bool stopping_ = false;
+};
+
+// Client side: connects, sends the requests over one connection and returns the PNG bytes of
+// every reply (empty for requests with an output path). Throws on error replies.
+inline std::vector<std::vector<unsigned char>> RequestRenders(
+    const std::string& socket_path, const std::vector<RenderRequest>& requests) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("Socket path is too long: " + socket_path);
+    }
+    std::copy(socket_path.begin(), socket_path.end(), address.sun_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw std::runtime_error("Can't connect to the render server at " + socket_path);
+    }
+    std::vector<std::vector<unsigned char>> images;
+    try {
+        SocketReader reader(fd);
+        for (const auto& request : requests) {
+            auto text = FormatRenderRequest(request);
+            std::string reply;
+            if (!WriteAll(fd, text.data(), text.size()) || !reader.ReadLine(reply)) {
+                throw std::runtime_error("Render server closed the connection");
+            }
+            if (reply.rfind("ok ", 0) != 0) {
+                throw std::runtime_error("Render server: " + reply);
+            }
+            auto& png = images.emplace_back(std::stoull(reply.substr(3)));
+            if (!reader.Read(png.data(), png.size())) {
+                throw std::runtime_error("Render server closed the connection");
+            }
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return images;
+}
+
+inline std::vector<unsigned char> RequestRender(const std::string& socket_path,
+                                                const RenderRequest& request) {
+    return std::move(RequestRenders(socket_path, {request}).front());
+}
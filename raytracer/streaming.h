@@ -0,0 +1,158 @@
+#pragma once
+
+#include <raytracer.h>
+#include <parallel_for.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// PNG file written one row at a time, for images that never exist in memory as a whole.
+class PngStreamWriter {
+public:
+    PngStreamWriter(const std::string& filename, int width, int height)
+        : width_(width), height_(height) {
+        fp_ = fopen(filename.c_str(), "wb");
+        if (!fp_) {
+            throw std::runtime_error("Can't open file " + filename);
+        }
+        png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        if (!png_) {
+            fclose(fp_);
+            throw std::runtime_error("Can't create png write struct");
+        }
+        info_ = png_create_info_struct(png_);
+        if (!info_) {
+            png_destroy_write_struct(&png_, nullptr);
+            fclose(fp_);
+            throw std::runtime_error("Can't create png info struct");
+        }
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+        png_init_io(png_, fp_);
+        png_set_IHDR(png_, info_, width_, height_, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png_, info_);
+    }
+
+    PngStreamWriter(const PngStreamWriter&) = delete;
+    PngStreamWriter& operator=(const PngStreamWriter&) = delete;
+
+    ~PngStreamWriter() {
+        if (png_) {
+            png_destroy_write_struct(&png_, &info_);
+            fclose(fp_);
+        }
+    }
+
+    // Next row, width RGB byte triples.
+    void WriteRow(const png_byte* rgb) {
+        if (rows_ == height_) {
+            throw std::logic_error("All PNG rows are already written");
+        }
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+        png_write_row(png_, rgb);
+        ++rows_;
+    }
+
+    // Ends the file once every row is written.
+    void Finish() {
+        if (rows_ != height_) {
+            throw std::logic_error("PNG rows are missing");
+        }
+        if (setjmp(png_jmpbuf(png_))) {
+            abort();
+        }
+        png_write_end(png_, nullptr);
+        png_destroy_write_struct(&png_, &info_);
+        bool closed = fclose(fp_) == 0;
+        png_ = nullptr;
+        if (!closed) {
+            throw std::runtime_error("Can't write the PNG file");
+        }
+    }
+
+private:
+    int width_;
+    int height_;
+    int rows_ = 0;
+    FILE* fp_ = nullptr;
+    png_structp png_ = nullptr;
+    png_infop info_ = nullptr;
+};
+
+struct StreamingOptions {
+    // Rows rendered, tone mapped and encoded at a time; memory use is proportional to it.
+    int band_height = 64;
+    // Exposure and gamma as in ToneMap. Without a white point one is estimated from a render
+    // of the frame scaled down by prepass_divisor along both axes; highlights smaller than
+    // a pre-pass pixel may then clip.
+    ToneMapOptions tone_map;
+    int prepass_divisor = 16;
+    // 0 means one per hardware thread.
+    size_t threads = 0;
+};
+
+// Full render of the crop window (or the whole frame) straight into a PNG file, band by band,
+// so that no frame-sized buffer is ever allocated. With the white point of the whole frame the
+// file is identical to the one Render produces. Returns the white point used.
+inline double RenderStreaming(const Scene& scene, const CameraOptions& camera_options,
+                              const RenderOptions& render_options, const std::string& filename,
+                              const StreamingOptions& options = {}) {
+    if (render_options.mode != RenderMode::kFull) {
+        throw std::invalid_argument("Only full renders can be streamed");
+    }
+    if (options.band_height <= 0 || options.prepass_divisor <= 0) {
+        throw std::invalid_argument("Band height and pre-pass divisor must be positive");
+    }
+    const size_t threads =
+        options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    double white_point;
+    if (options.tone_map.white_point) {
+        white_point = GetWhitePoint(options.tone_map, 0);
+    } else {
+        CameraOptions prepass = camera_options;
+        prepass.screen_width = std::max(1, camera_options.screen_width / options.prepass_divisor);
+        prepass.screen_height =
+            std::max(1, camera_options.screen_height / options.prepass_divisor);
+        prepass.crop.reset();
+        white_point = GetWhitePoint(options.tone_map,
+                                    MaxChannel(RenderRadiance(scene, prepass, render_options)));
+    }
+
+    Camera camera(camera_options);
+    const auto region = GetRenderRegion(camera_options);
+    const int width = region.Width();
+    PngStreamWriter writer(filename, width, region.Height());
+    RadianceBuffer band(width, std::min(options.band_height, region.Height()));
+    std::vector<png_byte> row(static_cast<size_t>(width) * 3);
+    for (int y = region.y_begin; y < region.y_end; y += options.band_height) {
+        const Tile band_region{region.x_begin, y, region.x_end,
+                               std::min(y + options.band_height, region.y_end)};
+        const auto tiles = MakeTiles(band_region);
+        ParallelFor(tiles.size(), threads, [&](size_t t) {
+            PasteTile(tiles[t], TraceTile(scene, camera, render_options, tiles[t]), band,
+                      band_region);
+        });
+        const float* px = band.Data().data();
+        for (int j = 0; j != band_region.Height(); ++j) {
+            for (int x = 0; x != width; ++x, px += 3) {
+                auto color = ToneMapPixel(px, options.tone_map, white_point);
+                row[3 * x] = color.r;
+                row[3 * x + 1] = color.g;
+                row[3 * x + 2] = color.b;
+            }
+            writer.WriteRow(row.data());
+        }
+    }
+    writer.Finish();
+    return white_point;
+}
@@ -1,6 +1,8 @@
 #include <catch.hpp>
 
+#include <chrono>
 #include <cmath>
+#include <filesystem>
 #include <string>
 #include <optional>
 
@@ -8,6 +10,22 @@
 #include <render_options.h>
 #include <commons.hpp>
 #include <raytracer.h>
+#include <distributed.h>
+#include <gbuffer.h>
+#include <texture_cache.h>
+#include <out_of_core.h>
+#include <denoise.h>
+#include <image_diff.h>
+#include <render_server.h>
+#include <image_writer.h>
+#include <streaming.h>
+#include <batch_shading.h>
+#include <render_jobs.h>
+
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <thread>
 
 int artifact_index = 0;
 #ifdef SHAD_ARTIFACTS_DIR
@@ -83,6 +101,24 @@ TEST_CASE("Box with spheres", "[raytracer]") {
     CheckImage("box/cube.obj", "box/cube.png", camera_opts, render_opts);
 }
 
+// A crop re-rendered into the frame keeps the frame's white point.
+TEST_CASE("Crop composite", "[raytracer]") {
+    CameraOptions camera_opts(640, 480, M_PI / 3);
+    camera_opts.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    camera_opts.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    RenderOptions render_opts{4};
+    const auto filename = kBasePath + "tests/box/cube.obj";
+    const auto scale =
+        GetFrameScale(RenderAovs(filename, camera_opts, render_opts, {Aov::kBeauty}));
+    camera_opts.crop = CropWindow{40, 360, 120, 90};
+    Image composite(kBasePath + "tests/box/cube.png");
+    composite.Paste(Image(120, 90), 40, 360);
+    REQUIRE_THROWS_AS(RenderInto(composite, filename, camera_opts, render_opts),
+                      std::invalid_argument);
+    RenderInto(composite, filename, camera_opts, render_opts, scale);
+    Compare(composite, Image(kBasePath + "tests/box/cube.png"));
+}
+
 TEST_CASE("Distorted box", "[raytracer]") {
     CameraOptions camera_opts(500, 500);
     camera_opts.look_from = std::array<double, 3>{-0.5, 1.5, 1.98};
@@ -99,3 +135,953 @@ TEST_CASE("Deer", "[raytracer]") {
     RenderOptions render_opts{1};
     CheckImage("deer/CERF_Free.obj", "deer/result.png", camera_opts, render_opts);
 }
+
+// Direction of the primary ray through pixel (i, j) as the old per-frame table computed it.
+Vector ReferenceRayDir(const CameraOptions& camera_options, int i, int j) {
+    Vector w = Vector(camera_options.look_from) - Vector(camera_options.look_to);
+    w.Normalize();
+    Vector u = CrossProduct({0, 1, 0}, w);
+    if (1 - std::fabs(w[1]) < 1e-9) {
+        u = {1, 0, 0};
+    }
+    u.Normalize();
+    Vector v = CrossProduct(w, u);
+    v.Normalize();
+    double scale = std::tan(camera_options.fov / 2);
+    double aspect_ratio = 1.0 * camera_options.screen_width / camera_options.screen_height;
+    double x = (2 * (i + 0.5) / camera_options.screen_width - 1) * aspect_ratio * scale;
+    double y = (2 * (j + 0.5) / camera_options.screen_height - 1) * scale;
+    Vector t = {x, -y, -1};
+    t.Normalize();
+    Vector dir = t[0] * u + t[1] * v + t[2] * w;
+    dir.Normalize();
+    return dir;
+}
+
+TEST_CASE("Camera rays", "[raytracer]") {
+    CameraOptions camera_opts(64, 27, 1.2);
+    camera_opts.look_from = std::array<double, 3>{1.5, -0.5, 2.0};
+    camera_opts.look_to = std::array<double, 3>{-0.5, 0.3, -1.0};
+    // Looking straight down or up the y axis makes the up vector useless for the basis.
+    auto down = camera_opts;
+    down.look_from = std::array<double, 3>{0.0, 2.0, 0.0};
+    down.look_to = std::array<double, 3>{0.0, 0.0, 0.0};
+    auto up = down;
+    up.look_from = std::array<double, 3>{0.0, -2.0, 0.0};
+    for (const auto& options : {camera_opts, down, up}) {
+        Camera camera(options);
+        double max_origin_error = 0;
+        double max_error = 0;
+        for (int j = 0; j != options.screen_height; ++j) {
+            for (int i = 0; i != options.screen_width; ++i) {
+                auto ray = camera.GetRay(i, j);
+                max_origin_error = std::max(max_origin_error,
+                                            Length(ray.GetOrigin(), Vector(options.look_from)));
+                max_error = std::max(max_error,
+                                     Length(ray.GetDirection(), ReferenceRayDir(options, i, j)));
+            }
+        }
+        REQUIRE(max_origin_error == 0);
+        REQUIRE(max_error < 1e-12);
+    }
+}
+
+TEST_CASE("Tile order", "[raytracer]") {
+    const int width = 70;
+    const int height = 45;
+    auto tiles = MakeTiles(width, height);
+    REQUIRE(tiles.size() == 5 * 3);
+    REQUIRE(tiles[0].x_begin == 0);
+    REQUIRE(tiles[1].x_begin == kTileSize);
+    REQUIRE(tiles[2].y_begin == kTileSize);
+
+    std::vector<int> visits(width * height);
+    ForEachPixel(tiles, [&](int x, int y) { ++visits[y * width + x]; });
+    REQUIRE(std::all_of(visits.begin(), visits.end(), [](int count) { return count == 1; }));
+}
+
+TEST_CASE("Distributed render", "[raytracer]") {
+    CameraOptions camera_opts(640, 480);
+    RenderOptions render_opts{1};
+    DistributedOptions options;
+    options.local_workers = 3;
+    // The first exits without answering and the second stalls partway through an answer, so
+    // their tiles have to be picked up by the others.
+    options.worker_commands = {{"false"}, {"sh", "-c", "printf R; exec sleep 60"}};
+    options.worker_timeout = std::chrono::seconds(1);
+    auto image = RenderDistributed(kBasePath + "tests/shading_parts/scene.obj", camera_opts,
+                                   render_opts, options);
+    Image ok_image(kBasePath + "tests/shading_parts/scene.png");
+    Compare(image, ok_image);
+}
+
+TEST_CASE("Render server", "[raytracer]") {
+    namespace fs = std::filesystem;
+    const auto socket_path = (fs::temp_directory_path() / "raytracer_server.sock").string();
+    const auto png_path = (fs::temp_directory_path() / "raytracer_server.png").string();
+    RenderServerOptions options;
+    options.threads = 2;
+    options.idle_timeout = std::chrono::milliseconds(500);
+    options.max_request_size = 1024;
+    RenderServer server(socket_path, options);
+    std::thread serving([&server] { server.Serve(); });
+
+    RenderRequest request;
+    request.scene = kBasePath + "tests/shading_parts/scene.obj";
+    request.camera_options = CameraOptions(640, 480);
+    REQUIRE(ParseRenderRequest({"scene " + request.scene, "size 640 480"}).camera_options.fov ==
+            request.camera_options.fov);
+
+    // Two clients at once, one of them with two requests on its connection.
+    std::vector<std::vector<unsigned char>> first;
+    std::thread client([&] { first = RequestRenders(socket_path, {request, request}); });
+    auto second = RequestRender(socket_path, request);
+    client.join();
+    REQUIRE(first.size() == 2);
+    REQUIRE(first[0] == second);
+    REQUIRE(first[1] == second);
+    REQUIRE(server.GetSceneCache().Loads() == 1);
+
+    std::ofstream(png_path, std::ios::binary)
+        .write(reinterpret_cast<const char*>(second.data()), second.size());
+    Compare(Image(png_path), Image(kBasePath + "tests/shading_parts/scene.png"));
+    fs::remove(png_path);
+
+    request.output = png_path;
+    REQUIRE(RequestRender(socket_path, request).empty());
+    Compare(Image(png_path), Image(kBasePath + "tests/shading_parts/scene.png"));
+    fs::remove(png_path);
+
+    request.scene = kBasePath + "tests/missing.obj";
+    REQUIRE_THROWS_AS(RequestRender(socket_path, request), std::runtime_error);
+    REQUIRE(server.GetSceneCache().Loads() == 1);
+
+    // Idle clients and requests that never end are cut off instead of holding the workers.
+    auto connect_raw = [&socket_path] {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::copy(socket_path.begin(), socket_path.end(), address.sun_path);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        REQUIRE(connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+        return fd;
+    };
+    const int idle = connect_raw();
+    const int endless = connect_raw();
+    const std::string junk(2000, 'x');
+    REQUIRE(WriteAll(endless, junk.data(), junk.size()));
+    std::string reply;
+    REQUIRE(SocketReader(endless).ReadLine(reply));
+    REQUIRE(reply.rfind("error ", 0) == 0);
+    char byte;
+    REQUIRE(read(endless, &byte, 1) == 0);
+    REQUIRE(read(idle, &byte, 1) == 0);
+    close(idle);
+    close(endless);
+    request.scene = kBasePath + "tests/shading_parts/scene.obj";
+    request.output.clear();
+    REQUIRE(RequestRender(socket_path, request) == second);
+
+    server.Stop();
+    serving.join();
+}
+
+TEST_CASE("Image writer", "[raytracer]") {
+    namespace fs = std::filesystem;
+    const auto dir = fs::temp_directory_path() / "raytracer_frames";
+    fs::create_directories(dir);
+    auto scene = ReadScene(kBasePath + "tests/shading_parts/scene.obj");
+    const Image ok_image(kBasePath + "tests/shading_parts/scene.png");
+
+    ImageWriterOptions options;
+    options.jpeg_quality = 95;
+    ImageWriter writer(options);
+    std::vector<CameraOptions> cameras(3, CameraOptions(640, 480));
+    std::vector<std::string> paths = {(dir / "0.png").string(), (dir / "1.jpg").string(),
+                                      (dir / "2.JPEG").string()};
+    RenderFrames(scene, cameras, RenderOptions{1}, paths, writer);
+    Compare(Image(paths[0]), ok_image);
+    for (const auto& path : {paths[1], paths[2]}) {
+        auto diff = DiffImages(Image(path), ok_image);
+        INFO(path << " mean " << diff.mean_distance << " psnr " << diff.psnr);
+        REQUIRE(diff.psnr > 35);
+    }
+    const Image frame(paths[0]);
+    REQUIRE(frame.EncodeJpeg(10).size() < frame.EncodeJpeg(95).size());
+
+    writer.Submit(Image(4, 4), (dir / "missing" / "frame.png").string());
+    REQUIRE_THROWS_AS(writer.Flush(), std::runtime_error);
+    writer.Flush();
+    fs::remove_all(dir);
+}
+
+TEST_CASE("Scene features", "[raytracer]") {
+    auto triangle = ReadScene(kBasePath + "tests/triangle/scene.obj");
+    REQUIRE((GetSceneFeatures(triangle) & (kSpheres | kReflection | kRefraction)) == 0);
+    auto box = ReadScene(kBasePath + "tests/box/cube.obj");
+    const auto features = GetSceneFeatures(box);
+    REQUIRE(features == kAllSceneFeatures);
+
+    // Without reflective or refractive materials the specialized kernel traces no secondary
+    // rays, yet matches the general one.
+    for (MaterialId id = 0; id != box.GetMaterials().Size(); ++id) {
+        auto material = box.GetMaterials()[id];
+        material.albedo = {1, 0, 0};
+        box.UpdateMaterial(box.GetMaterials().GetName(id), material);
+    }
+    REQUIRE(GetSceneFeatures(box) == (kTriangles | kSpheres | kDiffuseLight | kSpecularLight));
+    CameraOptions camera_opts(64, 48, M_PI / 3);
+    camera_opts.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    camera_opts.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    Camera camera(camera_opts);
+    const auto render_opts = ForCamera(RenderOptions{4}, camera);
+    int mismatches = 0;
+    for (int j = 0; j != 48; ++j) {
+        for (int i = 0; i != 64; ++i) {
+            auto ray = camera.GetRay(i, j);
+            auto general = Cast(box, ray, render_opts);
+            auto special = Cast<kTriangles | kSpheres | kDiffuseLight | kSpecularLight>(
+                box, ray, render_opts);
+            for (int k = 0; k != 3; ++k) {
+                mismatches += general[k] != special[k];
+            }
+        }
+    }
+    REQUIRE(mismatches == 0);
+}
+
+TEST_CASE("Trace cost", "[raytracer]") {
+    CameraOptions camera_opts(64, 48, M_PI / 3);
+    camera_opts.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    camera_opts.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    RenderOptions render_opts{4};
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    auto plain = RenderAovs(scene, camera_opts, render_opts, {Aov::kBeauty});
+    auto aovs = RenderAovs(scene, camera_opts, render_opts, {Aov::kBeauty, Aov::kCost});
+    REQUIRE(plain.cost.empty());
+    REQUIRE(aovs.radiance->Data() == plain.radiance->Data());
+    REQUIRE(aovs.cost.size() == 64 * 48);
+
+    size_t max_depth = 0;
+    size_t max_shadow_rays = 0;
+    bool all_traversed = true;
+    for (const auto& pixel : aovs.cost) {
+        max_depth = std::max(max_depth, pixel.depth);
+        max_shadow_rays = std::max(max_shadow_rays, pixel.shadow_rays);
+        all_traversed = all_traversed && pixel.traversal_steps > 0 && pixel.intersection_tests > 0;
+    }
+    REQUIRE(all_traversed);
+    // The box has mirror and glass spheres, so some paths reach the depth limit.
+    REQUIRE(max_depth == 4);
+    REQUIRE(max_shadow_rays > scene.GetLights().size());
+
+    auto plane = GetCostPlane(aovs.cost, CostMetric::kShadowRays);
+    REQUIRE(plane[100] == aovs.cost[100].shadow_rays);
+    auto image = CostToImage(aovs.cost, 64, CostMetric::kTraversalSteps);
+    REQUIRE(image.Width() == 64);
+    REQUIRE(image.Height() == 48);
+    REQUIRE_THROWS_AS(CostToImage(aovs.cost, 50, CostMetric::kDepth), std::invalid_argument);
+
+    // Counting is compiled out of the plain kernels.
+    CurrentTraceCost() = {};
+    Cast(scene, Camera(camera_opts).GetRay(32, 24), ForCamera(render_opts, Camera(camera_opts)));
+    REQUIRE(CurrentTraceCost().traversal_steps == 0);
+}
+
+TEST_CASE("Streaming render", "[raytracer]") {
+    const auto path =
+        (std::filesystem::temp_directory_path() / "raytracer_streaming.png").string();
+    auto scene = ReadScene(kBasePath + "tests/shading_parts/scene.obj");
+    CameraOptions camera_opts(640, 480);
+    RenderOptions render_opts{1};
+    const double max = MaxChannel(RenderRadiance(scene, camera_opts, render_opts));
+
+    StreamingOptions options;
+    options.band_height = 50;
+    options.tone_map.white_point = max;
+    REQUIRE(RenderStreaming(scene, camera_opts, render_opts, path, options) == max);
+    auto diff = DiffImages(Image(path), Render(scene, camera_opts, render_opts));
+    REQUIRE(diff.max_distance == 0);
+
+    options.tone_map.white_point.reset();
+    double estimate = RenderStreaming(scene, camera_opts, render_opts, path, options);
+    INFO("estimate " << estimate << " max " << max);
+    REQUIRE(estimate > 0.5 * max);
+    REQUIRE(estimate <= max);
+    Compare(Image(path), Image(kBasePath + "tests/shading_parts/scene.png"));
+
+    camera_opts.crop = CropWindow{100, 100, 200, 90};
+    RenderStreaming(scene, camera_opts, render_opts, path, options);
+    Image cropped(path);
+    REQUIRE(cropped.Width() == 200);
+    REQUIRE(cropped.Height() == 90);
+    std::filesystem::remove(path);
+
+    render_opts.mode = RenderMode::kDepth;
+    REQUIRE_THROWS_AS(RenderStreaming(scene, camera_opts, render_opts, path),
+                      std::invalid_argument);
+}
+
+TEST_CASE("Render jobs", "[raytracer]") {
+    auto scene =
+        std::make_shared<const Scene>(ReadScene(kBasePath + "tests/shading_parts/scene.obj"));
+    CameraOptions camera_opts(640, 480);
+    RenderOptions render_opts{1};
+    {
+        RenderScheduler scheduler(2);
+        auto job = scheduler.Submit(scene, camera_opts, render_opts);
+        auto image = job.Get();
+        REQUIRE(job.State() == RenderJobState::kDone);
+        REQUIRE(job.Progress().tiles_done == job.Progress().tiles_total);
+        REQUIRE(job.Progress().tiles_total == MakeTiles(GetRenderRegion(camera_opts)).size());
+        REQUIRE(DiffImages(image, Render(*scene, camera_opts, render_opts)).max_distance == 0);
+    }
+
+    // With one thread the preview runs in between the tiles of the batch frame.
+    RenderScheduler scheduler(1);
+    auto batch = scheduler.Submit(scene, camera_opts, render_opts);
+    CameraOptions preview_opts(64, 48);
+    auto preview = scheduler.Submit(scene, preview_opts, render_opts, 1);
+    Compare(preview.Get(), Render(*scene, preview_opts, render_opts));
+    REQUIRE(batch.Progress().tiles_done < batch.Progress().tiles_total);
+    batch.Cancel();
+    REQUIRE_THROWS_AS(batch.Get(), std::runtime_error);
+    REQUIRE(batch.State() == RenderJobState::kCancelled);
+    REQUIRE(batch.Progress().tiles_done < batch.Progress().tiles_total);
+
+    auto last = scheduler.Submit(scene, preview_opts, render_opts);
+    Compare(last.Get(), Render(*scene, preview_opts, render_opts));
+
+    render_opts.mode = RenderMode::kDepth;
+    REQUIRE_THROWS_AS(scheduler.Submit(scene, camera_opts, render_opts), std::invalid_argument);
+}
+
+struct ShadingBatch {
+    std::vector<ShadingPoint> points;
+    std::vector<char> occluded;
+};
+
+// Primary hits of the box lit by extra lights, a third of them blocked at random.
+ShadingBatch MakeShadingBatch(Scene& scene, int width, int height, int extra_lights) {
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<double> unit(0, 1);
+    for (int k = 0; k != extra_lights; ++k) {
+        scene.AddLight({{2 * unit(gen) - 1, 1.5 * unit(gen), 2 * unit(gen) - 1}, {0.1, 0.1, 0.1}});
+    }
+    CameraOptions camera_opts(width, height, M_PI / 3);
+    camera_opts.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    camera_opts.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    Camera camera(camera_opts);
+    ShadingBatch batch;
+    for (int j = 0; j != height; ++j) {
+        for (int i = 0; i != width; ++i) {
+            auto ray = camera.GetRay(i, j);
+            auto hit = FindClosestHit(scene, ray);
+            if (!hit) {
+                continue;
+            }
+            batch.points.push_back({hit->intersection.GetPosition(), hit->normal, ray.GetOrigin(),
+                                    scene.GetMaterials()[hit->material_id].diffuse_color,
+                                    hit->material_id});
+            for (size_t k = 0; k != scene.GetLights().size(); ++k) {
+                batch.occluded.push_back(unit(gen) < 0.3);
+            }
+        }
+    }
+    return batch;
+}
+
+std::vector<Vector> CalculateBasesOneByOne(const Scene& scene, const ShadingBatch& batch) {
+    std::vector<Vector> bases;
+    for (size_t i = 0; i != batch.points.size(); ++i) {
+        const auto& point = batch.points[i];
+        const char* blocked = batch.occluded.data() + i * scene.GetLights().size();
+        bases.push_back(CalculateBase(scene, Intersection(point.position, point.normal, 0),
+                                      scene.GetMaterials()[point.material_id],
+                                      point.diffuse_color, point.normal, point.from,
+                                      [&](size_t k) { return blocked[k]; }));
+    }
+    return bases;
+}
+
+TEST_CASE("Batch shading", "[raytracer]") {
+    for (double x : {1e-9, 0.01, 0.3, 0.999, 1.0}) {
+        REQUIRE(FastInvSqrt(x) == Approx(1 / std::sqrt(x)).epsilon(1e-14));
+        REQUIRE(FastUnitPow(x, 7.5) == Approx(std::pow(x, 7.5)).epsilon(1e-12));
+    }
+    REQUIRE(FastUnitPow(0, 0) == 1);
+    REQUIRE(FastUnitPow(0, 3) < 1e-150);
+
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    // A fractional exponent takes the log/exp path instead of repeated squaring.
+    auto floor_material = scene.GetMaterials()[scene.GetMaterials().GetId("floor")];
+    floor_material.specular_exponent = 10.5;
+    scene.UpdateMaterial("floor", floor_material);
+    const auto batch = MakeShadingBatch(scene, 80, 60, 30);
+    const auto expected = CalculateBasesOneByOne(scene, batch);
+    const auto bases = CalculateBases(scene, batch.points, batch.occluded);
+    REQUIRE(bases.size() == expected.size());
+    double max_error = 0;
+    for (size_t i = 0; i != bases.size(); ++i) {
+        for (int c = 0; c != 3; ++c) {
+            max_error = std::max(max_error, std::fabs(bases[i][c] - expected[i][c]) /
+                                                std::max(1e-9, std::fabs(expected[i][c])));
+        }
+    }
+    REQUIRE(max_error < 1e-9);
+
+    // The in-core renderer shades the primary hits of a tile as one batch.
+    CameraOptions camera_opts(80, 60, M_PI / 3);
+    camera_opts.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    camera_opts.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    const Camera camera(camera_opts);
+    const RenderOptions render_opts{4};
+    const auto tile_radiance = TraceTile(scene, camera, render_opts, {0, 0, 80, 60});
+    max_error = 0;
+    for (int j = 0; j != 60; ++j) {
+        for (int i = 0; i != 80; ++i) {
+            const auto cast = Cast(scene, camera.GetRay(i, j), ForCamera(render_opts, camera));
+            for (int c = 0; c != 3; ++c) {
+                max_error = std::max(max_error, std::fabs(tile_radiance[j * 80 + i][c] - cast[c]) /
+                                                    std::max(1e-9, std::fabs(cast[c])));
+            }
+        }
+    }
+    REQUIRE(max_error < 1e-9);
+
+    auto occluded = batch.occluded;
+    occluded.pop_back();
+    REQUIRE_THROWS_AS(CalculateBases(scene, batch.points, occluded), std::invalid_argument);
+}
+
+TEST_CASE("Shadow ray packets", "[raytracer]") {
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    const auto batch = MakeShadingBatch(scene, 80, 60, 15);
+    auto check = [&batch](const Scene& scene) {
+        size_t blocked = 0;
+        for (const auto& light : scene.GetLights()) {
+            std::vector<ShadowRay> shadow_rays;
+            for (const auto& point : batch.points) {
+                Intersection intersection(point.position, point.normal, 0);
+                shadow_rays.push_back(GetShadowRay(intersection, point.normal, light));
+            }
+            const auto occluded = FindOcclusions(scene, shadow_rays);
+            REQUIRE(occluded.size() == shadow_rays.size());
+            for (size_t i = 0; i != shadow_rays.size(); ++i) {
+                const auto& shadow = shadow_rays[i];
+                REQUIRE(occluded[i] == HasIntersections(scene, shadow.ray, shadow.length));
+                blocked += occluded[i];
+            }
+        }
+        REQUIRE(blocked > 0);
+        REQUIRE(blocked < batch.points.size() * scene.GetLights().size());
+    };
+    check(scene);
+    scene.CompressGeometry();
+    scene.Commit();
+    check(scene);
+    REQUIRE(FindOcclusions(scene, {}).empty());
+}
+
+TEST_CASE("Batch shading cost", "[.][benchmark]") {
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    const auto batch = MakeShadingBatch(scene, 320, 240, 63);
+    auto start = std::chrono::steady_clock::now();
+    auto expected = CalculateBasesOneByOne(scene, batch);
+    std::chrono::duration<double> one_by_one = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    auto bases = CalculateBases(scene, batch.points, batch.occluded);
+    std::chrono::duration<double> batched = std::chrono::steady_clock::now() - start;
+    WARN(batch.points.size() << " points, " << scene.GetLights().size() << " lights: one by one "
+                             << one_by_one.count() << "s, batched " << batched.count() << "s");
+}
+
+// Shadow rays of the primary hits of every 16x16 tile, one packet per tile and light.
+std::vector<std::vector<ShadowRay>> MakeShadowPackets(const Scene& scene,
+                                                      const CameraOptions& camera_opts) {
+    const Camera camera(camera_opts);
+    std::vector<std::vector<ShadowRay>> packets;
+    for (const auto& tile : MakeTiles(camera_opts.screen_width, camera_opts.screen_height)) {
+        std::vector<Hit> hits;
+        for (int j = tile.y_begin; j != tile.y_end; ++j) {
+            for (int i = tile.x_begin; i != tile.x_end; ++i) {
+                if (auto hit = FindClosestHit(scene, camera.GetRay(i, j))) {
+                    hits.push_back(*hit);
+                }
+            }
+        }
+        for (const auto& light : scene.GetLights()) {
+            auto& shadow_rays = packets.emplace_back();
+            for (const auto& hit : hits) {
+                shadow_rays.push_back(GetShadowRay(hit.intersection, hit.normal, light));
+            }
+        }
+    }
+    return packets;
+}
+
+TEST_CASE("Shadow ray packet cost", "[.][benchmark]") {
+    auto measure = [](const Scene& scene, const CameraOptions& camera_opts) {
+        const auto packets = MakeShadowPackets(scene, camera_opts);
+        size_t count = 0;
+        size_t expected = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (const auto& shadow_rays : packets) {
+            for (const auto& shadow : shadow_rays) {
+                expected += HasIntersections(scene, shadow.ray, shadow.length);
+            }
+            count += shadow_rays.size();
+        }
+        std::chrono::duration<double> one_by_one = std::chrono::steady_clock::now() - start;
+        size_t blocked = 0;
+        start = std::chrono::steady_clock::now();
+        for (const auto& shadow_rays : packets) {
+            for (char occluded : FindOcclusions(scene, shadow_rays)) {
+                blocked += occluded;
+            }
+        }
+        std::chrono::duration<double> in_packets = std::chrono::steady_clock::now() - start;
+        REQUIRE(blocked == expected);
+        WARN(scene.GetTriangleCount() << " triangles, " << count << " shadow rays: one by one "
+                                      << one_by_one.count() << "s, in packets "
+                                      << in_packets.count() << "s");
+    };
+
+    auto box = ReadScene(kBasePath + "tests/box/cube.obj");
+    for (int k = 0; k != 63; ++k) {
+        box.AddLight({{std::cos(k * 0.8), 1.5 * (k % 7) / 7, std::sin(k * 0.8)}, {0.1, 0.1, 0.1}});
+    }
+    CameraOptions box_camera(320, 240, M_PI / 3);
+    box_camera.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    box_camera.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    measure(box, box_camera);
+
+    auto deer = ReadScene(kBasePath + "tests/deer/CERF_Free.obj");
+    for (int k = 0; k != 8; ++k) {
+        deer.AddLight({{200 * std::cos(k * 0.8), 300, 200 * std::sin(k * 0.8)}, {1, 1, 1}});
+    }
+    CameraOptions deer_camera(320, 320);
+    deer_camera.look_from = std::array<double, 3>{100, 200, 150};
+    deer_camera.look_to = std::array<double, 3>{0.0, 100.0, 0.0};
+    measure(deer, deer_camera);
+}
+
+TEST_CASE("Memory accounting", "[raytracer]") {
+    auto& accounting = GetMemoryAccounting();
+    auto current = [&accounting](MemoryCategory category) {
+        return accounting.Get(category).current;
+    };
+    std::array<size_t, kMemoryCategoryCount> before;
+    for (size_t i = 0; i != kMemoryCategoryCount; ++i) {
+        before[i] = current(static_cast<MemoryCategory>(i));
+    }
+    const size_t rays = before[static_cast<size_t>(MemoryCategory::kRays)];
+    const size_t framebuffers = before[static_cast<size_t>(MemoryCategory::kFramebuffers)];
+    const size_t images = before[static_cast<size_t>(MemoryCategory::kImages)];
+
+    {
+        TrackedBytes bytes(MemoryCategory::kRays);
+        bytes.Set(1000);
+        auto copy = bytes;
+        REQUIRE(current(MemoryCategory::kRays) == rays + 2000);
+        auto moved = std::move(copy);
+        bytes.Set(10);
+        REQUIRE(current(MemoryCategory::kRays) == rays + 1010);
+    }
+    REQUIRE(current(MemoryCategory::kRays) == rays);
+
+    CameraOptions camera_opts(320, 240, M_PI / 3);
+    camera_opts.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    camera_opts.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    std::ostringstream report;
+    RenderOptions render_opts{4};
+    render_opts.memory_report = &report;
+    std::array<size_t, kMemoryCategoryCount> loaded;
+    accounting.ResetPeaks();
+    {
+        auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+        for (size_t i = 0; i != kMemoryCategoryCount; ++i) {
+            loaded[i] = current(static_cast<MemoryCategory>(i)) - before[i];
+        }
+        const auto estimate =
+            EstimateRenderMemory(scene.GetTriangleCount(), scene.GetSphereObjects().size(),
+                                 scene.GetMaterials().Size(), camera_opts);
+        for (auto category : {MemoryCategory::kObjects, MemoryCategory::kSpheres,
+                              MemoryCategory::kAcceleration}) {
+            const size_t i = static_cast<size_t>(category);
+            INFO(GetMemoryCategoryName(category) << " estimate " << estimate[i] << " loaded "
+                                                 << loaded[i]);
+            REQUIRE(loaded[i] >= estimate[i] / 2);
+            REQUIRE(loaded[i] <= 2 * estimate[i]);
+        }
+        REQUIRE(loaded[static_cast<size_t>(MemoryCategory::kMaterials)] >=
+                scene.GetMaterials().Size() * sizeof(Material));
+
+        auto image = Render(scene, camera_opts, render_opts);
+        const size_t pixels = 320 * 240;
+        REQUIRE(accounting.Get(MemoryCategory::kFramebuffers).peak >=
+                framebuffers + 3 * pixels * sizeof(float));
+        REQUIRE(current(MemoryCategory::kImages) >= images + 4 * pixels);
+        REQUIRE(accounting.Total().peak >= accounting.Total().current);
+
+        auto gbuffer = BuildGBuffer(scene, camera_opts);
+        REQUIRE(current(MemoryCategory::kRays) >= rays + pixels * sizeof(Ray));
+    }
+    for (size_t i = 0; i != kMemoryCategoryCount; ++i) {
+        INFO(GetMemoryCategoryName(static_cast<MemoryCategory>(i)));
+        REQUIRE(current(static_cast<MemoryCategory>(i)) == before[i]);
+    }
+    REQUIRE(report.str().find("framebuffers") != std::string::npos);
+    REQUIRE(report.str().find("total") != std::string::npos);
+}
+
+TEST_CASE("Radiance buffer", "[raytracer]") {
+    CameraOptions camera_opts(640, 480, M_PI / 3);
+    camera_opts.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    camera_opts.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    RenderOptions render_opts{4};
+    auto radiance = RenderRadiance(kBasePath + "tests/box/cube.obj", camera_opts, render_opts);
+
+    const auto path = (std::filesystem::temp_directory_path() / "raytracer_box.pfm").string();
+    WritePfm(radiance, path);
+    auto stored = ReadPfm(path);
+    std::filesystem::remove(path);
+    REQUIRE(stored.Width() == 640);
+    REQUIRE(stored.Height() == 480);
+    REQUIRE(stored.Data() == radiance.Data());
+    Compare(ToneMap(stored), Image(kBasePath + "tests/box/cube.png"));
+
+    // The same pixel written in the other byte order.
+    const float value = 0.25f;
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    bits = __builtin_bswap32(bits);
+    const std::string swapped(reinterpret_cast<const char*>(&bits), sizeof(bits));
+    std::ofstream(path, std::ios::binary)
+        << (kLittleEndianHost ? "PF\n1 1\n1.0\n" : "PF\n1 1\n-1.0\n") << swapped << swapped
+        << swapped;
+    REQUIRE(ReadPfm(path).Data() == std::vector<float>{value, value, value});
+    std::filesystem::remove(path);
+
+    auto brighter = ToneMap(stored, {2., MaxChannel(stored)});
+    auto darker = ToneMap(stored, {0.5, MaxChannel(stored)});
+    REQUIRE(brighter.GetPixel(240, 320).r > darker.GetPixel(240, 320).r);
+}
+
+TEST_CASE("G-buffer reshading", "[raytracer]") {
+    CameraOptions camera_opts(640, 480, M_PI / 3);
+    camera_opts.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    camera_opts.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    RenderOptions render_opts{4};
+    auto scene = ReadScene(kBasePath + "tests/box/cube.obj");
+    const auto gbuffer = BuildGBuffer(scene, camera_opts);
+    Compare(ToneMap(Reshade(scene, gbuffer, render_opts)),
+            Image(kBasePath + "tests/box/cube.png"));
+
+    auto material = scene.GetMaterials().Get("rightSphere");
+    material.diffuse_color = {0.1, 0.8, 0.1};
+    material.albedo = {0.7, 0.3, 0};
+    scene.UpdateMaterial("rightSphere", material);
+    auto lights = scene.GetLights();
+    lights.pop_back();
+    scene.SetLights(lights);
+    REQUIRE(Reshade(scene, gbuffer, render_opts).Data() ==
+            RenderRadiance(scene, camera_opts, render_opts).Data());
+}
+
+TEST_CASE("Compressed geometry", "[raytracer]") {
+    CameraOptions camera_opts(500, 500);
+    camera_opts.look_from = std::array<double, 3>{100, 200, 150};
+    camera_opts.look_to = std::array<double, 3>{0.0, 100.0, 0.0};
+    RenderOptions render_opts{1};
+    auto scene = ReadScene(kBasePath + "tests/deer/CERF_Free.obj");
+    size_t plain_size = scene.GetObjects().capacity() * sizeof(Object);
+    scene.CompressGeometry();
+    scene.Commit();
+    REQUIRE(scene.GetObjects().empty());
+    REQUIRE(scene.GetCompressedMesh().ByteSize() * 4 <= plain_size);
+    REQUIRE_THROWS(scene.AddObject(Object{}));
+
+    auto image = ToneMap(RenderRadiance(scene, camera_opts, render_opts));
+    Compare(image, Image(kBasePath + "tests/deer/result.png"));
+}
+
+// Not run by default: ./test_raytracer "[benchmark]"
+TEST_CASE("Compressed geometry cost", "[.][benchmark]") {
+    CameraOptions camera_opts(500, 500);
+    camera_opts.look_from = std::array<double, 3>{100, 200, 150};
+    camera_opts.look_to = std::array<double, 3>{0.0, 100.0, 0.0};
+    RenderOptions render_opts{1};
+    auto scene = ReadScene(kBasePath + "tests/deer/CERF_Free.obj");
+    for (bool compressed : {false, true}) {
+        if (compressed) {
+            scene.CompressGeometry();
+            scene.Commit();
+        }
+        auto start = std::chrono::steady_clock::now();
+        RenderRadiance(scene, camera_opts, render_opts);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        WARN((compressed ? "compressed: " : "plain: ") << elapsed.count() << "s");
+    }
+}
+
+TEST_CASE("Out-of-core geometry", "[raytracer]") {
+    struct Case {
+        std::string obj;
+        std::string result;
+        CameraOptions camera_opts;
+        int depth;
+    };
+    CameraOptions box_camera(640, 480, M_PI / 3);
+    box_camera.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    box_camera.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    CameraOptions deer_camera(500, 500);
+    deer_camera.look_from = std::array<double, 3>{100, 200, 150};
+    deer_camera.look_to = std::array<double, 3>{0.0, 100.0, 0.0};
+    const auto path = (std::filesystem::temp_directory_path() / "raytracer_test.clusters").string();
+
+    for (const auto& c : {Case{"box/cube.obj", "box/cube.png", box_camera, 4},
+                          Case{"deer/CERF_Free.obj", "deer/result.png", deer_camera, 1}}) {
+        auto scene = ReadScene(kBasePath + "tests/" + c.obj);
+        ClusterConversionOptions conversion;
+        conversion.cluster_size = 64;
+        const auto scene_only = ConvertObjToClusterFile(kBasePath + "tests/" + c.obj, path,
+                                                        conversion);
+        // Room for a handful of clusters only.
+        const size_t budget = 4 * 64 * (sizeof(Object) + 2 * sizeof(Bvh::Node));
+        ClusterStore store(path, budget);
+        REQUIRE(store.GetTriangleCount() == scene.GetTriangleCount());
+        REQUIRE(store.GetClusters().size() == (scene.GetTriangleCount() + 63) / 64);
+
+        auto image =
+            ToneMap(RenderRadiance(store, scene_only, c.camera_opts, RenderOptions{c.depth}));
+        Compare(image, Image(kBasePath + "tests/" + c.result));
+        REQUIRE(store.MemoryUsage() <= budget);
+        REQUIRE(store.PageIns() >= store.GetClusters().size());
+
+        // Small batches hold less ray state than the primary rays of the frame alone.
+        auto& accounting = GetMemoryAccounting();
+        accounting.ResetPeaks();
+        const auto rays_before = accounting.Get(MemoryCategory::kRays).current;
+        image = ToneMap(
+            RenderRadiance(store, scene_only, c.camera_opts, RenderOptions{c.depth}, 4096));
+        Compare(image, Image(kBasePath + "tests/" + c.result));
+        const size_t pixels =
+            static_cast<size_t>(c.camera_opts.screen_width) * c.camera_opts.screen_height;
+        REQUIRE(accounting.Get(MemoryCategory::kRays).peak - rays_before < pixels * sizeof(Ray));
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Denoise", "[raytracer]") {
+    CameraOptions camera_opts(640, 480, M_PI / 3);
+    camera_opts.look_from = std::array<double, 3>{0.0, 0.7, 1.75};
+    camera_opts.look_to = std::array<double, 3>{0.0, 0.7, 0.0};
+    auto aovs = RenderAovs(kBasePath + "tests/box/cube.obj", camera_opts, RenderOptions{4},
+                           {Aov::kBeauty, Aov::kDepth, Aov::kNormal});
+    const auto clean = *aovs.radiance;
+
+    // Per-pixel noise of a render with a handful of samples.
+    std::mt19937 gen(42);
+    std::normal_distribution<float> noise(1, 0.5);
+    RadianceBuffer noisy = clean;
+    for (float& value : noisy.Data()) {
+        value *= std::max(0.f, noise(gen));
+    }
+    auto rms_error = [&clean](const RadianceBuffer& buffer) {
+        double sum = 0;
+        for (size_t i = 0; i != buffer.Data().size(); ++i) {
+            double diff = buffer.Data()[i] - clean.Data()[i];
+            sum += diff * diff;
+        }
+        return std::sqrt(sum / buffer.Data().size());
+    };
+
+    aovs.radiance = noisy;
+    auto denoised = Denoise(aovs);
+    REQUIRE(denoised.Width() == clean.Width());
+    REQUIRE(denoised.Height() == clean.Height());
+    REQUIRE(rms_error(denoised) * 5 < rms_error(noisy));
+    DenoiseOptions two_threads;
+    two_threads.threads = 2;
+    REQUIRE(Denoise(aovs, two_threads).Data() == denoised.Data());
+
+    // A flat frame stays flat.
+    RadianceBuffer flat(16, 8);
+    std::fill(flat.Data().begin(), flat.Data().end(), 0.25f);
+    auto filtered =
+        Denoise(flat, std::vector<double>(16 * 8, 1), std::vector<Vector>(16 * 8, {0, 0, 1}));
+    for (float value : filtered.Data()) {
+        REQUIRE(value == Approx(0.25f));
+    }
+    REQUIRE_THROWS(Denoise(flat, {}, {}));
+    REQUIRE_THROWS(Denoise(RenderAovs(kBasePath + "tests/box/cube.obj", camera_opts,
+                                      RenderOptions{4}, {Aov::kBeauty})));
+}
+
+TEST_CASE("Image diff", "[raytracer]") {
+    Image expected(kBasePath + "tests/deer/result.png");
+    Image actual(kBasePath + "tests/deer/result.png");
+    auto same = DiffImages(actual, expected);
+    REQUIRE(same.max_distance == 0);
+    REQUIRE(same.mismatches == 0);
+    REQUIRE(same.psnr == std::numeric_limits<double>::infinity());
+
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<int> coord(0, 499);
+    std::uniform_int_distribution<int> delta(-3, 3);
+    for (int i = 0; i != 5000; ++i) {
+        int x = coord(gen);
+        int y = coord(gen);
+        auto pixel = actual.GetPixel(y, x);
+        pixel.r = std::clamp(pixel.r + delta(gen), 0, 255);
+        pixel.b = std::clamp(pixel.b + delta(gen), 0, 255);
+        actual.SetPixel(pixel, x, y);
+    }
+    actual.SetPixel({255, 255, 255}, 10, 20);
+    expected.SetPixel({0, 0, 0}, 10, 20);
+
+    double max = 0;
+    double sum = 0;
+    double squares = 0;
+    size_t mismatches = 0;
+    for (int y = 0; y != expected.Height(); ++y) {
+        for (int x = 0; x != expected.Width(); ++x) {
+            double distance = PixelDistance(actual.GetPixel(y, x), expected.GetPixel(y, x));
+            max = std::max(max, distance);
+            sum += distance;
+            squares += distance * distance;
+            mismatches += distance >= 2;
+        }
+    }
+    const double pixels = 500 * 500;
+    ImageDiffOptions options;
+    for (size_t threads : {1, 3}) {
+        options.threads = threads;
+        Image heatmap(0, 0);
+        auto diff = DiffImages(actual, expected, options, &heatmap);
+        REQUIRE(diff.max_distance == Approx(max));
+        REQUIRE(diff.mean_distance == Approx(sum / pixels));
+        REQUIRE(diff.mse == Approx(squares / (3 * pixels)));
+        REQUIRE(diff.psnr == Approx(10 * std::log10(255 * 255 / diff.mse)));
+        REQUIRE(diff.mismatches == mismatches);
+        REQUIRE(diff.Similarity() == Approx(1 - mismatches / pixels));
+        REQUIRE(heatmap.GetPixel(20, 10) == RGB{255, 255, 255});
+        REQUIRE(heatmap.GetPixel(0, 0) == RGB{0, 0, 0});
+    }
+    REQUIRE_THROWS(DiffImages(actual, Image(4, 4)));
+}
+
+// Left half red, right half blue.
+std::string WriteTestTexture(const std::filesystem::path& dir) {
+    Image texture(256, 128);
+    for (int y = 0; y != texture.Height(); ++y) {
+        for (int x = 0; x != texture.Width(); ++x) {
+            texture.SetPixel(x < 128 ? RGB{255, 0, 0} : RGB{0, 0, 255}, x, y);
+        }
+    }
+    auto path = (dir / "raytracer_test_texture.png").string();
+    texture.Write(path);
+    return path;
+}
+
+TEST_CASE("Texture cache", "[raytracer]") {
+    const auto dir = std::filesystem::temp_directory_path();
+    const auto path = WriteTestTexture(dir);
+    TextureCacheOptions options;
+    options.tile_size = 16;
+    options.memory_budget = 4 * 16 * 16 * 4;
+    options.directory = (dir / "raytracer_test_tiles").string();
+    std::filesystem::remove_all(options.directory);
+    TextureCache cache(options);
+
+    auto red = cache.Sample(path, 0.25, 0.5);
+    auto blue = cache.Sample(path, 0.75, 0.5);
+    REQUIRE(red[0] == Approx(1));
+    REQUIRE(red[2] == Approx(0));
+    REQUIRE(blue[0] == Approx(0));
+    REQUIRE(blue[2] == Approx(1));
+    // The coarsest level averages both halves.
+    auto average = cache.Sample(path, 0.3, 0.3, 1);
+    REQUIRE(average[0] == Approx(average[2]));
+    REQUIRE(average[0] > 0.1);
+    REQUIRE(average[0] < 0.5);
+
+    std::vector<Vector> expected;
+    for (int i = 0; i != 400; ++i) {
+        expected.push_back(cache.Sample(path, i * 0.013, i * 0.029));
+    }
+    REQUIRE(cache.MemoryUsage() <= options.memory_budget);
+    REQUIRE(cache.TileLoads() > 4);
+
+    std::vector<std::thread> threads;
+    std::vector<int> mismatches(4);
+    for (int t = 0; t != 4; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = t; i < 400; i += 2) {
+                auto value = cache.Sample(path, i * 0.013, i * 0.029);
+                mismatches[t] += Length(value, expected[i]) != 0;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    REQUIRE(mismatches == std::vector<int>(4));
+    REQUIRE(cache.MemoryUsage() <= options.memory_budget);
+
+    // Converted row by row, with partial tiles at the edges.
+    Image noise(37, 23);
+    std::mt19937 rng(3);
+    for (int y = 0; y != noise.Height(); ++y) {
+        for (int x = 0; x != noise.Width(); ++x) {
+            noise.SetPixel({static_cast<int>(rng() % 256), static_cast<int>(rng() % 256),
+                            static_cast<int>(rng() % 256)},
+                           x, y);
+        }
+    }
+    const auto noise_path = (dir / "raytracer_test_noise.png").string();
+    noise.Write(noise_path);
+    options.tile_size = 8;
+    TextureCache noise_cache(options);
+    for (int y = 0; y != noise.Height(); ++y) {
+        for (int x = 0; x != noise.Width(); ++x) {
+            auto value = noise_cache.Sample(noise_path, (x + 0.5) / noise.Width(),
+                                            1 - (y + 0.5) / noise.Height());
+            REQUIRE(value[1] == Approx(std::pow(noise.GetPixel(y, x).g / 255.0, 2.2)));
+        }
+    }
+
+    std::filesystem::remove_all(options.directory);
+    std::filesystem::remove(path);
+    std::filesystem::remove(noise_path);
+}
+
+TEST_CASE("Diffuse texture", "[raytracer]") {
+    const auto dir = std::filesystem::temp_directory_path();
+    const auto texture = WriteTestTexture(dir);
+    const auto obj = (dir / "raytracer_test_textured.obj").string();
+    {
+        std::ofstream mtl(dir / "raytracer_test_textured.mtl");
+        mtl << "newmtl textured\nKd 1 1 1\nKs 0 0 0\nNs 1\nNi 1\n"
+            << "map_Kd raytracer_test_texture.png\n";
+        std::ofstream out(obj);
+        out << "mtllib raytracer_test_textured.mtl\nusemtl textured\n"
+            << "v -1 -1 0\nv 1 -1 0\nv 1 1 0\nv -1 1 0\n"
+            << "vt 0 0\nvt 1 0\nvt 1 1\nvt 0 1\n"
+            << "f 1/1 2/2 3/3 4/4\nP 0 0 1 1 1 1\n";
+    }
+    CameraOptions camera_opts(64, 64);
+    camera_opts.look_from = std::array<double, 3>{0, 0, 2};
+    camera_opts.look_to = std::array<double, 3>{0, 0, 0};
+    auto image = Render(obj, camera_opts, RenderOptions{1});
+    auto left = image.GetPixel(32, 20);
+    auto right = image.GetPixel(32, 44);
+    REQUIRE(left.r > 100);
+    REQUIRE(left.b == 0);
+    REQUIRE(right.b > 100);
+    REQUIRE(right.r == 0);
+
+    std::filesystem::remove(obj);
+    std::filesystem::remove(dir / "raytracer_test_textured.mtl");
+    std::filesystem::remove(texture);
+}
@@ -0,0 +1,435 @@
+#pragma once
+
+#include <image.h>
+#include <vector.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct TextureCacheOptions {
+    // Upper bound on the texels held in memory, counted in tile bytes.
+    size_t memory_budget = size_t{256} << 20;
+    int tile_size = 64;
+    // Where converted textures are kept between runs; by default a directory under the
+    // system temporary one.
+    std::string directory;
+};
+
+// Serves texels of PNG/JPEG textures out of a bounded set of resident tiles. The first use of
+// an image converts it into a tiled mip-map file, decoding it once a band of rows at a time so
+// that not even the conversion holds the whole image; afterwards only the tiles that lookups
+// touch are read back, and the least recently used ones are evicted once the budget is
+// exceeded. Every method may be called from several threads at once.
+class TextureCache {
+public:
+    using Tile = std::vector<uint8_t>;
+
+    explicit TextureCache(const TextureCacheOptions& options = {}) : options_(options) {
+        if (options_.tile_size < 1) {
+            throw std::invalid_argument("Texture tiles need a positive size");
+        }
+        if (options_.directory.empty()) {
+            options_.directory =
+                (std::filesystem::temp_directory_path() / "raytracer-textures").string();
+        }
+    }
+
+    TextureCache(const TextureCache&) = delete;
+    TextureCache& operator=(const TextureCache&) = delete;
+
+    ~TextureCache() {
+        for (auto& [path, texture] : textures_) {
+            if (texture->fd >= 0) {
+                close(texture->fd);
+            }
+        }
+    }
+
+    // Bilinearly filtered color at (u, v) with repeat wrapping and v pointing up, as in OBJ
+    // files. footprint is the width of the sampled area in texture coordinates and selects
+    // the mip level. Colors are converted from sRGB to linear.
+    Vector Sample(const std::string& path, double u, double v, double footprint = 0) {
+        const auto& texture = GetTexture(path);
+        const auto& base = texture.levels[0];
+        double texels = footprint * std::max(base.width, base.height);
+        int level = std::clamp(static_cast<int>(std::log2(std::max(texels, 1.0))), 0,
+                               static_cast<int>(texture.levels.size()) - 1);
+        const auto& info = texture.levels[level];
+        double x = (u - std::floor(u)) * info.width - 0.5;
+        double y = (1 - (v - std::floor(v))) * info.height - 0.5;
+        int x0 = std::floor(x);
+        int y0 = std::floor(y);
+        double fx = x - x0;
+        double fy = y - y0;
+        Vector result{0, 0, 0};
+        for (int dy = 0; dy != 2; ++dy) {
+            for (int dx = 0; dx != 2; ++dx) {
+                double weight = (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy);
+                if (weight > 0) {
+                    result = result + weight * Fetch(texture, level, x0 + dx, y0 + dy);
+                }
+            }
+        }
+        return result;
+    }
+
+    size_t MemoryUsage() const {
+        std::lock_guard lock(tiles_mutex_);
+        return memory_;
+    }
+
+    // Tiles read from converted files so far, including ones read again after eviction.
+    size_t TileLoads() const {
+        return tile_loads_;
+    }
+
+private:
+    struct Level {
+        int width;
+        int height;
+        int tiles_x;
+        int tiles_y;
+        uint64_t offset;
+    };
+
+    struct Texture {
+        std::once_flag converted;
+        int fd = -1;
+        std::vector<Level> levels;
+    };
+
+    struct TileKey {
+        const Texture* texture;
+        int level;
+        int x;
+        int y;
+
+        bool operator==(const TileKey& rhs) const {
+            return texture == rhs.texture && level == rhs.level && x == rhs.x && y == rhs.y;
+        }
+    };
+
+    struct TileKeyHash {
+        size_t operator()(const TileKey& key) const {
+            size_t hash = std::hash<const void*>()(key.texture);
+            for (int value : {key.level, key.x, key.y}) {
+                hash = hash * 1000003 ^ std::hash<int>()(value);
+            }
+            return hash;
+        }
+    };
+
+    using LruList = std::list<std::pair<TileKey, std::shared_ptr<const Tile>>>;
+
+    static constexpr char kMagic[8] = {'R', 'T', 'T', 'I', 'L', 'E', 'S', '1'};
+
+    size_t TileBytes() const {
+        return static_cast<size_t>(options_.tile_size) * options_.tile_size * 4;
+    }
+
+    const Texture& GetTexture(const std::string& path) {
+        Texture* texture;
+        {
+            std::lock_guard lock(textures_mutex_);
+            auto& slot = textures_[path];
+            if (!slot) {
+                slot = std::make_unique<Texture>();
+            }
+            texture = slot.get();
+        }
+        std::call_once(texture->converted, [&] { Open(path, *texture); });
+        return *texture;
+    }
+
+    std::vector<Level> ComputeLevels(int width, int height) const {
+        std::vector<Level> levels;
+        uint64_t offset = sizeof(kMagic) + 3 * sizeof(int32_t);
+        while (true) {
+            int tiles_x = (width + options_.tile_size - 1) / options_.tile_size;
+            int tiles_y = (height + options_.tile_size - 1) / options_.tile_size;
+            levels.push_back({width, height, tiles_x, tiles_y, offset});
+            offset += static_cast<uint64_t>(tiles_x) * tiles_y * TileBytes();
+            if (width == 1 && height == 1) {
+                break;
+            }
+            width = std::max(1, width / 2);
+            height = std::max(1, height / 2);
+        }
+        return levels;
+    }
+
+    // Opens the converted file of a texture, converting the image first if there is no file
+    // for its current version.
+    void Open(const std::string& path, Texture& texture) {
+        auto source = std::filesystem::path(path);
+        auto stamp = std::filesystem::last_write_time(source).time_since_epoch().count();
+        auto key = std::filesystem::absolute(source).string() + "@" + std::to_string(stamp) +
+                   "@" + std::to_string(options_.tile_size);
+        std::filesystem::create_directories(options_.directory);
+        auto tiled = std::filesystem::path(options_.directory) /
+                     (std::to_string(std::hash<std::string>()(key)) + ".tiles");
+
+        int32_t header[3];
+        int fd = open(tiled.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            char magic[sizeof(kMagic)];
+            bool ok = pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+                      std::memcmp(magic, kMagic, sizeof(magic)) == 0 &&
+                      pread(fd, header, sizeof(header), sizeof(magic)) == sizeof(header) &&
+                      header[2] == options_.tile_size && header[0] > 0 && header[1] > 0;
+            if (!ok) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        if (fd < 0) {
+            Convert(path, tiled);
+            fd = open(tiled.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0 || pread(fd, header, sizeof(header), sizeof(kMagic)) != sizeof(header)) {
+                throw std::runtime_error("Can't read converted texture " + tiled.string());
+            }
+        }
+        texture.fd = fd;
+        texture.levels = ComputeLevels(header[0], header[1]);
+    }
+
+    // Writes all mip levels of an image as tiles of RGBA bytes, padded at the right and bottom
+    // edges by repeating the last texel. The file is renamed into place when complete, so
+    // concurrent renders never see a partial one.
+    void Convert(const std::string& path, const std::filesystem::path& tiled) const {
+        ImageRowReader reader(path);
+        if (reader.Width() <= 0 || reader.Height() <= 0) {
+            throw std::runtime_error("Empty texture " + path);
+        }
+        auto temporary = tiled;
+        temporary += ".tmp" + std::to_string(getpid()) + "." +
+                      std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        FILE* fp = fopen(temporary.c_str(), "wb");
+        if (!fp) {
+            throw std::runtime_error("Can't write converted texture " + temporary.string());
+        }
+        int32_t header[3] = {reader.Width(), reader.Height(), options_.tile_size};
+        bool ok = fwrite(kMagic, 1, sizeof(kMagic), fp) == sizeof(kMagic) &&
+                  fwrite(header, sizeof(int32_t), 3, fp) == 3;
+        MipWriter writer(ComputeLevels(reader.Width(), reader.Height()), options_.tile_size, fp);
+        for (int y = 0; ok && y != reader.Height(); ++y) {
+            ok = writer.AddRow(0, reader.NextRow());
+        }
+        if (fclose(fp) != 0 || !ok) {
+            std::filesystem::remove(temporary);
+            throw std::runtime_error("Can't write converted texture " + temporary.string());
+        }
+        std::filesystem::rename(temporary, tiled);
+    }
+
+    // Builds the tiles of every mip level from the rows of the base level as they are decoded.
+    // Each level keeps one band of tile_size rows, written out as a row of tiles when full, and
+    // the even row waiting for its partner in the 2x2 box filter of the next level, so memory
+    // stays around two bands of the base level whatever the height of the image.
+    class MipWriter {
+    public:
+        MipWriter(std::vector<Level> levels, int tile_size, FILE* fp)
+            : levels_(std::move(levels)), tile_size_(tile_size), fp_(fp), bands_(levels_.size()) {
+            for (size_t level = 0; level != levels_.size(); ++level) {
+                const size_t row_bytes = static_cast<size_t>(levels_[level].width) * 4;
+                auto& band = bands_[level];
+                band.rows.resize(row_bytes * tile_size_);
+                band.pending.resize(row_bytes);
+                if (level + 1 != levels_.size()) {
+                    band.downsampled.resize(static_cast<size_t>(levels_[level + 1].width) * 4);
+                }
+            }
+        }
+
+        // Takes the next row of a level as RGBA bytes; false when writing failed.
+        bool AddRow(size_t level, const uint8_t* row) {
+            const auto& info = levels_[level];
+            auto& band = bands_[level];
+            const size_t row_bytes = static_cast<size_t>(info.width) * 4;
+            const int y = band.next_row++;
+            std::memcpy(&band.rows[row_bytes * band.filled++], row, row_bytes);
+            if ((band.filled == tile_size_ || y == info.height - 1) && !WriteBand(level, y)) {
+                return false;
+            }
+            if (level + 1 == levels_.size()) {
+                return true;
+            }
+            // Row k of the next level averages rows 2k and 2k + 1, or row 0 with itself when
+            // this level has one row; an odd last row is left out.
+            if (info.height == 1) {
+                return AddRow(level + 1, Downsample(level, row, row));
+            }
+            if (y % 2 == 0) {
+                std::memcpy(band.pending.data(), row, row_bytes);
+                return true;
+            }
+            return AddRow(level + 1, Downsample(level, band.pending.data(), row));
+        }
+
+    private:
+        struct Band {
+            std::vector<uint8_t> rows;
+            int filled = 0;
+            int next_row = 0;
+            std::vector<uint8_t> pending;
+            // Row of the next level being added.
+            std::vector<uint8_t> downsampled;
+        };
+
+        // 2x2 box filter; an odd last column is averaged with itself.
+        const uint8_t* Downsample(size_t level, const uint8_t* top, const uint8_t* bottom) {
+            const int width = levels_[level].width;
+            const int next_width = levels_[level + 1].width;
+            auto& out = bands_[level].downsampled;
+            for (int x = 0; x != next_width; ++x) {
+                for (int c = 0; c != 4; ++c) {
+                    int sum = 0;
+                    for (int dx = 0; dx != 2; ++dx) {
+                        int sx = std::min(2 * x + dx, width - 1);
+                        sum += top[sx * 4 + c] + bottom[sx * 4 + c];
+                    }
+                    out[x * 4 + c] = (sum + 2) / 4;
+                }
+            }
+            return out.data();
+        }
+
+        // Writes the row of tiles that ends with row last_row of the level.
+        bool WriteBand(size_t level, int last_row) {
+            const auto& info = levels_[level];
+            auto& band = bands_[level];
+            const int size = tile_size_;
+            const size_t tile_bytes = static_cast<size_t>(size) * size * 4;
+            const size_t ty = last_row / size;
+            const uint64_t offset = info.offset + ty * info.tiles_x * tile_bytes;
+            if (fseeko(fp_, offset, SEEK_SET) != 0) {
+                return false;
+            }
+            Tile tile(tile_bytes);
+            for (int tx = 0; tx != info.tiles_x; ++tx) {
+                for (int y = 0; y != size; ++y) {
+                    const uint8_t* row =
+                        &band.rows[static_cast<size_t>(std::min(y, band.filled - 1)) *
+                                   info.width * 4];
+                    for (int x = 0; x != size; ++x) {
+                        int sx = std::min(tx * size + x, info.width - 1);
+                        std::memcpy(&tile[(static_cast<size_t>(y) * size + x) * 4],
+                                    &row[sx * 4], 4);
+                    }
+                }
+                if (fwrite(tile.data(), 1, tile.size(), fp_) != tile.size()) {
+                    return false;
+                }
+            }
+            band.filled = 0;
+            return true;
+        }
+
+        std::vector<Level> levels_;
+        int tile_size_;
+        FILE* fp_;
+        std::vector<Band> bands_;
+    };
+
+    Vector Fetch(const Texture& texture, int level, int x, int y) {
+        const auto& info = texture.levels[level];
+        x = ((x % info.width) + info.width) % info.width;
+        y = ((y % info.height) + info.height) % info.height;
+        const int size = options_.tile_size;
+        auto tile = GetTile(texture, level, x / size, y / size);
+        const uint8_t* px = &(*tile)[(static_cast<size_t>(y % size) * size + x % size) * 4];
+        return {SrgbToLinear(px[0]), SrgbToLinear(px[1]), SrgbToLinear(px[2])};
+    }
+
+    static double SrgbToLinear(uint8_t value) {
+        static const auto kTable = [] {
+            std::array<double, 256> table;
+            for (int i = 0; i != 256; ++i) {
+                table[i] = std::pow(i / 255.0, 2.2);
+            }
+            return table;
+        }();
+        return kTable[value];
+    }
+
+    // Resident tile, read from disk outside the lock on a miss. Two threads missing the same
+    // tile may both read it; the first one to finish publishes it.
+    std::shared_ptr<const Tile> GetTile(const Texture& texture, int level, int x, int y) {
+        TileKey key{&texture, level, x, y};
+        {
+            std::lock_guard lock(tiles_mutex_);
+            auto it = tiles_.find(key);
+            if (it != tiles_.end()) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                return it->second->second;
+            }
+        }
+
+        const auto& info = texture.levels[level];
+        auto tile = std::make_shared<Tile>(TileBytes());
+        uint64_t offset = info.offset + (static_cast<uint64_t>(y) * info.tiles_x + x) * TileBytes();
+        size_t done = 0;
+        while (done != tile->size()) {
+            ssize_t got = pread(texture.fd, tile->data() + done, tile->size() - done, offset + done);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                throw std::runtime_error("Truncated converted texture");
+            }
+            done += got;
+        }
+        ++tile_loads_;
+
+        std::lock_guard lock(tiles_mutex_);
+        auto [it, inserted] = tiles_.emplace(key, lru_.end());
+        if (!inserted) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return it->second->second;
+        }
+        lru_.emplace_front(key, tile);
+        it->second = lru_.begin();
+        memory_ += tile->size();
+        // Tiles still used by a lookup stay alive through their shared_ptr after eviction.
+        while (memory_ > options_.memory_budget && lru_.size() > 1) {
+            memory_ -= lru_.back().second->size();
+            tiles_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+        return tile;
+    }
+
+    TextureCacheOptions options_;
+    std::mutex textures_mutex_;
+    std::unordered_map<std::string, std::unique_ptr<Texture>> textures_;
+    mutable std::mutex tiles_mutex_;
+    LruList lru_;
+    std::unordered_map<TileKey, LruList::iterator, TileKeyHash> tiles_;
+    size_t memory_ = 0;
+    std::atomic<size_t> tile_loads_ = 0;
+};
+
+// Cache used by renders that don't bring their own.
+inline TextureCache& DefaultTextureCache() {
+    static TextureCache cache;
+    return cache;
+}
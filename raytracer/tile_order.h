@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Screen rectangle [x_begin, x_end) x [y_begin, y_end).
+struct Tile {
+    int x_begin;
+    int y_begin;
+    int x_end;
+    int y_end;
+
+    int Width() const {
+        return x_end - x_begin;
+    }
+
+    int Height() const {
+        return y_end - y_begin;
+    }
+};
+
+constexpr int kTileSize = 16;
+
+// Interleaves the low 16 bits of x and y: x takes the even bits, y the odd ones.
+inline uint32_t MortonCode(uint32_t x, uint32_t y) {
+    auto spread = [](uint32_t v) {
+        v &= 0x0000ffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Splits a screen region into tile_size squares (clipped at its borders) ordered along a
+// Z-order curve, so that consecutive tiles stay spatially close. The order depends only on
+// the region, which keeps any traversal built on it deterministic.
+inline std::vector<Tile> MakeTiles(const Tile& region, int tile_size = kTileSize) {
+    int tiles_x = (region.Width() + tile_size - 1) / tile_size;
+    int tiles_y = (region.Height() + tile_size - 1) / tile_size;
+    std::vector<std::pair<uint32_t, Tile>> keyed;
+    keyed.reserve(static_cast<size_t>(std::max(tiles_x, 0)) * std::max(tiles_y, 0));
+    for (int ty = 0; ty < tiles_y; ++ty) {
+        for (int tx = 0; tx < tiles_x; ++tx) {
+            int x = region.x_begin + tx * tile_size;
+            int y = region.y_begin + ty * tile_size;
+            Tile tile{x, y, std::min(region.x_end, x + tile_size),
+                      std::min(region.y_end, y + tile_size)};
+            keyed.emplace_back(MortonCode(tx, ty), tile);
+        }
+    }
+    std::sort(keyed.begin(), keyed.end(),
+              [](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; });
+    std::vector<Tile> tiles;
+    tiles.reserve(keyed.size());
+    for (const auto& [code, tile] : keyed) {
+        tiles.push_back(tile);
+    }
+    return tiles;
+}
+
+inline std::vector<Tile> MakeTiles(int width, int height, int tile_size = kTileSize) {
+    return MakeTiles(Tile{0, 0, width, height}, tile_size);
+}
+
+// Calls f(x, y) for every pixel, finishing one tile (row by row) before moving to the next.
+template <class F>
+void ForEachPixel(const std::vector<Tile>& tiles, F&& f) {
+    for (const auto& tile : tiles) {
+        for (int y = tile.y_begin; y != tile.y_end; ++y) {
+            for (int x = tile.x_begin; x != tile.x_end; ++x) {
+                f(x, y);
+            }
+        }
+    }
+}